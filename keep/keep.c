@@ -1,510 +1,1064 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <dirent.h>
-#include <sys/types.h>
-#include <sys/stat.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
-#define MAX_FILE_PATH_LENGTH 256
-
-void keepInit();
-void keepTrack(const char* path);
-void keepUntrack(const char* path);
-void keepVersions();
-void keepStore(const char* note);
-void keepRestore(int version);
-
-int readLatestVersion();
-int checkModifiedFiles(int latestVersion);
-int copyTrackingFiles(const char* versionDir);
-int updateLatestVersion(int latestVersion);
-int storeNoteForVersion(const char* versionDir, const char* note);
-int copyFilesToTarget(const char* versionDir, const char* targetDir);
-int removeNonTrackingFiles();
-int copyFileToTarget(const char* source, const char* target);
+#include "keep.h"
+
+#define MAX_NOTE_LENGTH 256
+#define MAX_REQUEST_LENGTH 65536
+#define MAX_REQUEST_ARGS 64
+#define SERVE_SOCKET_PATH ".keep/serve.sock"
+
+volatile sig_atomic_t serving = 1;
+
+// The streams a command reads from and writes to: the caller's own when run
+// directly, or the client's descriptors when run by 'keep serve'.
+struct commandIo {
+    int inFd;
+    int outFd;
+    FILE* out;
+    FILE* err;
+};
+
+int runCommand(keep_ctx* ctx, int argc, char* argv[], struct commandIo* io);
+int keepInit(keep_ctx* ctx, struct commandIo* io);
+int keepTrack(keep_ctx* ctx, struct commandIo* io, const char* path);
+int keepUntrack(keep_ctx* ctx, struct commandIo* io, const char* path);
+int keepVersions(keep_ctx* ctx, struct commandIo* io);
+int keepStatus(keep_ctx* ctx, struct commandIo* io);
+int keepStore(keep_ctx* ctx, struct commandIo* io, const char* note);
+int keepRestore(keep_ctx* ctx, struct commandIo* io, int version, const char* toDir, int swap);
+int keepExport(keep_ctx* ctx, struct commandIo* io, int version);
+int keepImport(keep_ctx* ctx, struct commandIo* io);
+int keepLs(keep_ctx* ctx, struct commandIo* io, int version);
+int keepCat(keep_ctx* ctx, struct commandIo* io, int version, const char* path);
+int keepLog(keep_ctx* ctx, struct commandIo* io, const char* path);
+int keepGrep(keep_ctx* ctx, struct commandIo* io, int argc, char* argv[]);
+int keepDiff(keep_ctx* ctx, struct commandIo* io, int argc, char* argv[]);
+int keepFsck(keep_ctx* ctx, struct commandIo* io, int argc, char* argv[]);
+int keepStats(keep_ctx* ctx, struct commandIo* io, int argc, char* argv[]);
+int keepTier(keep_ctx* ctx, struct commandIo* io, int argc, char* argv[]);
+int keepAuto(keep_ctx* ctx, struct commandIo* io, int argc, char* argv[]);
+int keepBisect(keep_ctx* ctx, struct commandIo* io, int argc, char* argv[]);
+int keepMirror(keep_ctx* ctx, struct commandIo* io, const char* dir, int push);
+int keepAlternate(keep_ctx* ctx, struct commandIo* io, const char* dir);
+int keepServe(keep_ctx* ctx);
+
+void stopServing(int signal);
+int serveRequest(keep_ctx* ctx, int connection);
+int sendRequest(int argc, char* argv[], int* status);
+int parseIoOption(keep_ctx* ctx, int* argc, char* argv[], FILE* out);
+int parseSize(const char* text, long long* size);
+int reportError(keep_ctx* ctx, FILE* stream);
+int printListEntry(const char* path, long mtime, void* arg);
+int printLogEntry(int version, int removed, void* arg);
+int printGrepMatch(int version, const char* path, long line, const char* text, void* arg);
+int printDiffEntry(const struct keep_diff_entry* entry, void* arg);
+void printFsckProblem(const char* problem, void* arg);
+int printAutoStore(int error, const struct keep_store_result* result, const char* note, void* arg);
+int printBisectStep(int version, enum keep_bisect_verdict verdict, void* arg);
+int parseVersionRange(const char* text, int* first, int* last);
+int parseTraceOptions(int* argc, char* argv[], int* tracing);
 
 int main(int argc, char* argv[]) {
+    int tracing = 0;
+    if (parseTraceOptions(&argc, argv, &tracing) != 0) {
+        return 1;
+    }
     if (argc < 3) {
         printf("Error: No command specified.\n");
         return 1;
     }
-    if (strcmp(argv[1], "keep") == 0) {
-        if (strcmp(argv[2], "init") == 0) {
-            keepInit();
-        } else if (strcmp(argv[2], "track") == 0) {
-            if (argc < 4) {
-                printf("Error: No file or directory specified.\n");
-                return 1;
-            }
-            keepTrack(argv[3]);
-        } else if (strcmp(argv[2], "untrack") == 0) {
-            if (argc < 4) {
-                printf("Error: No file or directory specified.\n");
-                return 1;
-            }
-            keepUntrack(argv[3]);
-        } else if (strcmp(argv[2], "versions") == 0) {
-            keepVersions();
-        } else if (strcmp(argv[2], "store") == 0) {
-            if (argc < 4) {
-                printf("Error: No note specified.\n");
-                return 1;
+    if (strcmp(argv[1], "keep") != 0) {
+        printf("Error: Invalid command.\n");
+        return 1;
+    }
+
+    // Hand the command to a running 'keep serve' when there is one; traced
+    // runs stay local so the trace describes this process, and so do the
+    // long-running 'keep auto' and 'keep bisect', which runs commands.
+    int status;
+    if (!tracing && strcmp(argv[2], "serve") != 0 && strcmp(argv[2], "auto") != 0 &&
+        strcmp(argv[2], "bisect") != 0 && sendRequest(argc, argv, &status) == 0) {
+        return status;
+    }
+
+    keep_ctx* ctx = keep_open(".", NULL);
+    if (ctx == NULL) {
+        printf("Error: Failed to open current directory.\n");
+        return 1;
+    }
+
+    int result;
+    if (strcmp(argv[2], "serve") == 0) {
+        result = keepServe(ctx);
+    } else {
+        struct commandIo io = {STDIN_FILENO, STDOUT_FILENO, stdout, stderr};
+        result = runCommand(ctx, argc, argv, &io);
+    }
+
+    keep_close(ctx);
+    return result;
+}
+
+int runCommand(keep_ctx* ctx, int argc, char* argv[], struct commandIo* io) {
+    FILE* out = io->out;
+    int result = 0;
+
+    if (parseIoOption(ctx, &argc, argv, out) != 0) {
+        return 1;
+    }
+
+    if (strcmp(argv[2], "init") == 0) {
+        result = keepInit(ctx, io);
+    } else if (strcmp(argv[2], "track") == 0) {
+        if (argc < 4) {
+            fprintf(out, "Error: No file or directory specified.\n");
+            result = 1;
+        } else {
+            result = keepTrack(ctx, io, argv[3]);
+        }
+    } else if (strcmp(argv[2], "untrack") == 0) {
+        if (argc < 4) {
+            fprintf(out, "Error: No file or directory specified.\n");
+            result = 1;
+        } else {
+            result = keepUntrack(ctx, io, argv[3]);
+        }
+    } else if (strcmp(argv[2], "versions") == 0) {
+        result = keepVersions(ctx, io);
+    } else if (strcmp(argv[2], "status") == 0) {
+        result = keepStatus(ctx, io);
+    } else if (strcmp(argv[2], "store") == 0) {
+        if (argc < 4) {
+            fprintf(out, "Error: No note specified.\n");
+            result = 1;
+        } else {
+            result = keepStore(ctx, io, argv[3]);
+        }
+    } else if (strcmp(argv[2], "restore") == 0) {
+        if (argc < 4) {
+            fprintf(out, "Error: No version specified.\n");
+            result = 1;
+        } else {
+            const char* toDir = NULL;
+            int swap = 0;
+            for (int i = 4; i < argc && result == 0; i++) {
+                if (strcmp(argv[i], "--to") == 0 && i + 1 < argc) {
+                    toDir = argv[++i];
+                } else if (strcmp(argv[i], "--swap") == 0) {
+                    swap = 1;
+                } else {
+                    fprintf(out, "Error: Invalid restore option '%s'.\n", argv[i]);
+                    result = 1;
+                }
             }
-            keepStore(argv[3]);
-        } else if (strcmp(argv[2], "restore") == 0) {
-            if (argc < 4) {
-                printf("Error: No version specified.\n");
-                return 1;
+            if (result == 0) {
+                result = keepRestore(ctx, io, atoi(argv[3]), toDir, swap);
             }
-            int version = atoi(argv[3]);
-            keepRestore(version);
+        }
+    } else if (strcmp(argv[2], "export") == 0) {
+        if (argc < 4) {
+            fprintf(out, "Error: No version specified.\n");
+            result = 1;
         } else {
-            printf("Error: Invalid command.\n");
-            return 1;
+            result = keepExport(ctx, io, atoi(argv[3]));
+        }
+    } else if (strcmp(argv[2], "import") == 0) {
+        result = keepImport(ctx, io);
+    } else if (strcmp(argv[2], "push") == 0 || strcmp(argv[2], "pull") == 0) {
+        if (argc < 4) {
+            fprintf(out, "Error: No repository directory specified.\n");
+            result = 1;
+        } else {
+            result = keepMirror(ctx, io, argv[3], strcmp(argv[2], "push") == 0);
+        }
+    } else if (strcmp(argv[2], "log") == 0) {
+        if (argc < 4) {
+            fprintf(out, "Error: No file specified.\n");
+            result = 1;
+        } else {
+            result = keepLog(ctx, io, argv[3]);
+        }
+    } else if (strcmp(argv[2], "fsck") == 0) {
+        result = keepFsck(ctx, io, argc - 3, argv + 3);
+    } else if (strcmp(argv[2], "tier") == 0) {
+        result = keepTier(ctx, io, argc - 3, argv + 3);
+    } else if (strcmp(argv[2], "auto") == 0) {
+        result = keepAuto(ctx, io, argc - 3, argv + 3);
+    } else if (strcmp(argv[2], "bisect") == 0) {
+        result = keepBisect(ctx, io, argc - 3, argv + 3);
+    } else if (strcmp(argv[2], "stats") == 0) {
+        result = keepStats(ctx, io, argc - 3, argv + 3);
+    } else if (strcmp(argv[2], "diff") == 0) {
+        result = keepDiff(ctx, io, argc - 3, argv + 3);
+    } else if (strcmp(argv[2], "grep") == 0) {
+        result = keepGrep(ctx, io, argc - 3, argv + 3);
+    } else if (strcmp(argv[2], "alternate") == 0) {
+        if (argc < 4) {
+            fprintf(out, "Error: No repository directory specified.\n");
+            result = 1;
+        } else {
+            result = keepAlternate(ctx, io, argv[3]);
+        }
+    } else if (strcmp(argv[2], "ls") == 0) {
+        if (argc < 4) {
+            fprintf(out, "Error: No version specified.\n");
+            result = 1;
+        } else {
+            result = keepLs(ctx, io, atoi(argv[3]));
+        }
+    } else if (strcmp(argv[2], "cat") == 0) {
+        if (argc < 5) {
+            fprintf(out, "Error: No version or file specified.\n");
+            result = 1;
+        } else {
+            result = keepCat(ctx, io, atoi(argv[3]), argv[4]);
         }
     } else {
-        printf("Error: Invalid command.\n");
-        return 1;
+        fprintf(out, "Error: Invalid command.\n");
+        result = 1;
     }
 
-    return 0;
+    return result;
 }
 
-void keepInit() {
-    DIR* keepDir = opendir(".keep");
-    if (keepDir != NULL) {
-        printf("Error: .keep directory already exists.\n");
-        closedir(keepDir);
-        return;
+int keepInit(keep_ctx* ctx, struct commandIo* io) {
+    if (keep_init(ctx) != KEEP_OK) {
+        return reportError(ctx, io->out);
     }
 
-    if (mkdir(".keep", 0700) != 0) {
-        printf("Error: Failed to create .keep directory.\n");
-        return;
-    }
+    fprintf(io->out, "Initialized .keep directory.\n");
+    return 0;
+}
 
-    FILE* trackingFiles = fopen(".keep/tracking-files", "w");
-    if (trackingFiles == NULL) {
-        printf("Error: Failed to create tracking-files file.\n");
-        return;
+int keepTrack(keep_ctx* ctx, struct commandIo* io, const char* path) {
+    if (keep_track(ctx, path, NULL) != KEEP_OK) {
+        return reportError(ctx, io->out);
     }
-    fclose(trackingFiles);
 
-    FILE* latestVersionFile = fopen(".keep/latest-version", "w");
-    if (latestVersionFile == NULL) {
-        printf("Error: Failed to create latest-version file.\n");
-        return;
+    fprintf(io->out, "Tracking files in '%s'.\n", path);
+    return 0;
+}
+
+int keepUntrack(keep_ctx* ctx, struct commandIo* io, const char* path) {
+    if (keep_untrack(ctx, path) != KEEP_OK) {
+        return reportError(ctx, io->out);
     }
-    fprintf(latestVersionFile, "0");
-    fclose(latestVersionFile);
 
-    printf("Initialized .keep directory.\n");
+    fprintf(io->out, "Untracked '%s'.\n", path);
+    return 0;
 }
 
-void keepTrack(const char* path) {
-    DIR* dir = opendir(path);
-    if (dir == NULL) {
-        printf("Error: Failed to open '%s' directory.\n", path);
-        return;
+int keepVersions(keep_ctx* ctx, struct commandIo* io) {
+    struct keep_status status;
+    if (keep_status(ctx, &status) != KEEP_OK) {
+        return reportError(ctx, io->out);
     }
 
-    FILE* trackingFiles = fopen(".keep/tracking-files", "a");
-    if (trackingFiles == NULL) {
-        printf("Error: Failed to open tracking-files file.\n");
-        closedir(dir);
-        return;
-    }
+    fprintf(io->out, "Latest Version: %d\n", status.latest_version);
 
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+    for (int version = 1; version <= status.latest_version; version++) {
+        char note[MAX_NOTE_LENGTH];
+        if (keep_note(ctx, version, note, sizeof(note)) != KEEP_OK) {
+            reportError(ctx, io->out);
             continue;
         }
 
-        char filePath[MAX_FILE_PATH_LENGTH];
-        snprintf(filePath, sizeof(filePath), "%s/%s", path, entry->d_name);
-
-        struct stat fileStat;
-        if (stat(filePath, &fileStat) == 0) {
-            fprintf(trackingFiles, "%s %ld\n", filePath, fileStat.st_mtime);
-        } else {
-            printf("Error: Failed to get information for file '%s'.\n", filePath);
-        }
+        fprintf(io->out, "Version %d: %s\n", version, note);
     }
-
-    fclose(trackingFiles);
-    closedir(dir);
-    printf("Tracking files in '%s'.\n", path);
+    return 0;
 }
 
-void keepUntrack(const char* path) {
-    FILE* trackingFiles = fopen(".keep/tracking-files", "r");
-    if (trackingFiles == NULL) {
-        printf("Error: Failed to open tracking-files file.\n");
-        return;
+int keepStatus(keep_ctx* ctx, struct commandIo* io) {
+    struct keep_status status;
+    if (keep_status(ctx, &status) != KEEP_OK) {
+        return reportError(ctx, io->out);
     }
 
-    FILE* tempFile = fopen(".keep/tracking-files.temp", "w");
-    if (tempFile == NULL) {
-        printf("Error: Failed to create temporary file.\n");
-        fclose(trackingFiles);
-        return;
-    }
-
-    char filePath[MAX_FILE_PATH_LENGTH];
-    int found = 0;
+    fprintf(io->out, "Latest Version: %d\n", status.latest_version);
+    fprintf(io->out, "Tracked files: %d\n", status.tracked_files);
+    fprintf(io->out, "Modified files: %d\n", status.modified_files);
+    return 0;
+}
 
-    while (fgets(filePath, sizeof(filePath), trackingFiles) != NULL) {
-        filePath[strcspn(filePath, "\n")] = '\0'; // Remove the trailing newline character
+int keepStore(keep_ctx* ctx, struct commandIo* io, const char* note) {
+    struct keep_store_result result;
+    if (keep_store(ctx, note, &result) != KEEP_OK) {
+        return reportError(ctx, io->out);
+    }
 
-        if (strcmp(filePath, path) == 0 || strncmp(filePath, path, strlen(path) + 1) == 0) {
-            found = 1;
-        } else {
-            fprintf(tempFile, "%s\n", filePath);
+    if (result.version == 0) {
+        fprintf(io->out, "Nothing to update.\n");
+    } else {
+        fprintf(io->out, "Stored version %d.\n", result.version);
+        if (result.moved_files > 0) {
+            fprintf(io->out, "Reused stored content for %d moved files.\n", result.moved_files);
         }
     }
+    return 0;
+}
 
-    fclose(trackingFiles);
-    fclose(tempFile);
+int keepRestore(keep_ctx* ctx, struct commandIo* io, int version, const char* toDir, int swap) {
+    struct keep_restore_options options = {toDir, swap};
+    if (keep_restore(ctx, version, &options) != KEEP_OK) {
+        return reportError(ctx, io->out);
+    }
 
-    if (found) {
-        remove(".keep/tracking-files");
-        rename(".keep/tracking-files.temp", ".keep/tracking-files");
-        printf("Untracked '%s'.\n", path);
+    if (toDir == NULL) {
+        fprintf(io->out, "Restored version %d.\n", version);
+    } else if (!swap) {
+        fprintf(io->out, "Restored version %d into '%s'.\n", version, toDir);
     } else {
-        remove(".keep/tracking-files.temp");
-        printf("Error: '%s' is not tracked.\n", path);
+        fprintf(io->out, "Restored version %d; previous files were moved to '%s'.\n", version, toDir);
     }
+    return 0;
 }
 
-void keepVersions() {
-    FILE* latestVersionFile = fopen(".keep/latest-version", "r");
-    if (latestVersionFile == NULL) {
-        printf("Error: Failed to open latest-version file.\n");
-        return;
+int keepExport(keep_ctx* ctx, struct commandIo* io, int version) {
+    if (isatty(io->outFd)) {
+        fprintf(io->err, "Error: Refusing to write an export stream to a terminal.\n");
+        return 1;
     }
 
-    int latestVersion;
-    fscanf(latestVersionFile, "%d", &latestVersion);
-    fclose(latestVersionFile);
-
-    printf("Latest Version: %d\n", latestVersion);
+    fflush(io->out);
+    if (keep_export(ctx, version, io->outFd) != KEEP_OK) {
+        return reportError(ctx, io->err);
+    }
+    return 0;
+}
 
-    for (int version = 1; version <= latestVersion; version++) {
-        char versionDir[MAX_FILE_PATH_LENGTH];
-        snprintf(versionDir, sizeof(versionDir), ".keep/%d", version);
+int keepImport(keep_ctx* ctx, struct commandIo* io) {
+    int version;
+    if (keep_import(ctx, io->inFd, &version) != KEEP_OK) {
+        return reportError(ctx, io->out);
+    }
 
-        FILE* noteFile = fopen(".keep/note", "r");
-        if (noteFile == NULL) {
-            printf("Error: Failed to open note file for version %d.\n", version);
-            continue;
-        }
+    fprintf(io->out, "Imported version %d.\n", version);
+    return 0;
+}
 
-        char note[256];
-        fgets(note, sizeof(note), noteFile);
-        fclose(noteFile);
+int keepLs(keep_ctx* ctx, struct commandIo* io, int version) {
+    if (keep_list(ctx, version, printListEntry, io->out) != KEEP_OK) {
+        return reportError(ctx, io->out);
+    }
+    return 0;
+}
 
-        printf("Version %d: %s", version, note);
+int keepCat(keep_ctx* ctx, struct commandIo* io, int version, const char* path) {
+    fflush(io->out);
+    if (keep_cat(ctx, version, path, io->outFd) != KEEP_OK) {
+        return reportError(ctx, io->err);
     }
+    return 0;
 }
 
-void keepStore(const char* note) {
-    int latestVersion = readLatestVersion();
-    int modifiedFiles = checkModifiedFiles(latestVersion);
+struct logPrinter {
+    keep_ctx* ctx;
+    FILE* out;
+};
 
-    if (modifiedFiles == 0) {
-        printf("Nothing to update.\n");
-        return;
+int keepLog(keep_ctx* ctx, struct commandIo* io, const char* path) {
+    struct logPrinter printer = {ctx, io->out};
+    if (keep_log(ctx, path, printLogEntry, &printer) != KEEP_OK) {
+        return reportError(ctx, io->out);
     }
+    return 0;
+}
 
-    char versionDir[MAX_FILE_PATH_LENGTH];
-    snprintf(versionDir, sizeof(versionDir), ".keep/%d", latestVersion + 1);
-
-    if (mkdir(versionDir, 0700) != 0) {
-        printf("Error: Failed to create version directory.\n");
-        return;
+int keepGrep(keep_ctx* ctx, struct commandIo* io, int argc, char* argv[]) {
+    // keep grep [-F] [--] PATTERN [VERSIONS] [-- PATHS...]
+    struct keep_grep_options options = {0};
+    int i = 0;
+    if (i < argc && strcmp(argv[i], "-F") == 0) {
+        options.fixed = 1;
+        i++;
+    }
+    if (i + 1 < argc && strcmp(argv[i], "--") == 0) {
+        i++;
+    }
+    if (i == argc) {
+        fprintf(io->out, "Error: No pattern specified.\n");
+        return 1;
     }
+    options.pattern = argv[i++];
 
-    char targetDir[MAX_FILE_PATH_LENGTH];
-    snprintf(targetDir, sizeof(targetDir), "%s/target", versionDir);
+    if (i < argc && strcmp(argv[i], "--") != 0) {
+        if (parseVersionRange(argv[i], &options.first_version, &options.last_version) != 0) {
+            fprintf(io->out, "Error: Invalid version range '%s'.\n", argv[i]);
+            return 1;
+        }
+        i++;
+    }
+    if (i < argc && strcmp(argv[i], "--") == 0) {
+        options.paths = (const char* const*)argv + i + 1;
+        options.num_paths = argc - i - 1;
+    } else if (i < argc) {
+        fprintf(io->out, "Error: Unexpected argument '%s'.\n", argv[i]);
+        return 1;
+    }
 
-    if (mkdir(targetDir, 0700) != 0) {
-        printf("Error: Failed to create target directory.\n");
-        return;
+    if (keep_grep(ctx, &options, printGrepMatch, io->out) != KEEP_OK) {
+        return reportError(ctx, io->out);
     }
+    return 0;
+}
 
-    if (copyTrackingFiles(versionDir) != 0) {
-        printf("Error: Failed to copy tracking files.\n");
-        return;
+int keepDiff(keep_ctx* ctx, struct commandIo* io, int argc, char* argv[]) {
+    // keep diff [-M[PERCENT]] FROM TO
+    int similarity = 0;
+    if (argc > 0 && strncmp(argv[0], "-M", 2) == 0) {
+        similarity = argv[0][2] == '\0' ? 50 : atoi(argv[0] + 2);
+        if (similarity <= 0 || similarity > 100) {
+            fprintf(io->out, "Error: Invalid similarity '%s'.\n", argv[0] + 2);
+            return 1;
+        }
+        argc--;
+        argv++;
+    }
+    if (argc < 2) {
+        fprintf(io->out, "Error: Two versions must be specified.\n");
+        return 1;
     }
 
-    if (copyFilesToTarget(versionDir, targetDir) != 0) {
-        printf("Error: Failed to copy files to target directory.\n");
-        return;
+    if (keep_diff(ctx, atoi(argv[0]), atoi(argv[1]), similarity, printDiffEntry, io->out) != KEEP_OK) {
+        return reportError(ctx, io->out);
     }
+    return 0;
+}
 
-    if (updateLatestVersion(latestVersion) != 0) {
-        printf("Error: Failed to update latest version.\n");
-        return;
+int keepFsck(keep_ctx* ctx, struct commandIo* io, int argc, char* argv[]) {
+    // keep fsck [--scrub] [--restart]
+    struct keep_fsck_options options = {0, 0};
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--scrub") == 0) {
+            options.scrub = 1;
+        } else if (strcmp(argv[i], "--restart") == 0) {
+            options.restart = 1;
+        } else {
+            fprintf(io->out, "Error: Invalid fsck option '%s'.\n", argv[i]);
+            return 1;
+        }
     }
 
-    if (storeNoteForVersion(versionDir, note) != 0) {
-        printf("Error: Failed to store note for the version.\n");
-        return;
+    struct keep_fsck_result result;
+    if (keep_fsck(ctx, &options, printFsckProblem, io->out, &result) != KEEP_OK) {
+        return reportError(ctx, io->out);
     }
 
-    printf("Stored version %d.\n", latestVersion + 1);
+    if (options.scrub && result.resumed_at > 0) {
+        fprintf(io->out, "Resumed scrub at object directory %02x.\n", result.resumed_at);
+    }
+    fprintf(io->out, "Checked %d versions", result.versions);
+    if (options.scrub) {
+        fprintf(io->out, " and %lld objects (%lld bytes)", result.objects, result.bytes);
+    }
+    fprintf(io->out, "; %d problems found.\n", result.problems);
+    return result.problems > 0;
 }
 
-void keepRestore(int version) {
-    int latestVersion = readLatestVersion();
-    int modifiedFiles = checkModifiedFiles(latestVersion);
-
-    if (modifiedFiles > 0) {
-        printf("Error: There are modified files. Please store the changes before restoring.\n");
-        return;
+int keepStats(keep_ctx* ctx, struct commandIo* io, int argc, char* argv[]) {
+    // keep stats [--prometheus]
+    enum keep_stats_format format = KEEP_STATS_TEXT;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--prometheus") == 0) {
+            format = KEEP_STATS_PROMETHEUS;
+        } else {
+            fprintf(io->out, "Error: Invalid stats option '%s'.\n", argv[i]);
+            return 1;
+        }
     }
 
-    if (version <= 0 || version > latestVersion) {
-        printf("Error: Invalid version number.\n");
-        return;
+    fflush(io->out);
+    if (keep_stats(ctx, format, io->outFd) != KEEP_OK) {
+        return reportError(ctx, io->out);
     }
+    return 0;
+}
 
-    char versionDir[MAX_FILE_PATH_LENGTH];
-    snprintf(versionDir, sizeof(versionDir), ".keep/%d", version);
+int keepTier(keep_ctx* ctx, struct commandIo* io, int argc, char* argv[]) {
+    // keep tier [--age=DAYS] [--idle=DAYS]
+    long long days[2] = {30, -1};
+    for (int i = 0; i < argc; i++) {
+        int which = strncmp(argv[i], "--age=", 6) == 0 ? 0 : strncmp(argv[i], "--idle=", 7) == 0 ? 1 : -1;
+        char* end = NULL;
+        if (which >= 0) {
+            days[which] = strtoll(strchr(argv[i], '=') + 1, &end, 10);
+        }
+        if (which < 0 || end == strchr(argv[i], '=') + 1 || *end != '\0' || days[which] < 0) {
+            fprintf(io->out, "Error: Invalid tier option '%s'.\n", argv[i]);
+            return 1;
+        }
+    }
 
-    char targetDir[MAX_FILE_PATH_LENGTH];
-    snprintf(targetDir, sizeof(targetDir), "%s/target", versionDir);
+    // Versions restored since they turned cold count as idle for as long
+    // as versions have to be old, unless told otherwise.
+    struct keep_tier_options options = {days[0] * 86400, (days[1] < 0 ? days[0] : days[1]) * 86400};
+    struct keep_tier_result result;
+    if (keep_tier(ctx, &options, &result) != KEEP_OK) {
+        return reportError(ctx, io->out);
+    }
 
-    DIR* dir = opendir(targetDir);
-    if (dir == NULL) {
-        printf("Error: Failed to open target directory for version %d.\n", version);
-        return;
+    if (result.packed_objects > 0) {
+        fprintf(io->out, "Packed %lld objects of %d cold versions (%lld bytes into %lld).\n", result.packed_objects,
+                result.cold_versions, result.packed_bytes, result.pack_bytes);
+    } else {
+        fprintf(io->out, "Nothing to pack; %d versions are cold.\n", result.cold_versions);
     }
+    if (result.thawed_objects > 0) {
+        fprintf(io->out, "Unpacked %lld objects that hot versions use.\n", result.thawed_objects);
+    }
+    if (result.dropped_objects > 0) {
+        fprintf(io->out, "Removed %lld unpacked copies of packed objects.\n", result.dropped_objects);
+    }
+    if (result.merged_packs > 0) {
+        fprintf(io->out, "Combined %d inline packs into one.\n", result.merged_packs);
+    }
+    return 0;
+}
 
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+int keepAuto(keep_ctx* ctx, struct commandIo* io, int argc, char* argv[]) {
+    // keep auto [--interval=SECONDS] [--quiet=SECONDS] [--max-wait=SECONDS]
+    static const char* const names[] = {"--interval=", "--quiet=", "--max-wait="};
+    long seconds[3] = {60, 10, 600};
+    for (int i = 0; i < argc; i++) {
+        int which = -1;
+        for (int j = 0; j < 3 && which < 0; j++) {
+            which = strncmp(argv[i], names[j], strlen(names[j])) == 0 ? j : -1;
+        }
+        char* end = NULL;
+        if (which >= 0) {
+            seconds[which] = strtol(strchr(argv[i], '=') + 1, &end, 10);
+        }
+        if (which < 0 || end == strchr(argv[i], '=') + 1 || *end != '\0' || seconds[which] < 0 ||
+            seconds[which] > 86400 * 365) {
+            fprintf(io->out, "Error: Invalid auto option '%s'.\n", argv[i]);
+            return 1;
         }
+    }
 
-        char filePath[MAX_FILE_PATH_LENGTH];
-        snprintf(filePath, sizeof(filePath), "%s/%s", targetDir, entry->d_name);
+    // SIGINT and SIGTERM end the wait between stores, as for keep serve.
+    struct sigaction stop = {0};
+    stop.sa_handler = stopServing;
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+
+    fprintf(io->out, "Watching tracked files for changes.\n");
+    fflush(io->out);
+    struct keep_auto_options options = {(int)seconds[0], (int)seconds[1], (int)seconds[2]};
+    struct logPrinter printer = {ctx, io->out};
+    if (keep_auto(ctx, &options, printAutoStore, &printer) != KEEP_OK) {
+        return reportError(ctx, io->out);
+    }
+    return 0;
+}
 
-        if (remove(filePath) != 0) {
-            printf("Error: Failed to remove file '%s'.\n", filePath);
+int keepBisect(keep_ctx* ctx, struct commandIo* io, int argc, char* argv[]) {
+    // keep bisect --run CMD GOOD BAD
+    struct keep_bisect_options options = {0, 0, NULL};
+    int numVersions = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--run") == 0 && i + 1 < argc) {
+            options.command = argv[++i];
+        } else if (argv[i][0] != '-' && numVersions < 2) {
+            *(numVersions++ == 0 ? &options.good : &options.bad) = atoi(argv[i]);
+        } else {
+            fprintf(io->out, "Error: Invalid bisect option '%s'.\n", argv[i]);
+            return 1;
         }
     }
+    if (options.command == NULL) {
+        fprintf(io->out, "Error: No command specified; use --run CMD.\n");
+        return 1;
+    }
+    if (numVersions < 2) {
+        fprintf(io->out, "Error: No good and bad version specified.\n");
+        return 1;
+    }
 
-    closedir(dir);
+    // The command writes to the same stdout.
+    fflush(io->out);
+    struct keep_bisect_result result;
+    if (keep_bisect(ctx, &options, printBisectStep, io->out, &result) != KEEP_OK) {
+        return reportError(ctx, io->out);
+    }
 
-    if (copyFilesToTarget(versionDir, targetDir) != 0) {
-        printf("Error: Failed to restore files to target directory.\n");
-        return;
+    if (result.last_good + 1 == result.first_bad) {
+        fprintf(io->out, "Version %d is the first bad version (%d steps).\n", result.first_bad, result.steps);
+    } else {
+        fprintf(io->out, "The first bad version is one of %d to %d; the others could not be tested.\n",
+                result.last_good + 1, result.first_bad);
     }
+    fprintf(io->out, "Version %d is in '.keep/bisect/worktree'.\n", result.first_bad);
+    return 0;
+}
 
-    if (removeNonTrackingFiles() != 0) {
-        printf("Error: Failed to remove non-tracking files.\n");
-        return;
+int keepMirror(keep_ctx* ctx, struct commandIo* io, const char* dir, int push) {
+    struct keep_mirror_result result;
+    int error = push ? keep_push(ctx, dir, &result) : keep_pull(ctx, dir, &result);
+    if (error != KEEP_OK) {
+        return reportError(ctx, io->out);
     }
 
-    printf("Restored version %d.\n", version);
+    if (result.versions == 0) {
+        fprintf(io->out, "Already up to date.\n");
+    } else {
+        fprintf(io->out, "%s %d versions (%d objects, %lld bytes) %s '%s'.\n", push ? "Pushed" : "Pulled",
+                result.versions, result.objects, result.bytes, push ? "to" : "from", dir);
+    }
+    return 0;
 }
 
-int readLatestVersion() {
-    FILE* latestVersionFile = fopen(".keep/latest-version", "r");
-    if (latestVersionFile == NULL) {
-        printf("Error: Failed to open latest-version file.\n");
-        return -1;
+int keepAlternate(keep_ctx* ctx, struct commandIo* io, const char* dir) {
+    if (keep_add_alternate(ctx, dir) != KEEP_OK) {
+        return reportError(ctx, io->out);
     }
 
-    int latestVersion;
-    fscanf(latestVersionFile, "%d", &latestVersion);
-    fclose(latestVersionFile);
-
-    return latestVersion;
+    fprintf(io->out, "Using objects from '%s'.\n", dir);
+    return 0;
 }
 
-int checkModifiedFiles(int latestVersion) {
-    FILE* trackingFiles = fopen(".keep/tracking-files", "r");
-    if (trackingFiles == NULL) {
-        printf("Error: Failed to open tracking-files file.\n");
-        return -1;
+int keepServe(keep_ctx* ctx) {
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0) {
+        printf("Error: Failed to create socket.\n");
+        return 1;
     }
 
-    char filePath[MAX_FILE_PATH_LENGTH];
-    int modifiedFiles = 0;
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", SERVE_SOCKET_PATH);
 
-    while (fgets(filePath, sizeof(filePath), trackingFiles) != NULL) {
-        filePath[strcspn(filePath, "\n")] = '\0'; // Remove the trailing newline character
-
-        char* filePtr = strtok(filePath, " ");
-        char* timePtr = strtok(NULL, " ");
+    // A socket file left behind by a server that died is replaced; a live
+    // server keeps its socket.
+    if (connect(listener, (struct sockaddr*)&address, sizeof(address)) == 0) {
+        printf("Error: keep serve is already running.\n");
+        close(listener);
+        return 1;
+    }
+    unlink(SERVE_SOCKET_PATH);
 
-        if (filePtr == NULL || timePtr == NULL) {
-            continue;
-        }
+    if (bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 16) != 0) {
+        printf("Error: Failed to listen on '%s'.\n", SERVE_SOCKET_PATH);
+        close(listener);
+        return 1;
+    }
 
-        struct stat fileStat;
-        if (stat(filePtr, &fileStat) == 0) {
-            if (fileStat.st_mtime > atoi(timePtr)) {
-                modifiedFiles++;
+    // Clients may disconnect mid-response; that must not end the server.
+    // SIGINT and SIGTERM interrupt accept() so the socket can be removed.
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction stop = {0};
+    stop.sa_handler = stopServing;
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+
+    printf("Serving on '%s'.\n", SERVE_SOCKET_PATH);
+    fflush(stdout);
+
+    while (serving) {
+        int connection = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (connection < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            break;
         }
+
+        serveRequest(ctx, connection);
+        close(connection);
     }
 
-    fclose(trackingFiles);
-    return modifiedFiles;
+    close(listener);
+    unlink(SERVE_SOCKET_PATH);
+    return serving ? 1 : 0;
 }
 
-int copyTrackingFiles(const char* versionDir) {
-    FILE* trackingFiles = fopen(".keep/tracking-files", "r");
-    if (trackingFiles == NULL) {
-        printf("Error: Failed to open tracking-files file.\n");
+void stopServing(int signal) {
+    (void)signal;
+    serving = 0;
+}
+
+int serveRequest(keep_ctx* ctx, int connection) {
+    // A request is the client's argument vector, NUL separated, sent together
+    // with its stdin, stdout and stderr descriptors. The reply is the exit
+    // status; all other output goes straight to the client's descriptors.
+    static char request[MAX_REQUEST_LENGTH];
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = {request, sizeof(request) - 1};
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t length = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    if (length <= 0 || header == NULL || header->cmsg_type != SCM_RIGHTS ||
+        header->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
         return -1;
     }
 
-    char filePath[MAX_FILE_PATH_LENGTH];
-    FILE* targetFile = fopen(".keep/target/tracking-files", "w");
-    if (targetFile == NULL) {
-        printf("Error: Failed to create target tracking-files file.\n");
-        fclose(trackingFiles);
-        return -1;
+    int fds[3];
+    memcpy(fds, CMSG_DATA(header), sizeof(fds));
+
+    // The descriptors arrive with the first bytes; the rest of a long
+    // argument vector may follow in later reads.
+    while (length < 2 || request[length - 1] != '\0' || request[length - 2] != '\0') {
+        ssize_t n = read(connection, request + length, sizeof(request) - 1 - length);
+        if (n <= 0) {
+            close(fds[0]);
+            close(fds[1]);
+            close(fds[2]);
+            return -1;
+        }
+        length += n;
     }
 
-    while (fgets(filePath, sizeof(filePath), trackingFiles) != NULL) {
-        filePath[strcspn(filePath, "\n")] = '\0'; // Remove the trailing newline character
-        fprintf(targetFile, "%s\n", filePath);
+    char* argv[MAX_REQUEST_ARGS + 1];
+    int argc = 0;
+    for (char* arg = request; *arg != '\0' && argc < MAX_REQUEST_ARGS; arg += strlen(arg) + 1) {
+        argv[argc++] = arg;
+    }
+    argv[argc] = NULL;
+
+    FILE* out = fdopen(fds[1], "w");
+    FILE* err = fdopen(fds[2], "w");
+    int status = 1;
+    if (out != NULL && err != NULL && argc >= 3) {
+        struct commandIo io = {fds[0], fds[1], out, err};
+        status = runCommand(ctx, argc, argv, &io);
     }
 
-    fclose(trackingFiles);
-    fclose(targetFile);
-    return 0;
+    if (out != NULL) {
+        fclose(out);
+    } else {
+        close(fds[1]);
+    }
+    if (err != NULL) {
+        fclose(err);
+    } else {
+        close(fds[2]);
+    }
+    close(fds[0]);
+
+    unsigned char reply = status;
+    return write(connection, &reply, 1) == 1 ? 0 : -1;
 }
 
-int updateLatestVersion(int latestVersion) {
-    FILE* latestVersionFile = fopen(".keep/latest-version", "w");
-    if (latestVersionFile == NULL) {
-        printf("Error: Failed to open latest-version file.\n");
+int sendRequest(int argc, char* argv[], int* status) {
+    if (access(SERVE_SOCKET_PATH, F_OK) != 0) {
         return -1;
     }
 
-    fprintf(latestVersionFile, "%d", latestVersion + 1);
-    fclose(latestVersionFile);
-    return 0;
-}
-
-int storeNoteForVersion(const char* versionDir, const char* note) {
-    FILE* noteFile = fopen(".keep/note", "w");
-    if (noteFile == NULL) {
-        printf("Error: Failed to open note file.\n");
+    int connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connection < 0) {
         return -1;
     }
 
-    fprintf(noteFile, "%s\n", note);
-    fclose(noteFile);
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", SERVE_SOCKET_PATH);
 
-    char targetNoteFile[MAX_FILE_PATH_LENGTH];
-    snprintf(targetNoteFile, sizeof(targetNoteFile), "%s/target/note", versionDir);
+    if (connect(connection, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close(connection);
+        return -1;
+    }
 
-    if (copyFileToTarget(".keep/note", targetNoteFile) != 0) {
-        printf("Error: Failed to copy note file to target directory.\n");
+    char request[MAX_REQUEST_LENGTH];
+    size_t length = 0;
+    for (int i = 0; i < argc; i++) {
+        size_t argLength = strlen(argv[i]) + 1;
+        if (length + argLength + 1 > sizeof(request) || i >= MAX_REQUEST_ARGS) {
+            close(connection);
+            return -1;
+        }
+        memcpy(request + length, argv[i], argLength);
+        length += argLength;
+    }
+    request[length++] = '\0';
+
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))] = {0};
+    struct iovec iov = {request, length};
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(header), fds, sizeof(fds));
+
+    ssize_t sent = sendmsg(connection, &message, 0);
+    if (sent < 0) {
+        close(connection);
+        return -1;
+    }
+    if ((size_t)sent < length && write(connection, request + sent, length - sent) != (ssize_t)(length - sent)) {
+        close(connection);
         return -1;
     }
 
-    return 0;
-}
+    unsigned char reply;
+    ssize_t n;
+    while ((n = read(connection, &reply, 1)) < 0 && errno == EINTR) {
+    }
+    close(connection);
 
-int copyFilesToTarget(const char* versionDir, const char* targetDir) {
-    FILE* trackingFiles = fopen(".keep/tracking-files", "r");
-    if (trackingFiles == NULL) {
-        printf("Error: Failed to open tracking-files file.\n");
-        return -1;
+    if (n != 1) {
+        printf("Error: keep serve closed the connection.\n");
+        *status = 1;
+        return 0;
     }
 
-    char filePath[MAX_FILE_PATH_LENGTH];
-    while (fgets(filePath, sizeof(filePath), trackingFiles) != NULL) {
-        filePath[strcspn(filePath, "\n")] = '\0'; // Remove the trailing newline character
-        char targetFile[MAX_FILE_PATH_LENGTH];
-        snprintf(targetFile, sizeof(targetFile), "%s/target/%s", versionDir, filePath);
-        if (copyFileToTarget(filePath, targetFile) != 0) {
-            fclose(trackingFiles);
+    *status = reply;
+    return 0;
+}
+
+int parseIoOption(keep_ctx* ctx, int* argc, char* argv[], FILE* out) {
+    enum keep_io_backend backend = KEEP_IO_SYNC;
+    enum keep_cache_policy policy = KEEP_CACHE_NORMAL;
+    enum keep_read_order order = KEEP_ORDER_AUTO;
+    struct keep_throttle throttle = {0, 0, 0};
+    long long memory = 0;
+    long long inlineLimit = -1;
+    int kept = 0;
+
+    // Options end at "--" so a note, pattern or path may look like one. A
+    // "--" right after the command only ends them; a later one belongs to
+    // the command, as grep's path separator.
+    int i = 0;
+    for (; i < *argc && strcmp(argv[i], "--") != 0; i++) {
+        if (strcmp(argv[i], "--io=uring") == 0) {
+            backend = KEEP_IO_URING;
+        } else if (strcmp(argv[i], "--io=sync") == 0) {
+            backend = KEEP_IO_SYNC;
+        } else if (strncmp(argv[i], "--io=", 5) == 0) {
+            fprintf(out, "Error: Invalid I/O backend '%s'.\n", argv[i] + 5);
+            return -1;
+        } else if (strcmp(argv[i], "--cache=normal") == 0) {
+            policy = KEEP_CACHE_NORMAL;
+        } else if (strcmp(argv[i], "--cache=drop") == 0) {
+            policy = KEEP_CACHE_DROP;
+        } else if (strcmp(argv[i], "--cache=direct") == 0) {
+            policy = KEEP_CACHE_DIRECT;
+        } else if (strncmp(argv[i], "--cache=", 8) == 0) {
+            fprintf(out, "Error: Invalid cache policy '%s'.\n", argv[i] + 8);
             return -1;
+        } else if (strcmp(argv[i], "--order=auto") == 0) {
+            order = KEEP_ORDER_AUTO;
+        } else if (strcmp(argv[i], "--order=path") == 0) {
+            order = KEEP_ORDER_PATH;
+        } else if (strcmp(argv[i], "--order=physical") == 0) {
+            order = KEEP_ORDER_PHYSICAL;
+        } else if (strncmp(argv[i], "--order=", 8) == 0) {
+            fprintf(out, "Error: Invalid read order '%s'.\n", argv[i] + 8);
+            return -1;
+        } else if (strncmp(argv[i], "--memory=", 9) == 0) {
+            if (parseSize(argv[i] + 9, &memory) != 0) {
+                fprintf(out, "Error: Invalid memory limit '%s'.\n", argv[i] + 9);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--inline=0") == 0) {
+            inlineLimit = 0;
+        } else if (strncmp(argv[i], "--inline=", 9) == 0) {
+            if (parseSize(argv[i] + 9, &inlineLimit) != 0) {
+                fprintf(out, "Error: Invalid inline limit '%s'.\n", argv[i] + 9);
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--rate=", 7) == 0) {
+            if (parseSize(argv[i] + 7, &throttle.bytes_per_second) != 0) {
+                fprintf(out, "Error: Invalid rate '%s'.\n", argv[i] + 7);
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--iops=", 7) == 0) {
+            char* end;
+            long ops = strtol(argv[i] + 7, &end, 10);
+            if (end == argv[i] + 7 || *end != '\0' || ops <= 0 || ops > 1000000000) {
+                fprintf(out, "Error: Invalid operation rate '%s'.\n", argv[i] + 7);
+                return -1;
+            }
+            throttle.ops_per_second = (int)ops;
+        } else if (strcmp(argv[i], "--adaptive") == 0) {
+            throttle.adaptive = 1;
+        } else {
+            argv[kept++] = argv[i];
         }
     }
-
-    fclose(trackingFiles);
+    if (i < *argc && kept == 3) {
+        i++;
+    }
+    while (i < *argc) {
+        argv[kept++] = argv[i++];
+    }
+    *argc = kept;
+    argv[kept] = NULL;
+
+    keep_set_cache_policy(ctx, policy);
+    keep_set_read_order(ctx, order);
+    keep_set_memory_limit(ctx, memory);
+    keep_set_inline_limit(ctx, inlineLimit);
+    keep_set_throttle(ctx, &throttle);
+
+    // Without io_uring (old kernel, seccomp) keep the synchronous path.
+    if (keep_set_io_backend(ctx, backend) != KEEP_OK) {
+        keep_set_io_backend(ctx, KEEP_IO_SYNC);
+    }
     return 0;
 }
 
-int removeNonTrackingFiles() {
-    DIR* dir = opendir(".");
-    if (dir == NULL) {
-        printf("Error: Failed to open current directory.\n");
+int parseSize(const char* text, long long* size) {
+    // Bytes, optionally followed by k, m or g for powers of 1024.
+    char* end;
+    long long value = strtoll(text, &end, 10);
+    int shift = 0;
+    if (*end == 'k' || *end == 'K') {
+        shift = 10;
+    } else if (*end == 'm' || *end == 'M') {
+        shift = 20;
+    } else if (*end == 'g' || *end == 'G') {
+        shift = 30;
+    }
+    if (shift != 0) {
+        end++;
+    }
+    if (end == text || *end != '\0' || value <= 0 || value > (1LL << (62 - shift))) {
         return -1;
     }
+    *size = value << shift;
+    return 0;
+}
 
-    FILE* trackingFiles = fopen(".keep/tracking-files", "r");
-    if (trackingFiles == NULL) {
-        printf("Error: Failed to open tracking-files file.\n");
-        closedir(dir);
-        return -1;
+int reportError(keep_ctx* ctx, FILE* stream) {
+    fprintf(stream, "Error: %s.\n", keep_error_message(ctx));
+    return 1;
+}
+
+int printListEntry(const char* path, long mtime, void* arg) {
+    (void)mtime;
+    fprintf((FILE*)arg, "%s\n", path);
+    return 0;
+}
+
+int printLogEntry(int version, int removed, void* arg) {
+    struct logPrinter* printer = arg;
+    char note[MAX_NOTE_LENGTH];
+    if (keep_note(printer->ctx, version, note, sizeof(note)) != KEEP_OK) {
+        note[0] = '\0';
     }
 
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
+    fprintf(printer->out, "Version %d: %s%s\n", version, note, removed ? " (removed)" : "");
+    return 0;
+}
 
-        char filePath[MAX_FILE_PATH_LENGTH];
-        snprintf(filePath, sizeof(filePath), "%s", entry->d_name);
+int printGrepMatch(int version, const char* path, long line, const char* text, void* arg) {
+    fprintf((FILE*)arg, "%d:%s:%ld:%s\n", version, path, line, text);
+    return 0;
+}
 
-        int found = 0;
-        char trackedFilePath[MAX_FILE_PATH_LENGTH];
-        rewind(trackingFiles);
-        while (fgets(trackedFilePath, sizeof(trackedFilePath), trackingFiles) != NULL) {
-            trackedFilePath[strcspn(trackedFilePath, "\n")] = '\0'; // Remove the trailing newline character
+int printDiffEntry(const struct keep_diff_entry* entry, void* arg) {
+    FILE* out = arg;
+    if (entry->change == KEEP_RENAMED) {
+        fprintf(out, "R %s -> %s (%d%%)\n", entry->old_path, entry->path, entry->similarity);
+    } else {
+        fprintf(out, "%c %s\n", entry->change == KEEP_ADDED ? 'A' : entry->change == KEEP_REMOVED ? 'D' : 'M',
+                entry->path);
+    }
+    return 0;
+}
 
-            if (strcmp(filePath, trackedFilePath) == 0) {
-                found = 1;
-                break;
-            }
-        }
+void printFsckProblem(const char* problem, void* arg) {
+    fprintf((FILE*)arg, "Problem: %s.\n", problem);
+}
 
-        if (!found) {
-            if (remove(filePath) != 0) {
-                printf("Error: Failed to remove file '%s'.\n", filePath);
-            }
-        }
+int printAutoStore(int error, const struct keep_store_result* result, const char* note, void* arg) {
+    // A failed store is reported and retried later rather than ending the
+    // watch; files may be mid-rename.
+    struct logPrinter* printer = arg;
+    if (error != KEEP_OK) {
+        reportError(printer->ctx, printer->out);
+    } else if (result != NULL && result->version > 0) {
+        fprintf(printer->out, "Stored version %d (%s).\n", result->version, note);
     }
+    fflush(printer->out);
+    return !serving;
+}
 
-    fclose(trackingFiles);
-    closedir(dir);
+int printBisectStep(int version, enum keep_bisect_verdict verdict, void* arg) {
+    static const char* const verdicts[] = {"good", "bad", "skipped"};
+    fprintf((FILE*)arg, "Version %d is %s.\n", version, verdicts[verdict]);
+    fflush((FILE*)arg);
     return 0;
 }
 
-int copyFileToTarget(const char* source, const char* target) {
-    FILE* sourceFile = fopen(source, "r");
-    if (sourceFile == NULL) {
-        printf("Error: Failed to open file '%s'.\n", source);
+int parseVersionRange(const char* text, int* first, int* last) {
+    // "N", "A-B", "A-" or "-B"; an open end is left as 0.
+    char* end;
+    *first = 0;
+    *last = 0;
+    if (*text != '-') {
+        *first = strtol(text, &end, 10);
+        if (end == text || *first <= 0) {
+            return -1;
+        }
+        text = end;
+        if (*text == '\0') {
+            *last = *first;
+            return 0;
+        }
+    }
+    if (*text++ != '-') {
         return -1;
     }
+    if (*text != '\0') {
+        *last = strtol(text, &end, 10);
+        if (end == text || *end != '\0' || *last <= 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    FILE* targetFile = fopen(target, "w");
-    if (targetFile == NULL) {
-        printf("Error: Failed to create target file '%s'.\n", target);
-        fclose(sourceFile);
-        return -1;
+int parseTraceOptions(int* argc, char* argv[], int* tracing) {
+    const char* traceFile = NULL;
+    int traceStats = 0;
+    int kept = 0;
+
+    // Stop at "--" and leave it for parseIoOption, which ends the other
+    // options there too.
+    int i = 0;
+    for (; i < *argc && strcmp(argv[i], "--") != 0; i++) {
+        if (strncmp(argv[i], "--trace=", 8) == 0) {
+            traceFile = argv[i] + 8;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            traceStats = 1;
+        } else {
+            argv[kept++] = argv[i];
+        }
     }
+    while (i < *argc) {
+        argv[kept++] = argv[i++];
+    }
+    *argc = kept;
+    argv[kept] = NULL;
 
-    char ch;
-    while ((ch = fgetc(sourceFile)) != EOF) {
-        fputc(ch, targetFile);
+    if (traceFile == NULL && !traceStats) {
+        return 0;
     }
 
-    fclose(sourceFile);
-    fclose(targetFile);
+    *tracing = 1;
+    if (keep_trace(traceFile, traceStats) != KEEP_OK) {
+        printf("Error: Tracing is not available; rebuild keep with -DKEEP_TRACE.\n");
+        return -1;
+    }
     return 0;
 }
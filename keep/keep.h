@@ -0,0 +1,296 @@
+#ifndef KEEP_H
+#define KEEP_H
+
+#include <stddef.h>
+
+typedef struct keep_ctx keep_ctx;
+
+enum keep_error {
+    KEEP_OK = 0,
+    KEEP_ERR_IO = -1,
+    KEEP_ERR_NO_REPO = -2,
+    KEEP_ERR_EXISTS = -3,
+    KEEP_ERR_INVALID_VERSION = -4,
+    KEEP_ERR_MODIFIED = -5,
+    KEEP_ERR_NOT_TRACKED = -6,
+    KEEP_ERR_INVALID_ARGUMENT = -7,
+    KEEP_ERR_UNSUPPORTED = -8,
+    KEEP_ERR_NO_MEMORY = -9
+};
+
+enum keep_io_backend {
+    KEEP_IO_SYNC,
+    KEEP_IO_URING           // batched statx/openat/read/write/close via io_uring
+};
+
+enum keep_cache_policy {
+    KEEP_CACHE_NORMAL,      // buffered I/O, sequential readahead on sources
+    KEEP_CACHE_DROP,        // drop the pages a command brought into the cache
+    KEEP_CACHE_DIRECT       // like DROP, with O_DIRECT source reads and object writes
+};
+
+enum keep_read_order {
+    KEEP_ORDER_AUTO,        // PHYSICAL when .keep is on a rotational disk, PATH otherwise
+    KEEP_ORDER_PATH,        // in manifest order
+    KEEP_ORDER_PHYSICAL     // in the order content lies on disk, with large readahead
+};
+
+struct keep_throttle {
+    long long bytes_per_second;     // 0 for no limit on throughput
+    int ops_per_second;             // 0 for no limit on reads and writes
+    int adaptive;                   // scale down while I/O latency rises
+};
+
+enum keep_stats_format {
+    KEEP_STATS_TEXT,
+    KEEP_STATS_PROMETHEUS   // text exposition format, for a node_exporter textfile collector
+};
+
+struct keep_status {
+    int latest_version;
+    int tracked_files;
+    int modified_files;
+};
+
+struct keep_store_result {
+    int version;            // 0 when no tracked file was modified
+    int modified_files;
+    int stored_files;
+    int moved_files;        // new paths whose content was already stored
+};
+
+struct keep_mirror_result {
+    int versions;           // versions the receiving repository was missing
+    int objects;            // objects copied; shared ones are skipped
+    long long bytes;
+};
+
+typedef int (*keep_list_callback)(const char* path, long mtime, void* arg);
+typedef int (*keep_log_callback)(int version, int removed, void* arg);
+enum keep_change {
+    KEEP_ADDED,
+    KEEP_REMOVED,
+    KEEP_MODIFIED,
+    KEEP_RENAMED
+};
+
+struct keep_diff_entry {
+    enum keep_change change;
+    const char* path;           // the path in the newer version, except for KEEP_REMOVED
+    const char* old_path;       // KEEP_RENAMED only
+    int similarity;             // KEEP_RENAMED only, in percent
+};
+
+struct keep_fsck_options {
+    int scrub;                  // also rehash every object in the store
+    int restart;                // scrub from the start instead of resuming
+};
+
+struct keep_fsck_result {
+    int versions;
+    long long objects;          // objects scrubbed
+    long long bytes;
+    int problems;
+    int resumed_at;             // first object directory scrubbed, 0 to 255
+};
+
+typedef void (*keep_fsck_callback)(const char* problem, void* arg);
+typedef int (*keep_diff_callback)(const struct keep_diff_entry* entry, void* arg);
+typedef int (*keep_grep_callback)(int version, const char* path, long line, const char* text, void* arg);
+
+struct keep_grep_options {
+    const char* pattern;        // POSIX extended regular expression
+    int fixed;                  // treat pattern as a plain string instead
+    int first_version;          // 0 for the first version
+    int last_version;           // 0 for the latest version
+    const char* const* paths;   // files or directories to search, NULL for all
+    int num_paths;
+};
+
+struct keep_tier_options {
+    long long min_age;          // seconds since a version was stored before it can be cold
+    long long min_idle;         // seconds since it was last restored
+};
+
+struct keep_tier_result {
+    int cold_versions;
+    long long packed_objects;
+    long long packed_bytes;
+    long long pack_bytes;       // packed_bytes after compression
+    long long thawed_objects;   // packed objects that hot versions use again
+    long long dropped_objects;  // unpacked copies of packed objects removed
+    int merged_packs;           // inline packs combined into one
+};
+
+struct keep_auto_options {
+    int min_interval;           // seconds between stores, at least
+    int quiet_period;           // seconds without changes before a store
+    int max_staleness;          // seconds a change may wait despite ongoing ones, 0 for no limit
+};
+
+// Called after every store keep_auto attempts, with the error it returned
+// and the note it was given, and with result NULL when a signal interrupted
+// the wait. A non-zero return stops keep_auto.
+typedef int (*keep_auto_callback)(int error, const struct keep_store_result* result, const char* note, void* arg);
+
+enum keep_bisect_verdict {
+    KEEP_BISECT_GOOD,
+    KEEP_BISECT_BAD,
+    KEEP_BISECT_SKIP        // the command exited with 125: the version cannot be tested
+};
+
+struct keep_bisect_options {
+    int good;
+    int bad;                    // newer than good
+    const char* command;        // run by /bin/sh in the worktree; exits 0 when good
+};
+
+struct keep_bisect_result {
+    int first_bad;
+    int last_good;              // first_bad - 1 unless skipped versions lie between
+    int steps;
+};
+
+typedef int (*keep_bisect_callback)(int version, enum keep_bisect_verdict verdict, void* arg);
+
+struct keep_restore_options {
+    const char* to_dir;     // NULL restores into the working tree
+    int swap;               // exchange to_dir with the working tree afterwards, keeping
+                            // tracked files the version lacks, as a restore in place does
+};
+
+// A context is bound to one repository root and caches its tracking list
+// and latest version between calls. Contexts are independent of each other
+// and of the process working directory, but a single context must not be
+// used from several threads at once.
+keep_ctx* keep_open(const char* repo_path, int* error);
+void keep_close(keep_ctx* ctx);
+
+// Returns a description of the last error reported on ctx.
+const char* keep_error_message(const keep_ctx* ctx);
+
+// Selects how store and restore issue file I/O. Returns KEEP_ERR_UNSUPPORTED
+// and stays on KEEP_IO_SYNC when the kernel refuses io_uring.
+int keep_set_io_backend(keep_ctx* ctx, enum keep_io_backend backend);
+
+// Selects how store, restore, import, export and mirroring treat the page
+// cache. Falls back to buffered I/O per file where O_DIRECT is refused.
+int keep_set_cache_policy(keep_ctx* ctx, enum keep_cache_policy policy);
+
+// Selects the order in which restore, export and scrubbing read stored
+// content. Reading by physical location turns the seeks of a restore from a
+// spinning disk into mostly sequential reads; export then writes files in
+// that order too.
+int keep_set_read_order(keep_ctx* ctx, enum keep_read_order order);
+
+// Caps the memory that sorting file lists takes, in bytes; 0 restores the
+// default of 64 MiB. Store, diff, restore, export and bisect stream the file
+// lists of versions in path order and sort through temporary files in .keep
+// when a list is not. Diff, restore, export and bisect thus use memory that
+// does not grow with the number of files in a version. Store still holds
+// the tracking list, which the context caches, and a few bytes per tracked
+// file besides.
+int keep_set_memory_limit(keep_ctx* ctx, long long bytes);
+
+// Sets the size up to which store keeps the content of a new file in a
+// compressed pack shared with the other small files of that store instead
+// of in an object file of its own. Restore, export and bisect then read
+// such files a pack group at a time. 0 turns this off and a negative size
+// restores the default of 4 KiB; sizes above 1 MiB count as 1 MiB.
+int keep_set_inline_limit(keep_ctx* ctx, long long bytes);
+
+// Limits the file I/O of store, restore, import and mirroring so that they
+// can run next to latency-sensitive work. Adaptive mode works with or
+// without explicit rates; NULL removes all limits.
+int keep_set_throttle(keep_ctx* ctx, const struct keep_throttle* throttle);
+
+// Writers (track, untrack, store, import and restores that replace the
+// working tree) serialize on .keep/lock and publish a version only once it
+// is complete. Everything else reads without locking and sees the versions
+// that were published when it looked at latest-version.
+int keep_init(keep_ctx* ctx);
+int keep_track(keep_ctx* ctx, const char* path, int* tracked_files);
+int keep_untrack(keep_ctx* ctx, const char* path);
+int keep_status(keep_ctx* ctx, struct keep_status* status);
+int keep_note(keep_ctx* ctx, int version, char* note, size_t size);
+int keep_store(keep_ctx* ctx, const char* note, struct keep_store_result* result);
+int keep_restore(keep_ctx* ctx, int version, const struct keep_restore_options* options);
+int keep_export(keep_ctx* ctx, int version, int fd);
+int keep_import(keep_ctx* ctx, int fd, int* version);
+
+// Lets this repository read objects from the repository at dir and skip
+// storing, pushing or pulling anything that repository already has. Loose
+// objects are hard-linked in where both live on one filesystem; otherwise
+// dir must stay in place. Objects that keep_tier in dir moves into its packs
+// are unpacked into this repository when first read.
+int keep_add_alternate(keep_ctx* ctx, const char* dir);
+
+// Calls callback for every file of a version; a non-zero return stops the
+// walk and is returned.
+int keep_list(keep_ctx* ctx, int version, keep_list_callback callback, void* arg);
+// Writes the stored content of one file of a version to fd.
+int keep_cat(keep_ctx* ctx, int version, const char* path, int fd);
+// Calls callback for every version that added, changed or removed path,
+// newest first. Answered from the per-path index kept up to date by writers.
+int keep_log(keep_ctx* ctx, const char* path, keep_log_callback callback, void* arg);
+// Calls callback for every file that differs between two versions, sorted by
+// path. A removed and an added file with the same content are reported as a
+// rename; with min_similarity between 1 and 99, so are pairs whose content
+// is at least that similar.
+int keep_diff(keep_ctx* ctx, int from, int to, int min_similarity, keep_diff_callback callback, void* arg);
+// Calls callback for every line matching options->pattern in the selected
+// versions, in version order. Content shared by several versions is read
+// once; files that look binary are skipped.
+int keep_grep(keep_ctx* ctx, const struct keep_grep_options* options, keep_grep_callback callback, void* arg);
+
+// Checks that every published version is complete and that the objects its
+// files refer to are present and of the right size; with options->scrub,
+// also rehashes the whole object store on a pool of threads. Each problem
+// is passed to callback. An interrupted scrub resumes where it stopped.
+// Honors keep_set_throttle and keep_set_cache_policy.
+int keep_fsck(keep_ctx* ctx, const struct keep_fsck_options* options, keep_fsck_callback callback, void* arg,
+              struct keep_fsck_result* result);
+
+// Writes the counters and latency histograms that store, restore, import
+// and mirroring accumulate in .keep/metrics to fd. Only that file is read,
+// however large the repository.
+int keep_stats(keep_ctx* ctx, enum keep_stats_format format, int fd);
+
+// Moves the objects that only cold versions use into a new compressed pack.
+// The latest version, the base version of the working tree and versions
+// stored or restored more recently than the options allow are hot. Packed
+// objects are unpacked again on first use, and by the next keep_tier once
+// hot versions use them. Once stores have left several inline packs, they
+// are combined into one, as every object lookup searches each pack. Honors
+// keep_set_throttle and keep_set_cache_policy.
+int keep_tier(keep_ctx* ctx, const struct keep_tier_options* options, struct keep_tier_result* result);
+
+// Watches the tracked files and stores a version once they changed and then
+// stayed unchanged for the quiet period, noting which files changed. Sleeps
+// in the kernel between changes; where it cannot watch the files it scans
+// them every min_interval, or every second at most, instead. A failed store
+// is retried after a wait that doubles up to five minutes. Runs until
+// callback asks to stop.
+int keep_auto(keep_ctx* ctx, const struct keep_auto_options* options, keep_auto_callback callback, void* arg);
+
+// Searches the versions between options->good and options->bad for the
+// first one on which options->command fails. Each candidate is checked out
+// into .keep/bisect/worktree, leaving the working tree alone, by writing
+// only the files that differ from the version checked out before, so the
+// command must not modify tracked files there. The worktree, with any build
+// output, is kept for the next bisect. The command sees the version in
+// KEEP_BISECT_VERSION. Callback is told every verdict; a non-zero return
+// stops the search and is returned.
+int keep_bisect(keep_ctx* ctx, const struct keep_bisect_options* options, keep_bisect_callback callback, void* arg,
+                struct keep_bisect_result* result);
+
+// Bring the repository at dir (push) or this one (pull) up to date with the
+// other. Only versions after the receiver's latest one are copied, and only
+// objects the receiver does not have yet.
+int keep_push(keep_ctx* ctx, const char* dir, struct keep_mirror_result* result);
+int keep_pull(keep_ctx* ctx, const char* dir, struct keep_mirror_result* result);
+
+// Enables process-wide tracing; see KEEP_TRACE in libkeep.c.
+int keep_trace(const char* file, int stats);
+
+#endif
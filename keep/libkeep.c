@@ -0,0 +1,8654 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <regex.h>
+#include <lzma.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+
+#include "keep.h"
+
+#define MAX_FILE_PATH_LENGTH 256
+#define MAX_ERROR_LENGTH 512
+#define TAR_BLOCK_SIZE 512
+#define TAR_FILE_MODE 0644
+#define TAR_MAX_EXTENSION (1 << 20)
+#define NOTE_ENTRY_NAME ".keep-note"
+#define LOCK_PATH ".keep/lock"
+#define BASE_VERSION_PATH ".keep/base-version"
+#define OBJECTS_DIR ".keep/objects"
+#define OBJECT_INDEX_PATH ".keep/objects/index"
+#define OBJECT_INDEX_MAGIC "keepidx1"
+#define OBJECT_HASH_SIZE 32
+#define BLOOM_BLOCK_SIZE 64
+#define BLOOM_BITS_PER_OBJECT 10
+#define BLOOM_PROBES 7
+#define INDEX_MIN_JOURNAL_SLOTS 8192
+#define PACKS_DIR ".keep/packs"
+#define PACK_MAGIC "keeppck1"
+#define ACCESS_DIR ".keep/access"
+#define TIER_PRESET 7
+#define TIER_GROUP_SIZE (16 << 20)
+#define TIER_GRACE_SECONDS 3600
+#define INLINE_DEFAULT_LIMIT 4096
+#define INLINE_GROUP_SIZE (1 << 20)
+#define INLINE_PRESET 1
+#define INLINE_MERGE_PACKS 8
+#define AUTO_NOTE_PATHS 3
+#define AUTO_RETRY_SECONDS 1
+#define AUTO_MAX_RETRY_SECONDS 300
+#define LAYOUT_READAHEAD (16 << 20)
+#define SORT_DIR ".keep/sort"
+#define SORT_DEFAULT_MEMORY (64 << 20)
+#define SORT_MIN_MEMORY (1 << 20)
+#define SORT_MAX_RUNS 64
+#define MANIFEST_LINE_LENGTH (MAX_FILE_PATH_LENGTH + 128)
+#define LAYOUT_KEY_LENGTH 28    // "%016llx %010d " in front of the lines of a layout plan
+#define ALTERNATES_PATH ".keep/alternates"
+#define PATHS_DIR ".keep/paths"
+#define INDEXED_VERSION_PATH ".keep/paths/version"
+#define HASH_HEX_LENGTH 64
+#define URING_ENTRIES 128
+#define URING_BATCH_FILES 32
+#define URING_CHUNK_SIZE (128 * 1024)
+#define COPY_CHUNK_SIZE 65536
+#define DIRECT_ALIGNMENT 4096
+#define DROP_WINDOW (8 << 20)
+#define GREP_MAX_THREADS 16
+#define SCRUB_PROGRESS_PATH ".keep/scrub-progress"
+#define SCRUB_MAX_THREADS 16
+#define DIFF_RENAME_LIMIT 1000
+#define DIFF_CHUNK_LENGTH 64
+#define DIFF_MAX_SIMILARITY_SIZE (64 << 20)
+#define GREP_BINARY_PROBE 8000
+#define THROTTLE_CHUNK_SIZE (1 << 20)
+#define THROTTLE_ADJUST_INTERVAL 100000
+#define METRICS_PATH ".keep/metrics"
+#define METRICS_LOCK_PATH ".keep/metrics.lock"
+#define BISECT_LOCK_PATH ".keep/bisect/lock"
+#define BISECT_VERSION_PATH ".keep/bisect/version"
+#define BISECT_WORKTREE ".keep/bisect/worktree"
+#define LATENCY_BUCKETS 6
+
+// Build with -DKEEP_TRACE to enable keep_trace(); otherwise the TRACE_*
+// macros expand to nothing.
+#ifdef KEEP_TRACE
+#define MAX_TRACE_EVENTS 65536
+
+enum traceCounter {
+    TRACE_SYSCALLS,
+    TRACE_BYTES,
+    TRACE_FILES,
+    TRACE_COUNTER_COUNT
+};
+
+struct traceSpan {
+    const char* name;
+    long long start;
+};
+
+static struct traceSpan traceBegin(const char* name);
+static void traceEnd(struct traceSpan* span);
+static void traceCount(enum traceCounter counter, long long value);
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) \
+    struct traceSpan TRACE_CONCAT(traceSpan, __LINE__) __attribute__((cleanup(traceEnd))) = traceBegin(name)
+#define TRACE_COUNT(counter, value) traceCount(counter, value)
+#else
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_COUNT(counter, value) ((void)0)
+#endif
+
+struct fileStamp {
+    int valid;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+};
+
+struct trackedFile {
+    char path[MAX_FILE_PATH_LENGTH];
+    long mtime;
+};
+
+// Minimal io_uring submission/completion rings, driven with the raw
+// io_uring_setup/io_uring_enter system calls.
+struct uring {
+    int fd;
+    unsigned pending;
+    unsigned* sqTail;
+    unsigned sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+};
+
+// One keep_fsck run. Problems are reported from the calling thread only.
+struct fsckRun {
+    keep_ctx* ctx;
+    keep_fsck_callback callback;
+    void* arg;
+    struct keep_fsck_result* result;
+};
+
+// The objects of one .keep/objects/xx directory, hashed by a pool of
+// threads. Scrubbing a directory at a time bounds memory by the size of
+// the largest one rather than by the size of the store.
+struct scrubBatch {
+    keep_ctx* ctx;
+    char (*names)[HASH_HEX_LENGTH + 1];
+    char* states;
+    long long* sizes;
+    int numNames;
+    int capacity;
+    int next;
+    pthread_mutex_t throttleLock;
+};
+
+// A piece of a file as used for rename similarity: its hash and length.
+// Files are cut after each newline and at least every DIFF_CHUNK_LENGTH
+// bytes, so an edit only changes the pieces it touches.
+struct chunkPrint {
+    uint32_t hash;
+    uint32_t length;
+};
+
+struct diffSide {
+    struct versionFile* file;
+    struct chunkPrint* prints;
+    int numPrints;
+    int matched;
+};
+
+struct copyJob {
+    char source[MAX_FILE_PATH_LENGTH];
+    char target[MAX_FILE_PATH_LENGTH];
+};
+
+// A top-level entry that restore --swap moved into the working tree.
+struct swappedEntry {
+    char name[NAME_MAX + 1];
+    int exchanged;              // with a live entry, rather than moved
+};
+
+// One file of a stored version. Versions written before the object store
+// have no hash; their content lives under .keep/N/target/ instead.
+struct versionFile {
+    char path[MAX_FILE_PATH_LENGTH];
+    char hash[HASH_HEX_LENGTH + 1];
+    long long size;
+    long mtime;
+};
+
+// Token buckets for keep_set_throttle. Tokens accrue continuously at the
+// configured rates scaled by factor, and at most one second's worth is
+// banked. In adaptive mode factor follows the ratio of a fast and a slow
+// moving average of the time individual reads and writes take.
+struct throttle {
+    long long bytesPerSecond;
+    int opsPerSecond;
+    int adaptive;
+    double byteTokens;
+    double opTokens;
+    long long lastRefill;
+    double factor;
+    double fastLatency;
+    double slowLatency;
+    long long lastAdjust;
+};
+
+// Cumulative counters kept in .keep/metrics for keep_stats. A command counts
+// into ctx->metrics and adds its counts to the file when it finishes, so
+// reading them never means walking the repository.
+enum metric {
+    METRIC_STORES,
+    METRIC_STORE_FILES_SCANNED,
+    METRIC_STORE_FILES_CHANGED,
+    METRIC_STORE_FILES_REUSED,
+    METRIC_STORE_SCAN_MICROS,
+    METRIC_STORE_OBJECTS_MICROS,
+    METRIC_STORE_PUBLISH_MICROS,
+    METRIC_RESTORES,
+    METRIC_RESTORE_FILES,
+    METRIC_RESTORE_BYTES,
+    METRIC_OBJECTS_NEW,
+    METRIC_BYTES_NEW,
+    METRIC_BYTES_REUSED,
+    METRIC_COUNT
+};
+
+enum latency {
+    LATENCY_STORE,
+    LATENCY_RESTORE,
+    LATENCY_COUNT
+};
+
+// Latency buckets are cumulative, as in a Prometheus histogram; the last one
+// counts every command.
+struct metrics {
+    long long counters[METRIC_COUNT];
+    long long buckets[LATENCY_COUNT][LATENCY_BUCKETS + 1];
+    long long latencyMicros[LATENCY_COUNT];
+};
+
+// .keep/objects/index lists every object of this repository so that store
+// can tell whether it already has one without looking at the object
+// directories. The file is the header followed by
+//   - a blocked Bloom filter: a hash selects one 64-byte block, a cache
+//     line, and sets BLOOM_PROBES bits in it;
+//   - the binary object hashes in sorted order;
+//   - a journal of objects added since: an open-addressing table that
+//     writers fill in place and merge into the sorted part when it is half
+//     full, rewriting the file and sizing the filter for the new count.
+// Object hashes are SHA-256 and thus uniform, so their own bytes select
+// the block, the bits and the journal slot.
+struct objectIndexHeader {
+    char magic[8];
+    uint64_t bloomBlocks;       // a power of two
+    uint64_t sortedCount;
+    uint64_t journalSlots;      // a power of two
+    uint64_t journalCount;
+    char reserved[24];
+};
+
+struct objectIndex {
+    unsigned char* map;
+    size_t size;
+    struct objectIndexHeader* header;
+    unsigned char* bloom;
+    const unsigned char (*sorted)[OBJECT_HASH_SIZE];
+    unsigned char (*journal)[OBJECT_HASH_SIZE];
+    int failed;                 // no usable index until the next lockRepo
+};
+
+// keep tier moves objects that only old versions refer to into
+// .keep/packs/cold-N.pack, a series of xz streams called groups. Objects are
+// laid out by path and version, so that successive revisions of a file
+// share a group and compress against each other, and a group holds at most
+// TIER_GROUP_SIZE bytes, the dictionary size of TIER_PRESET, so that one
+// object never costs much more than that to read. cold-N.idx lists the
+// objects sorted by hash and is written last.
+//
+// Store writes new files of at most ctx->inlineLimit bytes into
+// inline-N.pack in the same format, in groups of INLINE_GROUP_SIZE. Those
+// objects have no loose copy to begin with, and restores decode each group
+// once instead of unpacking every object.
+struct packHeader {
+    char magic[8];
+    uint64_t count;
+    char reserved[16];
+};
+
+struct packEntry {
+    unsigned char hash[OBJECT_HASH_SIZE];
+    uint64_t group;             // offset of the group in the pack
+    uint64_t groupLength;
+    uint64_t offset;            // of the object in the uncompressed group
+    uint64_t size;
+};
+
+struct pack {
+    char path[MAX_FILE_PATH_LENGTH];
+    int isInline;               // an inline-N.pack
+    const struct packEntry* entries;
+    uint64_t count;
+    void* map;
+    size_t mapSize;
+};
+
+// keep_grep scans every distinct blob once, however many versions share
+// it, and then reports its matches for each version file referring to it.
+struct grepMatch {
+    long line;
+    char* text;
+};
+
+struct grepBlob {
+    char source[MAX_FILE_PATH_LENGTH];
+    int inlined;                // source is the inline pack that holds entry
+    struct packEntry entry;
+    struct grepMatch* matches;
+    int numMatches;
+    int failed;
+};
+
+struct grepRef {
+    int version;
+    int blob;
+    char path[MAX_FILE_PATH_LENGTH];
+    char key[MAX_FILE_PATH_LENGTH];
+    char hash[HASH_HEX_LENGTH + 1];
+};
+
+struct grepScan {
+    keep_ctx* ctx;
+    struct grepBlob* blobs;
+    int numBlobs;
+    int nextBlob;
+    const regex_t* regex;
+    const char* literal;
+    size_t literalLength;
+};
+
+struct tierObject {
+    char hash[HASH_HEX_LENGTH + 1];
+    char path[MAX_FILE_PATH_LENGTH];
+    int version;
+    long long size;
+};
+
+// Receives the uncompressed bytes of a group as they are decoded. Returns 0
+// for more, 1 to stop early and -1 on error.
+typedef int (*packConsumer)(const unsigned char* data, size_t length, uint64_t position, void* arg);
+
+// A group of an inline pack decoded in full.
+struct groupBuffer {
+    unsigned char* data;
+    size_t length;
+    size_t capacity;
+};
+
+// The new small objects of a store on their way into an inline pack: the
+// group being filled and the entries of the pack so far.
+struct inlineBatch {
+    char packPath[MAX_FILE_PATH_LENGTH];
+    char indexPath[MAX_FILE_PATH_LENGTH];
+    int fd;                     // -1 until the first group is written
+    uint64_t packOffset;
+    unsigned char* group;
+    size_t groupSize;
+    struct packEntry* entries;
+    int count;
+    int capacity;
+    int groupFirst;             // first entry of the group being filled
+};
+
+// Where mirrorInlineFile puts what it reads.
+struct inlineMirror {
+    keep_ctx* target;
+    struct inlineBatch* batch;
+    struct keep_mirror_result* result;
+};
+
+// Takes a file that readInlineFiles read, with its hash left empty, and its content.
+typedef int (*inlineConsumer)(keep_ctx* ctx, const struct versionFile* file, const unsigned char* data, void* arg);
+
+struct packSlice {
+    const struct packEntry* entry;
+    int fd;                     // -1 to only hash
+    struct sha256* sha;
+    unsigned char* copy;        // receives the bytes too, unless NULL
+};
+
+struct packScrub {
+    struct fsckRun* run;
+    const struct pack* pack;
+    const struct packEntry** entries;   // one group, by offset
+    int count;
+    int next;
+    struct sha256* sha;
+};
+
+// State of keep_auto: one inotify watch per directory holding tracked
+// files, and the tracked paths, sorted, with a flag for those that changed
+// since the last store.
+struct autoWatch {
+    int wd;
+    char dir[MAX_FILE_PATH_LENGTH];
+};
+
+struct autoState {
+    int fd;
+    int polling;                // inotify unavailable: store every interval
+    struct autoWatch* watches;
+    int numWatches;
+    int watchesCapacity;
+    char (*paths)[MAX_FILE_PATH_LENGTH];
+    char* changed;
+    int numPaths;
+};
+
+// The file list of a version read one entry at a time: as stored, in path
+// order (sorted through a temporary file when the list on disk is not), or
+// in the order planLayoutOrder put it, with a layout key in front of each
+// line. A stream without a file is empty.
+struct manifestStream {
+    FILE* file;
+    int version;
+    int hasManifest;            // legacy versions list "path mtime"
+    int keyed;
+    int hashLegacy;             // hash files that have no hash on the way
+    struct versionFile entry;
+};
+
+typedef int (*lineCompare)(const char* a, const char* b);
+
+// Sort key of a file for reads in physical order.
+struct layoutKey {
+    unsigned long long physical;
+    int index;
+};
+
+struct sha256 {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t blockLength;
+};
+
+struct keep_ctx {
+    int rootFd;
+    char error[MAX_ERROR_LENGTH];
+
+    // Cached copies of .keep/latest-version and .keep/tracking-files. They
+    // are reloaded only when the stamp of the file on disk changes.
+    int latestVersion;
+    struct fileStamp latestVersionStamp;
+    struct trackedFile* trackedFiles;
+    int numTrackedFiles;
+    int trackedFilesCapacity;
+    struct fileStamp trackingFilesStamp;
+
+    // Object directories of other repositories listed in .keep/alternates,
+    // reloaded the same way.
+    char (*alternates)[MAX_FILE_PATH_LENGTH];
+    int numAlternates;
+    struct fileStamp alternatesStamp;
+
+    // Notes of stored versions, indexed by version. A version never changes
+    // once stored, so entries stay valid for the lifetime of the context.
+    char** notes;
+    int notesCapacity;
+
+    // Numbers temporary object files so that they never collide.
+    int tempCounter;
+
+    // Object directories that gained entries since the last version was
+    // published, one bit per directory; see syncVersionData.
+    unsigned char unsyncedObjectDirs[256 / 8];
+
+    // Page cache policy of the current command, see keep_set_cache_policy.
+    enum keep_cache_policy cachePolicy;
+
+    // Read order of the current command, see keep_set_read_order, and
+    // whether .keep sits on a rotational disk: 0 until checked, then 1 or -1.
+    enum keep_read_order readOrder;
+    int rotational;
+
+    // Memory an external sort may use before it spills, see
+    // keep_set_memory_limit; 0 for SORT_DEFAULT_MEMORY.
+    long long memoryLimit;
+
+    // Files of at most this many bytes are stored in inline packs, see
+    // keep_set_inline_limit; 0 when every object is stored loose.
+    long long inlineLimit;
+
+    // Rate limits of the current command, see keep_set_throttle.
+    struct throttle throttle;
+
+    // What the current command did, until recordMetrics adds it to
+    // .keep/metrics.
+    struct metrics metrics;
+
+    // Mapped by the first lookup of a writer and dropped by the next
+    // lockRepo, since another process may have rewritten it in between.
+    struct objectIndex objectIndex;
+
+    // Indexes of .keep/packs, reloaded when the directory changes.
+    struct pack* packs;
+    int numPacks;
+    struct fileStamp packsStamp;
+
+    // Indexes of the packs of every alternate, mapped when an object is
+    // missing from this repository and reloaded when one of their
+    // directories changes. One stamp per alternate.
+    struct pack* alternatePacks;
+    int numAlternatePacks;
+    struct fileStamp* alternatePackStamps;
+    int numAlternatePackStamps;
+
+    // Set up by keep_set_io_backend(KEEP_IO_URING) and kept for later calls.
+    int useRing;
+    struct uring* ring;
+    char* ringBuffers;
+};
+
+static int setError(keep_ctx* ctx, int code, const char* format, ...);
+static int requireRepo(keep_ctx* ctx);
+static int lockRepo(keep_ctx* ctx);
+static void unlockRepo(int lockFd);
+static int removeTree(keep_ctx* ctx, const char* path);
+static int storeVersion(keep_ctx* ctx, const char* note, struct keep_store_result* result);
+static int restoreVersion(keep_ctx* ctx, int version, const char* toDir, int swap);
+static int importVersion(keep_ctx* ctx, int fd, int* version);
+static int prepareStagingDir(keep_ctx* ctx, int version, char* stagingDir, size_t size);
+static int publishVersion(keep_ctx* ctx, const char* stagingDir, int version);
+static int syncVersionData(keep_ctx* ctx, const char* stagingDir);
+static int syncPath(keep_ctx* ctx, const char* path);
+static int updatePathIndex(keep_ctx* ctx);
+static int indexVersionChanges(keep_ctx* ctx, int version, struct manifestStream* previous,
+                               struct manifestStream* files);
+static int appendPathChange(keep_ctx* ctx, const char* path, int version, const char* hash);
+static int readIndexedVersion(keep_ctx* ctx);
+static void pathIndexPath(const char* path, char* indexPath, size_t size);
+static int loadIndexedVersionFiles(keep_ctx* ctx, int version, struct versionFile** files, int* count);
+static const struct versionFile* findVersionFile(const struct versionFile* files, int count, const char* path);
+static int addChange(keep_ctx* ctx, int** changes, int* count, int* capacity, int change);
+static int collectGrepRefs(keep_ctx* ctx, const struct keep_grep_options* options, int first, int last,
+                           struct grepRef** refs, int* count);
+static int grepPathSelected(const struct keep_grep_options* options, const char* path);
+static int compareGrepRefKeys(const void* a, const void* b);
+static void regexLiteral(const char* pattern, char* literal, size_t size);
+static void* grepWorker(void* arg);
+static void grepBlob(struct grepScan* scan, struct grepBlob* blob);
+static int addGrepMatch(struct grepBlob* blob, long line, const char* text, size_t length);
+static void matchRenames(keep_ctx* ctx, int from, int to, struct diffSide* removed, int numRemoved,
+                         struct diffSide* added, int numAdded, int minSimilarity);
+static int compareDiffSideHashes(const void* a, const void* b);
+static int fingerprintFile(keep_ctx* ctx, int version, struct diffSide* side);
+static int compareChunkPrints(const void* a, const void* b);
+static int chunkSimilarity(const struct diffSide* a, const struct diffSide* b);
+static int compareDiffEntries(const void* a, const void* b);
+static void fsckProblem(struct fsckRun* run, const char* format, ...);
+static void fsckVersion(struct fsckRun* run, int version, struct versionFile** previous, int* numPrevious);
+static int scrubObjects(struct fsckRun* run, int restart);
+static int loadScrubBatch(struct scrubBatch* batch, int prefix);
+static void* scrubWorker(void* arg);
+static int scrubObject(struct scrubBatch* batch, int index);
+static int mirrorRepo(keep_ctx* ctx, const char* dir, int push, struct keep_mirror_result* result);
+static int copyMissingVersions(keep_ctx* source, keep_ctx* target, struct keep_mirror_result* result);
+static int copyVersion(keep_ctx* source, keep_ctx* target, int version, struct keep_mirror_result* result);
+static int sameVersion(keep_ctx* source, keep_ctx* target, int version);
+static int readBaseVersion(keep_ctx* ctx);
+static int updateBaseVersion(keep_ctx* ctx, int version);
+static FILE* repoOpen(keep_ctx* ctx, const char* path, const char* mode);
+static DIR* repoOpenDir(keep_ctx* ctx, const char* path);
+static int readStamp(keep_ctx* ctx, const char* path, struct fileStamp* stamp);
+static int sameStamp(const struct fileStamp* a, const struct fileStamp* b);
+
+static int readLatestVersion(keep_ctx* ctx);
+static int updateLatestVersion(keep_ctx* ctx, int latestVersion);
+static int loadTrackedFiles(keep_ctx* ctx);
+static int saveTrackedFiles(keep_ctx* ctx);
+static int addTrackedFile(keep_ctx* ctx, const char* path, long mtime);
+static int trackPath(keep_ctx* ctx, const char* path, int* added);
+static int checkModifiedFiles(keep_ctx* ctx);
+static int storeNoteForVersion(keep_ctx* ctx, const char* versionDir, const char* note);
+static int storeObjects(keep_ctx* ctx, const char* stagingDir, int* movedFiles);
+static long long* goneFileSizes(keep_ctx* ctx, const struct trackedFile** tracked, int numTracked,
+                                struct manifestStream* base, int* count);
+static int compareTrackedFiles(const void* a, const void* b);
+static int inlineFile(keep_ctx* ctx, struct inlineBatch* batch, struct versionFile* file);
+static int reserveInlineSpace(keep_ctx* ctx, struct inlineBatch* batch, size_t length);
+static int addInlineObject(keep_ctx* ctx, struct inlineBatch* batch, const char* hash, size_t length);
+static int appendInlineEntry(keep_ctx* ctx, struct inlineBatch* batch, const unsigned char* hash, size_t length);
+static int mirrorInlineFile(keep_ctx* ctx, const struct versionFile* file, const unsigned char* data, void* arg);
+static int flushInlineGroup(keep_ctx* ctx, struct inlineBatch* batch);
+static int finishInlineBatch(keep_ctx* ctx, struct inlineBatch* batch, int commit);
+static int flushPendingFiles(keep_ctx* ctx, FILE* manifest, const struct versionFile* files, int count,
+                             struct copyJob* jobs, struct versionFile** jobFiles, int numJobs);
+static int compareSizes(const void* a, const void* b);
+static int ingestFilesBatched(keep_ctx* ctx, struct copyJob* jobs, struct versionFile** files, int count);
+static int ingestFd(keep_ctx* ctx, int sourceFd, long long limit, char* hash, long long* size);
+static int hashFile(keep_ctx* ctx, const char* path, char* hash, long long* size);
+static int linkObject(keep_ctx* ctx, const char* tempPath, const char* hash, long long size);
+static int copyDataExtents(keep_ctx* ctx, int sourceFd, int targetFd, off_t size);
+static void nextDataExtent(int fd, off_t offset, off_t size, off_t* start, off_t* end);
+static void hashZeros(struct sha256* sha, long long count);
+static int isZeroBlock(const char* buf, size_t size);
+static unsigned char* snapshotResidency(int fd, off_t size);
+static int isRangeResident(const unsigned char* residency, off_t size, off_t offset, off_t length);
+static void dropWrittenPages(int fd);
+static int setDirect(int fd, int direct);
+static long long throttleBegin(keep_ctx* ctx, long long bytes, int ops);
+static void throttleEnd(keep_ctx* ctx, long long started, int ops);
+static long long monotonicMicros(void);
+static void observeLatency(struct metrics* metrics, enum latency latency, long long micros);
+static void recordMetrics(keep_ctx* ctx);
+static void loadMetrics(keep_ctx* ctx, struct metrics* metrics);
+static long long* findMetric(struct metrics* metrics, const char* name, int* micros);
+static void latencyBucketName(enum latency latency, int bucket, char* name, size_t size);
+static int writeMetrics(int fd, const struct metrics* metrics, int prometheus);
+static int writeMetricsSummary(int fd, const struct metrics* metrics);
+static void latencyQuantile(const struct metrics* metrics, enum latency latency, double quantile, char* text,
+                            size_t size);
+static void sleepMicros(long long micros);
+static void objectPath(const char* hash, char* path, size_t size);
+static int loadAlternates(keep_ctx* ctx);
+static int findObject(keep_ctx* ctx, const char* hash, char* path, size_t size);
+static int borrowObject(keep_ctx* ctx, const char* hash);
+static int openObjectIndex(keep_ctx* ctx);
+static void closeObjectIndex(keep_ctx* ctx);
+static int objectIndexLookup(keep_ctx* ctx, const char* hash);
+static void objectIndexAdd(keep_ctx* ctx, const char* hash);
+static int buildObjectIndex(keep_ctx* ctx);
+static int mergeObjectIndex(keep_ctx* ctx);
+static int writeObjectIndex(keep_ctx* ctx, const unsigned char (*a)[OBJECT_HASH_SIZE], uint64_t numA,
+                            const unsigned char (*b)[OBJECT_HASH_SIZE], uint64_t numB);
+static int parseObjectHash(const char* hex, unsigned char* hash);
+static int compareObjectHashes(const void* a, const void* b);
+static uint64_t hashWord(const unsigned char* hash, int word);
+static void bloomAdd(unsigned char* bloom, uint64_t blocks, const unsigned char* hash);
+static int bloomTest(const unsigned char* bloom, uint64_t blocks, const unsigned char* hash);
+static int tierObjects(keep_ctx* ctx, const struct keep_tier_options* options, struct keep_tier_result* result);
+static int isColdVersion(keep_ctx* ctx, int version, time_t now, const struct keep_tier_options* options);
+static void* growArray(void* array, int* capacity, int count, size_t itemSize);
+static int compareTierObjects(const void* a, const void* b);
+static int compareTierLayout(const void* a, const void* b);
+static int compareHashes(const void* a, const void* b);
+static int writePack(keep_ctx* ctx, struct tierObject* objects, int count, struct keep_tier_result* result);
+static int mergeInlinePacks(keep_ctx* ctx, time_t now, struct keep_tier_result* result);
+static int removeAbandonedPacks(keep_ctx* ctx, time_t now);
+static int comparePackEntryOffsets(const void* a, const void* b);
+static void newPackPaths(keep_ctx* ctx, const char* kind, char* packPath, char* indexPath, size_t size);
+static int writePackIndex(keep_ctx* ctx, const char* indexPath, struct packEntry* entries, int count);
+static int encodeChunk(lzma_stream* stream, const unsigned char* data, size_t length, lzma_action action, int fd,
+                       uint64_t* offset);
+static int comparePackEntries(const void* a, const void* b);
+static int loadPacks(keep_ctx* ctx);
+static int mapPacks(keep_ctx* ctx, const char* dirPath, struct pack** packs, int* count, int* capacity);
+static void freePacks(keep_ctx* ctx);
+static int loadAlternatePacks(keep_ctx* ctx);
+static void alternatePacksPath(const char* alternate, char* path, size_t size);
+static void freeAlternatePacks(keep_ctx* ctx);
+static int findPackedObject(keep_ctx* ctx, const char* hash, const struct pack** pack, const struct packEntry** entry);
+static int findAlternatePackedObject(keep_ctx* ctx, const char* hash, const struct pack** pack,
+                                     const struct packEntry** entry);
+static int searchPacks(const struct pack* packs, int count, const struct packEntry* key, const struct pack** pack,
+                       const struct packEntry** entry);
+static int decodePackGroup(keep_ctx* ctx, int fd, const struct packEntry* entry, packConsumer consume, void* arg);
+static int consumeSlice(const unsigned char* data, size_t length, uint64_t position, void* arg);
+static int thawObject(keep_ctx* ctx, const char* hash);
+static int findInlineObject(keep_ctx* ctx, const char* hash, const struct pack** pack, const struct packEntry** entry);
+static unsigned char* readPackedObject(keep_ctx* ctx, const char* packPath, const struct packEntry* entry);
+static int planFileSource(keep_ctx* ctx, int version, const struct versionFile* file, FILE** plan, char* path,
+                          size_t size);
+static int readInlineFiles(keep_ctx* ctx, FILE* plan, inlineConsumer consume, void* arg);
+static int consumeGroup(const unsigned char* data, size_t length, uint64_t position, void* arg);
+static int restoreInlineFile(keep_ctx* ctx, const struct versionFile* file, const unsigned char* data, void* arg);
+static int exportInlineFile(keep_ctx* ctx, const struct versionFile* file, const unsigned char* data, void* arg);
+static int scrubPacks(struct fsckRun* run);
+static int compareScrubEntries(const void* a, const void* b);
+static int consumeScrub(const unsigned char* data, size_t length, uint64_t position, void* arg);
+static void formatObjectHash(const unsigned char* hash, char* hex);
+static void recordVersionAccess(keep_ctx* ctx, int version);
+static int watchTrackedFiles(keep_ctx* ctx, struct autoState* state);
+static int readAutoEvents(struct autoState* state, int* rewatch);
+static void autoNote(const struct autoState* state, char* note, size_t size);
+static int comparePaths(const void* a, const void* b);
+static int nextBisectVersion(int good, int bad, const char* skipped, int first);
+static int checkoutBisectVersion(keep_ctx* ctx, int* current, int version);
+static int applyVersionDelta(keep_ctx* ctx, int from, int to, const char* dir);
+static int runBisectCommand(keep_ctx* ctx, const char* command, int version, enum keep_bisect_verdict* verdict);
+static int useLayoutOrder(keep_ctx* ctx);
+static void planLayoutOrder(keep_ctx* ctx, struct manifestStream* stream);
+static unsigned long long layoutKeyOf(keep_ctx* ctx, int version, const struct versionFile* file, int* packFds,
+                                      int numPackFds);
+static unsigned long long physicalOffset(int fd, off_t offset);
+static int compareLayoutKeys(const void* a, const void* b);
+static void tempObjectPath(keep_ctx* ctx, char* path, size_t size);
+static int loadVersionFiles(keep_ctx* ctx, int version, struct versionFile** files, int* count);
+static int parseManifestLine(char* line, struct versionFile* file);
+static int openManifestStream(keep_ctx* ctx, int version, int sorted, struct manifestStream* stream);
+static int nextManifestEntry(keep_ctx* ctx, struct manifestStream* stream);
+static void closeManifestStream(struct manifestStream* stream);
+static int appendVersionFile(keep_ctx* ctx, struct versionFile** files, int* count, int* capacity,
+                             const struct versionFile* file);
+static FILE* sortLines(keep_ctx* ctx, FILE* input, lineCompare compare);
+static FILE* mergeRuns(keep_ctx* ctx, FILE** runs, int count, lineCompare compare);
+static void siftRuns(int* heap, int size, int index, char (*lines)[MANIFEST_LINE_LENGTH], lineCompare compare);
+static FILE* createSortFile(keep_ctx* ctx);
+static int isSortedFile(FILE* file, lineCompare compare);
+static int compareLinePointers(const void* a, const void* b, void* compare);
+static int compareManifestLines(const char* a, const char* b);
+static const char* skipFields(const char* line, int count);
+static int compareTrackingLines(const char* a, const char* b);
+static int comparePathSpans(const char* a, size_t aLength, const char* b, size_t bLength);
+static int compareLines(const char* a, const char* b);
+static int writeManifest(keep_ctx* ctx, const char* dir, struct versionFile* files, int count);
+static void versionFileSource(keep_ctx* ctx, int version, const struct versionFile* file, char* path, size_t size);
+static int compareVersionFiles(const void* a, const void* b);
+static int removeNonTrackingFiles(keep_ctx* ctx);
+static int copyFileToTarget(keep_ctx* ctx, const char* source, const char* target);
+static int parseTrackingLine(char* line, char** path, long* mtime);
+static int refreshTrackingTimes(keep_ctx* ctx);
+static int makeParentDirs(keep_ctx* ctx, const char* path);
+static int cloneFileToTarget(keep_ctx* ctx, const char* source, const char* target);
+static int restoreFilesToDir(keep_ctx* ctx, int version, const char* dir);
+static int isDirectoryEmpty(keep_ctx* ctx, const char* dir);
+static int carryTrackedFiles(keep_ctx* ctx, const char* dir);
+static int swapIntoPlace(keep_ctx* ctx, const char* dir);
+static int exportFile(keep_ctx* ctx, int fd, const char* source, const char* name, long mtime);
+static int writeTarHeader(keep_ctx* ctx, int fd, const char* name, long long size, int mode, long mtime);
+static int parseTarHeader(const unsigned char* header, char* name, size_t nameSize, long long* size, long* mtime);
+static char* readTarExtension(int fd, long long size);
+static int parsePaxRecords(const char* data, long long size, char* name, size_t nameSize, long long* fileSize,
+                           long* mtime);
+static int forwardBytes(int inFd, int outFd, long long size);
+static int readFully(int fd, void* buf, size_t size);
+static int writeFully(int fd, const void* buf, size_t size);
+static int isSafeRelativePath(const char* path);
+static int statTrackedFiles(keep_ctx* ctx, long* mtimes);
+static int copyFilesBatched(keep_ctx* ctx, struct copyJob* jobs, int count);
+static int uringInit(struct uring* ring, unsigned entries);
+static void uringFree(struct uring* ring);
+static struct io_uring_sqe* uringGetSqe(struct uring* ring, unsigned long long userData);
+static int uringRun(struct uring* ring, int* results, int numResults);
+static void sha256Init(struct sha256* sha);
+static void sha256Update(struct sha256* sha, const void* data, size_t size);
+static void sha256Final(struct sha256* sha, char* hex);
+static void sha256Transform(struct sha256* sha, const unsigned char* block);
+
+struct metricInfo {
+    const char* name;           // in .keep/metrics; keep_ is prepended for Prometheus
+    const char* help;
+    int micros;                 // counted in microseconds, written in seconds
+};
+
+static const struct metricInfo metricInfos[METRIC_COUNT] = {
+    {"stores_total", "Store commands that completed.", 0},
+    {"store_files_scanned_total", "Tracked files checked for modifications by store.", 0},
+    {"store_files_changed_total", "Tracked files store found modified.", 0},
+    {"store_files_reused_total", "Unmodified or moved files store recorded without copying them again.", 0},
+    {"store_scan_seconds_total", "Time store spent looking for modified files.", 1},
+    {"store_objects_seconds_total", "Time store spent reading files into the object store.", 1},
+    {"store_publish_seconds_total", "Time store spent publishing versions.", 1},
+    {"restores_total", "Restore commands that completed.", 0},
+    {"restore_files_total", "Files written by restore.", 0},
+    {"restore_bytes_total", "Bytes written by restore.", 0},
+    {"objects_new_total", "Objects added to the object store.", 0},
+    {"bytes_new_total", "Bytes of objects added to the object store.", 0},
+    {"bytes_reused_total", "Bytes of content that was already stored and not stored again.", 0},
+};
+
+static const struct metricInfo latencyInfos[LATENCY_COUNT] = {
+    {"store_duration_seconds", "Duration of store commands.", 1},
+    {"restore_duration_seconds", "Duration of restore commands.", 1},
+};
+
+static const long long latencyBounds[LATENCY_BUCKETS] = {10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+static const char* latencyBoundNames[LATENCY_BUCKETS + 1] = {"0.01", "0.1", "1", "10", "100", "1000", "+Inf"};
+
+static const unsigned char emptySlot[OBJECT_HASH_SIZE];
+
+keep_ctx* keep_open(const char* repo_path, int* error) {
+    keep_ctx* ctx = calloc(1, sizeof(keep_ctx));
+    if (ctx == NULL) {
+        if (error != NULL) {
+            *error = KEEP_ERR_NO_MEMORY;
+        }
+        return NULL;
+    }
+
+    ctx->rootFd = open(repo_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ctx->rootFd < 0) {
+        if (error != NULL) {
+            *error = KEEP_ERR_IO;
+        }
+        free(ctx);
+        return NULL;
+    }
+
+    ctx->latestVersion = -1;
+    ctx->inlineLimit = INLINE_DEFAULT_LIMIT;
+    if (error != NULL) {
+        *error = KEEP_OK;
+    }
+    return ctx;
+}
+
+void keep_close(keep_ctx* ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+
+    close(ctx->rootFd);
+    free(ctx->trackedFiles);
+    free(ctx->alternates);
+    for (int i = 0; i < ctx->notesCapacity; i++) {
+        free(ctx->notes[i]);
+    }
+    free(ctx->notes);
+    if (ctx->ring != NULL) {
+        uringFree(ctx->ring);
+        free(ctx->ring);
+    }
+    free(ctx->ringBuffers);
+    closeObjectIndex(ctx);
+    freePacks(ctx);
+    freeAlternatePacks(ctx);
+    free(ctx);
+}
+
+const char* keep_error_message(const keep_ctx* ctx) {
+    return ctx->error;
+}
+
+int keep_set_io_backend(keep_ctx* ctx, enum keep_io_backend backend) {
+    if (backend == KEEP_IO_SYNC) {
+        ctx->useRing = 0;
+        return KEEP_OK;
+    }
+
+    if (ctx->ring == NULL) {
+        struct uring* ring = calloc(1, sizeof(struct uring));
+        char* buffers = malloc((size_t)URING_BATCH_FILES * URING_CHUNK_SIZE);
+        if (ring == NULL || buffers == NULL) {
+            free(ring);
+            free(buffers);
+            return setError(ctx, KEEP_ERR_NO_MEMORY, "Out of memory");
+        }
+
+        if (uringInit(ring, URING_ENTRIES) != 0) {
+            free(ring);
+            free(buffers);
+            return setError(ctx, KEEP_ERR_UNSUPPORTED, "io_uring is not available on this system");
+        }
+
+        ctx->ring = ring;
+        ctx->ringBuffers = buffers;
+    }
+
+    ctx->useRing = 1;
+    return KEEP_OK;
+}
+
+int keep_set_cache_policy(keep_ctx* ctx, enum keep_cache_policy policy) {
+    if (policy != KEEP_CACHE_NORMAL && policy != KEEP_CACHE_DROP && policy != KEEP_CACHE_DIRECT) {
+        return setError(ctx, KEEP_ERR_INVALID_ARGUMENT, "Invalid cache policy");
+    }
+    ctx->cachePolicy = policy;
+    return KEEP_OK;
+}
+
+int keep_set_read_order(keep_ctx* ctx, enum keep_read_order order) {
+    if (order != KEEP_ORDER_AUTO && order != KEEP_ORDER_PATH && order != KEEP_ORDER_PHYSICAL) {
+        return setError(ctx, KEEP_ERR_INVALID_ARGUMENT, "Invalid read order");
+    }
+    ctx->readOrder = order;
+    return KEEP_OK;
+}
+
+int keep_set_memory_limit(keep_ctx* ctx, long long bytes) {
+    if (bytes < 0) {
+        return setError(ctx, KEEP_ERR_INVALID_ARGUMENT, "Invalid memory limit");
+    }
+    ctx->memoryLimit = bytes > 0 && bytes < SORT_MIN_MEMORY ? SORT_MIN_MEMORY : bytes;
+    return KEEP_OK;
+}
+
+int keep_set_inline_limit(keep_ctx* ctx, long long bytes) {
+    if (bytes < 0) {
+        ctx->inlineLimit = INLINE_DEFAULT_LIMIT;
+    } else {
+        ctx->inlineLimit = bytes > INLINE_GROUP_SIZE ? INLINE_GROUP_SIZE : bytes;
+    }
+    return KEEP_OK;
+}
+
+int keep_set_throttle(keep_ctx* ctx, const struct keep_throttle* throttle) {
+    struct throttle* state = &ctx->throttle;
+    if (throttle == NULL) {
+        memset(state, 0, sizeof(*state));
+        return KEEP_OK;
+    }
+    if (throttle->bytes_per_second < 0 || throttle->ops_per_second < 0) {
+        return setError(ctx, KEEP_ERR_INVALID_ARGUMENT, "Invalid throttle rate");
+    }
+
+    state->bytesPerSecond = throttle->bytes_per_second;
+    state->opsPerSecond = throttle->ops_per_second;
+    state->adaptive = throttle->adaptive != 0;
+    state->byteTokens = state->bytesPerSecond;
+    state->opTokens = state->opsPerSecond;
+    state->lastRefill = monotonicMicros();
+    state->factor = 1.0;
+    state->fastLatency = 0;
+    state->slowLatency = 0;
+    state->lastAdjust = state->lastRefill;
+    return KEEP_OK;
+}
+
+int keep_add_alternate(keep_ctx* ctx, const char* dir) {
+    TRACE_SCOPE("addAlternate");
+
+    int error = requireRepo(ctx);
+    if (error != KEEP_OK) {
+        return error;
+    }
+
+    // Alternates are stored as absolute paths to the object directory so
+    // that they resolve the same way from every process.
+    char keepDir[PATH_MAX];
+    char resolved[PATH_MAX];
+    struct stat otherStat;
+    struct stat ownStat;
+    snprintf(keepDir, sizeof(keepDir), "%s/.keep", dir);
+    if (realpath(keepDir, resolved) == NULL || stat(resolved, &otherStat) != 0 || !S_ISDIR(otherStat.st_mode)) {
+        return setError(ctx, KEEP_ERR_NO_REPO, "'%s' is not a keep repository", dir);
+    }
+    if (fstatat(ctx->rootFd, ".keep", &ownStat, 0) == 0 && ownStat.st_dev == otherStat.st_dev &&
+        ownStat.st_ino == otherStat.st_ino) {
+        return setError(ctx, KEEP_ERR_INVALID_ARGUMENT, "'%s' is this repository", dir);
+    }
+
+    char alternate[MAX_FILE_PATH_LENGTH];
+    if (strlen(resolved) + strlen("/objects/xx/") + HASH_HEX_LENGTH - 2 >= sizeof(alternate)) {
+        return setError(ctx, KEEP_ERR_INVALID_ARGUMENT, "Path of '%s' is too long", dir);
+    }
+    snprintf(alternate, sizeof(alternate), "%s/objects", resolved);
+
+    int lockFd = lockRepo(ctx);
+    if (lockFd < 0) {
+        return KEEP_ERR_IO;
+    }
+
+    error = loadAlternates(ctx) == 0 ? KEEP_OK : KEEP_ERR_IO;
+    for (int i = 0; i < ctx->numAlternates && error == KEEP_OK; i++) {
+        if (strcmp(ctx->alternates[i], alternate) == 0) {
+            error = setError(ctx, KEEP_ERR_EXISTS, "'%s' is already an alternate", dir);
+        }
+    }
+
+    if (error == KEEP_OK) {
+        FILE* alternates = repoOpen(ctx, ALTERNATES_PATH, "a");
+        if (alternates == NULL) {
+            error = setError(ctx, KEEP_ERR_IO, "Failed to open alternates file");
+        } else {
+            fprintf(alternates, "%s\n", alternate);
+            if (fclose(alternates) != 0) {
+                error = setError(ctx, KEEP_ERR_IO, "Failed to write alternates file");
+            }
+        }
+    }
+
+    unlockRepo(lockFd);
+    return error;
+}
+
+int keep_init(keep_ctx* ctx) {
+    struct stat st;
+    if (fstatat(ctx->rootFd, ".keep", &st, 0) == 0) {
+        return setError(ctx, KEEP_ERR_EXISTS, ".keep directory already exists");
+    }
+
+    if (mkdirat(ctx->rootFd, ".keep", 0700) != 0) {
+        return setError(ctx, KEEP_ERR_IO, "Failed to create .keep directory");
+    }
+
+    FILE* trackingFiles = repoOpen(ctx, ".keep/tracking-files", "w");
+    if (trackingFiles == NULL) {
+        return setError(ctx, KEEP_ERR_IO, "Failed to create tracking-files file");
+    }
+    fclose(trackingFiles);
+
+    FILE* latestVersionFile = repoOpen(ctx, ".keep/latest-version", "w");
+    if (latestVersionFile == NULL) {
+        return setError(ctx, KEEP_ERR_IO, "Failed to create latest-version file");
+    }
+    fprintf(latestVersionFile, "0");
+    fclose(latestVersionFile);
+
+    return KEEP_OK;
+}
+
+int keep_track(keep_ctx* ctx, const char* path, int* tracked_files) {
+    int result = requireRepo(ctx);
+    if (result != KEEP_OK) {
+        return result;
+    }
+
+    int lockFd = lockRepo(ctx);
+    if (lockFd < 0) {
+        return KEEP_ERR_IO;
+    }
+
+    int added = 0;
+    if ((result = loadTrackedFiles(ctx)) == KEEP_OK &&
+        (result = trackPath(ctx, path, &added)) == KEEP_OK) {
+        result = saveTrackedFiles(ctx);
+    }
+    unlockRepo(lockFd);
+
+    if (tracked_files != NULL) {
+        *tracked_files = added;
+    }
+    return result;
+}
+
+int keep_untrack(keep_ctx* ctx, const char* path) {
+    int result = requireRepo(ctx);
+    if (result != KEEP_OK) {
+        return result;
+    }
+
+    int lockFd = lockRepo(ctx);
+    if (lockFd < 0) {
+        return KEEP_ERR_IO;
+    }
+
+    if ((result = loadTrackedFiles(ctx)) != KEEP_OK) {
+        unlockRepo(lockFd);
+        return result;
+    }
+
+    size_t pathLength = strlen(path);
+    int kept = 0;
+    for (int i = 0; i < ctx->numTrackedFiles; i++) {
+        const char* trackedPath = ctx->trackedFiles[i].path;
+        int matches = strcmp(trackedPath, path) == 0 ||
+                      (strncmp(trackedPath, path, pathLength) == 0 && trackedPath[pathLength] == '/');
+        if (!matches) {
+            ctx->trackedFiles[kept++] = ctx->trackedFiles[i];
+        }
+    }
+
+    if (kept == ctx->numTrackedFiles) {
+        result = setError(ctx, KEEP_ERR_NOT_TRACKED, "'%s' is not tracked", path);
+    } else {
+        ctx->numTrackedFiles = kept;
+        result = saveTrackedFiles(ctx);
+    }
+
+    unlockRepo(lockFd);
+    return result;
+}
+
+int keep_status(keep_ctx* ctx, struct keep_status* status) {
+    int result = requireRepo(ctx);
+    if (result != KEEP_OK) {
+        return result;
+    }
+
+    int latestVersion = readLatestVersion(ctx);
+    if (latestVersion < 0) {
+        return KEEP_ERR_IO;
+    }
+
+    int modifiedFiles = checkModifiedFiles(ctx);
+    if (modifiedFiles < 0) {
+        return KEEP_ERR_IO;
+    }
+
+    status->latest_version = latestVersion;
+    status->tracked_files = ctx->numTrackedFiles;
+    status->modified_files = modifiedFiles;
+    return KEEP_OK;
+}
+
+int keep_note(keep_ctx* ctx, int version, char* note, size_t size) {
+    if (version > 0 && version < ctx->notesCapacity && ctx->notes[version] != NULL) {
+        snprintf(note, size, "%s", ctx->notes[version]);
+        return KEEP_OK;
+    }
+
+    char notePath[MAX_FILE_PATH_LENGTH];
+    snprintf(notePath, sizeof(notePath), ".keep/%d/target/note", version);
+
+    FILE* noteFile = repoOpen(ctx, notePath, "r");
+    if (noteFile == NULL) {
+        return setError(ctx, KEEP_ERR_IO, "Failed to open note file for version %d", version);
+    }
+
+    if (fgets(note, size, noteFile) == NULL) {
+        note[0] = '\0';
+    }
+    note[strcspn(note, "\n")] = '\0';
+    fclose(noteFile);
+
+    if (version >= ctx->notesCapacity) {
+        int capacity = version + 64;
+        char** notes = realloc(ctx->notes, capacity * sizeof(char*));
+        if (notes == NULL) {
+            return KEEP_OK;
+        }
+        memset(notes + ctx->notesCapacity, 0, (capacity - ctx->notesCapacity) * sizeof(char*));
+        ctx->notes = notes;
+        ctx->notesCapacity = capacity;
+    }
+    ctx->notes[version] = strdup(note);
+    return KEEP_OK;
+}
+
+int keep_store(keep_ctx* ctx, const char* note, struct keep_store_result* result) {
+    TRACE_SCOPE("store");
+    memset(result, 0, sizeof(*result));
+
+    int error = requireRepo(ctx);
+    if (error != KEEP_OK) {
+        return error;
+    }
+
+    int lockFd = lockRepo(ctx);
+    if (lockFd < 0) {
+        return KEEP_ERR_IO;
+    }
+
+    long long started = monotonicMicros();
+    error = storeVersion(ctx, note, result);
+    unlockRepo(lockFd);
+
+    // Only stores that published a version count; a no-op store would
+    // inflate the count and pull the latencies down.
+    if (error == KEEP_OK && result->version > 0) {
+        ctx->metrics.counters[METRIC_STORES]++;
+        observeLatency(&ctx->metrics, LATENCY_STORE, monotonicMicros() - started);
+    }
+    recordMetrics(ctx);
+    return error;
+}
+
+static int storeVersion(keep_ctx* ctx, const char* note, struct keep_store_result* result) {
+    int latestVersion = readLatestVersion(ctx);
+    if (latestVersion < 0) {
+        return KEEP_ERR_IO;
+    }
+
+    long long scanStarted = monotonicMicros();
+    int modifiedFiles = checkModifiedFiles(ctx);
+    if (modifiedFiles < 0) {
+        return KEEP_ERR_IO;
+    }
+
+    long long* counters = ctx->metrics.counters;
+    counters[METRIC_STORE_SCAN_MICROS] += monotonicMicros() - scanStarted;
+    counters[METRIC_STORE_FILES_SCANNED] += ctx->numTrackedFiles;
+    counters[METRIC_STORE_FILES_CHANGED] += modifiedFiles;
+
+    result->modified_files = modifiedFiles;
+    if (modifiedFiles == 0) {
+        return KEEP_OK;
+    }
+
+    char stagingDir[MAX_FILE_PATH_LENGTH];
+    if (prepareStagingDir(ctx, latestVersion + 1, stagingDir, sizeof(stagingDir)) != 0) {
+        return KEEP_ERR_IO;
+    }
+
+    long long objectsStarted = monotonicMicros();
+    if (storeObjects(ctx, stagingDir, &result->moved_files) != 0) {
+        return KEEP_ERR_IO;
+    }
+
+    long long publishStarted = monotonicMicros();
+    counters[METRIC_STORE_OBJECTS_MICROS] += publishStarted - objectsStarted;
+    if (storeNoteForVersion(ctx, stagingDir, note) != 0 ||
+        publishVersion(ctx, stagingDir, latestVersion + 1) != 0 ||
+        updateBaseVersion(ctx, latestVersion + 1) != 0 ||
+        refreshTrackingTimes(ctx) != 0) {
+        return KEEP_ERR_IO;
+    }
+    counters[METRIC_STORE_PUBLISH_MICROS] += monotonicMicros() - publishStarted;
+
+    result->version = latestVersion + 1;
+    result->stored_files = ctx->numTrackedFiles;
+    return KEEP_OK;
+}
+
+int keep_restore(keep_ctx* ctx, int version, const struct keep_restore_options* options) {
+    TRACE_SCOPE("restore");
+    const char* toDir = options != NULL ? options->to_dir : NULL;
+    int swap = options != NULL && options->swap;
+
+    int error = requireRepo(ctx);
+    if (error != KEEP_OK) {
+        return error;
+    }
+
+    if (swap && toDir == NULL) {
+        return setError(ctx, KEEP_ERR_INVALID_ARGUMENT, "--swap requires --to DIR");
+    }
+
+    // Restoring into a separate directory only reads a published version;
+    // replacing the working tree also rewrites tracking-files.
+    long long started = monotonicMicros();
+    if (toDir != NULL && !swap) {
+        error = restoreVersion(ctx, version, toDir, swap);
+    } else {
+        int lockFd = lockRepo(ctx);
+        if (lockFd < 0) {
+            return KEEP_ERR_IO;
+        }
+        error = restoreVersion(ctx, version, toDir, swap);
+        unlockRepo(lockFd);
+    }
+
+    if (error == KEEP_OK) {
+        recordVersionAccess(ctx, version);
+        ctx->metrics.counters[METRIC_RESTORES]++;
+        observeLatency(&ctx->metrics, LATENCY_RESTORE, monotonicMicros() - started);
+    }
+    recordMetrics(ctx);
+    return error;
+}
+
+static int restoreVersion(keep_ctx* ctx, int version, const char* toDir, int swap) {
+    int latestVersion = readLatestVersion(ctx);
+    if (latestVersion < 0) {
+        return KEEP_ERR_IO;
+    }
+
+    // Restoring into a separate directory leaves the working tree alone,
+    // so pending modifications only matter when it is going to be replaced.
+    if (toDir == NULL || swap) {
+        int modifiedFiles = checkModifiedFiles(ctx);
+        if (modifiedFiles < 0) {
+            return KEEP_ERR_IO;
+        }
+
+        if (modifiedFiles > 0) {
+            return setError(ctx, KEEP_ERR_MODIFIED, "There are modified files. Please store the changes before restoring");
+        }
+    }
+
+    if (version <= 0 || version > latestVersion) {
+        return setError(ctx, KEEP_ERR_INVALID_VERSION, "Invalid version number");
+    }
+
+    if (toDir == NULL) {
+        if (restoreFilesToDir(ctx, version, ".") != 0 ||
+            removeNonTrackingFiles(ctx) != 0 ||
+            updateBaseVersion(ctx, version) != 0 ||
+            refreshTrackingTimes(ctx) != 0) {
+            return KEEP_ERR_IO;
+        }
+        return KEEP_OK;
+    }
+
+    if (mkdirat(ctx->rootFd, toDir, 0700) != 0 && errno != EEXIST) {
+        return setError(ctx, KEEP_ERR_IO, "Failed to create directory '%s'", toDir);
+    }
+
+    if (!isDirectoryEmpty(ctx, toDir)) {
+        return setError(ctx, KEEP_ERR_EXISTS, "Directory '%s' is not empty", toDir);
+    }
+
+    if (restoreFilesToDir(ctx, version, toDir) != 0) {
+        return KEEP_ERR_IO;
+    }
+
+    if (!swap) {
+        return KEEP_OK;
+    }
+
+    if (carryTrackedFiles(ctx, toDir) != 0 ||
+        swapIntoPlace(ctx, toDir) != 0 ||
+        updateBaseVersion(ctx, version) != 0 ||
+        refreshTrackingTimes(ctx) != 0) {
+        return KEEP_ERR_IO;
+    }
+    return KEEP_OK;
+}
+
+int keep_export(keep_ctx* ctx, int version, int fd) {
+    TRACE_SCOPE("export");
+
+    int error = requireRepo(ctx);
+    if (error != KEEP_OK) {
+        return error;
+    }
+
+    int latestVersion = readLatestVersion(ctx);
+    if (latestVersion < 0) {
+        return KEEP_ERR_IO;
+    }
+
+    if (version <= 0 || version > latestVersion) {
+        return setError(ctx, KEEP_ERR_INVALID_VERSION, "Invalid version number");
+    }
+
+    struct manifestStream stream;
+    if (openManifestStream(ctx, version, 0, &stream) != 0) {
+        return KEEP_ERR_IO;
+    }
+
+    char notePath[MAX_FILE_PATH_LENGTH];
+    snprintf(notePath, sizeof(notePath), ".keep/%d/target/note", version);
+
+    // Files from inline packs go last, a group at a time.
+    FILE* inlinePlan = NULL;
+    planLayoutOrder(ctx, &stream);
+    int result = exportFile(ctx, fd, notePath, NOTE_ENTRY_NAME, -1);
+
+    for (int status; result == 0 && (status = nextManifestEntry(ctx, &stream)) != 0;) {
+        if (status < 0) {
+            result = -1;
+            break;
+        }
+        char sourceFile[MAX_FILE_PATH_LENGTH];
+        int deferred = planFileSource(ctx, version, &stream.entry, &inlinePlan, sourceFile, sizeof(sourceFile));
+        if (deferred != 0) {
+            result = deferred < 0 ? -1 : 0;
+        } else {
+            result = exportFile(ctx, fd, sourceFile, stream.entry.path, stream.entry.mtime);
+        }
+    }
+
+    closeManifestStream(&stream);
+    if (result == 0 && inlinePlan != NULL) {
+        result = readInlineFiles(ctx, inlinePlan, exportInlineFile, &fd);
+    } else if (inlinePlan != NULL) {
+        fclose(inlinePlan);
+    }
+
+    if (result != 0) {
+        return KEEP_ERR_IO;
+    }
+
+    // A tar archive ends with two zero blocks.
+    char zeros[TAR_BLOCK_SIZE * 2] = {0};
+    if (writeFully(fd, zeros, sizeof(zeros)) != 0) {
+        return setError(ctx, KEEP_ERR_IO, "Failed to write export stream");
+    }
+    return KEEP_OK;
+}
+
+int keep_list(keep_ctx* ctx, int version, keep_list_callback callback, void* arg) {
+    int error = requireRepo(ctx);
+    if (error != KEEP_OK) {
+        return error;
+    }
+
+    int latestVersion = readLatestVersion(ctx);
+    if (latestVersion < 0) {
+        return KEEP_ERR_IO;
+    }
+
+    if (version <= 0 || version > latestVersion) {
+        return setError(ctx, KEEP_ERR_INVALID_VERSION, "Invalid version number");
+    }
+
+    struct versionFile* files;
+    int numFiles;
+    if (loadVersionFiles(ctx, version, &files, &numFiles) != 0) {
+        return KEEP_ERR_IO;
+    }
+
+    int result = KEEP_OK;
+    for (int i = 0; i < numFiles && result == KEEP_OK; i++) {
+        result = callback(files[i].path, files[i].mtime, arg);
+    }
+
+    free(files);
+    return result;
+}
+
+int keep_cat(keep_ctx* ctx, int version, const char* path, int fd) {
+    int error = requireRepo(ctx);
+    if (error != KEEP_OK) {
+        return error;
+    }
+
+    int latestVersion = readLatestVersion(ctx);
+    if (latestVersion < 0) {
+        return KEEP_ERR_IO;
+    }
+
+    if (version <= 0 || version > latestVersion) {
+        return setError(ctx, KEEP_ERR_INVALID_VERSION, "Invalid version number");
+    }
+
+    struct versionFile* files;
+    int numFiles;
+    if (loadVersionFiles(ctx, version, &files, &numFiles) != 0) {
+        return KEEP_ERR_IO;
+    }
+
+    int found = -1;
+    for (int i = 0; i < numFiles && found < 0; i++) {
+        if (strcmp(files[i].path, path) == 0) {
+            found = i;
+        }
+    }
+
+    char sourceFile[MAX_FILE_PATH_LENGTH];
+    const struct pack* pack;
+    const struct packEntry* entry;
+    int inlined = found >= 0 && findInlineObject(ctx, files[found].hash, &pack, &entry) == 0;
+    if (found >= 0 && !inlined) {
+        versionFileSource(ctx, version, &files[found], sourceFile, sizeof(sourceFile));
+    }
+    free(files);
+
+    if (found < 0) {
+        return setError(ctx, KEEP_ERR_NOT_TRACKED, "'%s' is not in version %d", path, version);
+    }
+    if (inlined) {
+        unsigned char* data = readPackedObject(ctx, pack->path, entry);
+        if (data == NULL) {
+            return setError(ctx, KEEP_ERR_IO, "Failed to read '%s' from '%s'", path, pack->path);
+        }
+        int result = writeFully(fd, data, entry->size) == 0 ? KEEP_OK :
+                     setError(ctx, KEEP_ERR_IO, "Failed to write '%s'", path);
+        free(data);
+        return result;
+    }
+
+    int sourceFd = openat(ctx->rootFd, sourceFile, O_RDONLY | O_CLOEXEC);
+    if (sourceFd < 0) {
+        return setError(ctx, KEEP_ERR_IO, "Failed to open file '%s'", sourceFile);
+    }
+
+    struct stat fileStat;
+    if (fstat(sourceFd, &fileStat) != 0 || forwardBytes(sourceFd, fd, fileStat.st_size) != 0) {
+        close(sourceFd);
+        return setError(ctx, KEEP_ERR_IO, "Failed to write '%s'", path);
+    }
+    close(sourceFd);
+    return KEEP_OK;
+}
+
+int keep_log(keep_ctx* ctx, const char* path, keep_log_callback callback, void* arg) {
+    TRACE_SCOPE("log");
+
+    int error = requireRepo(ctx);
+    if (error != KEEP_OK) {
+        return error;
+    }
+
+    // The marker is read before the index so that every line up to it is
+    // known to be complete; later lines are ignored, and versions after it
+    // are compared from their manifests instead.
+    int indexed = readIndexedVersion(ctx);
+    int latestVersion = readLatestVersion(ctx);
+    if (latestVersion < 0) {
+        return KEEP_ERR_IO;
+    }
+    if (indexed > latestVersion) {
+        indexed = latestVersion;
+    }
+
+    // A change is kept as its version, negated when the file was removed.
+    // Lines a crashed writer appended twice are skipped.
+    int* changes = NULL;
+    int numChanges = 0;
+    int capacity = 0;
+    int result = 0;
+
+    char indexPath[MAX_FILE_PATH_LENGTH];
+    pathIndexPath(path, indexPath, sizeof(indexPath));
+    FILE* index = indexed > 0 ? repoOpen(ctx, indexPath, "r") : NULL;
+    char header[MAX_FILE_PATH_LENGTH + 1];
+    if (index != NULL && fgets(header, sizeof(header), index) != NULL) {
+        header[strcspn(header, "\n")] = '\0';
+        char line[HASH_HEX_LENGTH + 32];
+        int lastVersion = 0;
+        while (result == 0 && strcmp(header, path) == 0 && fgets(line, sizeof(line), index) != NULL) {
+            int version;
+            char hash[HASH_HEX_LENGTH + 1];
+            if (sscanf(line, "%d %64s", &version, hash) != 2 || version <= lastVersion || version > indexed) {
+                continue;
+            }
+            result = addChange(ctx, &changes, &numChanges, &capacity, strcmp(hash, "-") == 0 ? -version : version);
+            lastVersion = version;
+        }
+    }
+    if (index != NULL) {
+        fclose(index);
+    }
+
+    struct versionFile* previous = NULL;
+    int numPrevious = 0;
+    if (result == 0 && indexed > 0 && indexed < latestVersion &&
+        loadIndexedVersionFiles(ctx, indexed, &previous, &numPrevious) != 0) {
+        result = -1;
+    }
+    for (int version = indexed + 1; version <= latestVersion && result == 0; version++) {
+        struct versionFile* files;
+        int numFiles;
+        if (loadIndexedVersionFiles(ctx, version, &files, &numFiles) != 0) {
+            result = -1;
+            break;
+        }
+
+        const struct versionFile* before = findVersionFile(previous, numPrevious, path);
+        const struct versionFile* after = findVersionFile(files, numFiles, path);
+        int change = 0;
+        if (after != NULL && (before == NULL || strcmp(before->hash, after->hash) != 0)) {
+            change = version;
+        } else if (after == NULL && before != NULL) {
+            change = -version;
+        }
+        free(previous);
+        previous = files;
+        numPrevious = numFiles;
+        if (change != 0) {
+            result = addChange(ctx, &changes, &numChanges, &capacity, change);
+        }
+    }
+    free(previous);
+
+    if (result != 0 || numChanges == 0) {
+        free(changes);
+        return result != 0 ? KEEP_ERR_IO : setError(ctx, KEEP_ERR_NOT_TRACKED, "'%s' is not in any version", path);
+    }
+
+    result = KEEP_OK;
+    for (int i = numChanges - 1; i >= 0 && result == KEEP_OK; i--) {
+        result = callback(changes[i] < 0 ? -changes[i] : changes[i], changes[i] < 0, arg);
+    }
+    free(changes);
+    return result;
+}
+
+int keep_grep(keep_ctx* ctx, const struct keep_grep_options* options, keep_grep_callback callback, void* arg) {
+    TRACE_SCOPE("grep");
+
+    int error = requireRepo(ctx);
+    if (error != KEEP_OK) {
+        return error;
+    }
+
+    int latestVersion = readLatestVersion(ctx);
+    if (latestVersion < 0) {
+        return KEEP_ERR_IO;
+    }
+
+    int first = options->first_version > 0 ? options->first_version : 1;
+    int last = options->last_version > 0 ? options->last_version : latestVersion;
+    if (first > last || last > latestVersion) {
+        return setError(ctx, KEEP_ERR_INVALID_VERSION, "Invalid version number");
+    }
+    if (options->pattern == NULL || options->pattern[0] == '\0') {
+        return setError(ctx, KEEP_ERR_INVALID_ARGUMENT, "Empty pattern");
+    }
+
+    // Lines are found through a literal that every match must contain, so
+    // most of the data is only ever seen by memmem(). A fixed pattern is
+    // its own literal; a regular expression is checked on the candidate
+    // lines only, or on every line when it has no such literal.
+    regex_t regex;
+    char literal[MAX_FILE_PATH_LENGTH] = "";
+    if (!options->fixed) {
+        if (regcomp(&regex, options->pattern, REG_EXTENDED | REG_NOSUB | REG_NEWLINE) != 0) {
+            return setError(ctx, KEEP_ERR_INVALID_ARGUMENT, "Invalid pattern '%s'", options->pattern);
+        }
+        regexLiteral(options->pattern, literal, sizeof(literal));
+    }
+
+    struct grepRef* refs = NULL;
+    int numRefs = 0;
+    if (collectGrepRefs(ctx, options, first, last, &refs, &numRefs) != 0) {
+        if (!options->fixed) {
+            regfree(&regex);
+        }
+        return KEEP_ERR_IO;
+    }
+
+    // Versions share objects, so sorting references by object gives the
+    // distinct blobs; each reference then points at its blob.
+    struct grepRef** byKey = malloc((numRefs + 1) * sizeof(struct grepRef*));
+    struct grepBlob* blobs = calloc(numRefs + 1, sizeof(struct grepBlob));
+    int numBlobs = 0;
+    if (byKey == NULL || blobs == NULL) {
+        free(byKey);
+        free(blobs);
+        free(refs);
+        if (!options->fixed) {
+            regfree(&regex);
+        }
+        return setError(ctx, KEEP_ERR_NO_MEMORY, "Out of memory");
+    }
+    for (int i = 0; i < numRefs; i++) {
+        byKey[i] = &refs[i];
+    }
+    qsort(byKey, numRefs, sizeof(struct grepRef*), compareGrepRefKeys);
+    for (int i = 0; i < numRefs; i++) {
+        if (i == 0 || strcmp(byKey[i]->key, byKey[i - 1]->key) != 0) {
+            struct grepBlob* blob = &blobs[numBlobs++];
+            const struct pack* pack;
+            const struct packEntry* entry;
+            if (findInlineObject(ctx, byKey[i]->hash, &pack, &entry) == 0) {
+                snprintf(blob->source, MAX_FILE_PATH_LENGTH, "%s", pack->path);
+                blob->inlined = 1;
+                blob->entry = *entry;
+            } else {
+                snprintf(blob->source, MAX_FILE_PATH_LENGTH, "%s", byKey[i]->key);
+            }
+        }
+        byKey[i]->blob = numBlobs - 1;
+    }
+    free(byKey);
+
+    const char* needle = options->fixed ? options->pattern : literal;
+    struct grepScan scan = {ctx, blobs, numBlobs, 0, options->fixed ? NULL : &regex, needle, strlen(needle)};
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    int numThreads = processors < 1 ? 1 : processors > GREP_MAX_THREADS ? GREP_MAX_THREADS : (int)processors;
+    if (numThreads > numBlobs) {
+        numThreads = numBlobs;
+    }
+
+    pthread_t threads[GREP_MAX_THREADS];
+    int started = 0;
+    while (started < numThreads - 1 && pthread_create(&threads[started], NULL, grepWorker, &scan) == 0) {
+        started++;
+    }
+    grepWorker(&scan);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    if (!options->fixed) {
+        regfree(&regex);
+    }
+
+    int result = KEEP_OK;
+    for (int i = 0; i < numBlobs && result == KEEP_OK; i++) {
+        if (blobs[i].failed) {
+            result = setError(ctx, KEEP_ERR_IO, "Failed to read '%s'", blobs[i].source);
+        }
+    }
+    for (int i = 0; i < numRefs && result == KEEP_OK; i++) {
+        struct grepBlob* blob = &blobs[refs[i].blob];
+        for (int j = 0; j < blob->numMatches && result == KEEP_OK; j++) {
+            result = callback(refs[i].version, refs[i].path, blob->matches[j].line, blob->matches[j].text, arg);
+        }
+    }
+
+    for (int i = 0; i < numBlobs; i++) {
+        for (int j = 0; j < blobs[i].numMatches; j++) {
+            free(blobs[i].matches[j].text);
+        }
+        free(blobs[i].matches);
+    }
+    free(blobs);
+    free(refs);
+    return result;
+}
+
+int keep_diff(keep_ctx* ctx, int from, int to, int min_similarity, keep_diff_callback callback, void* arg) {
+    TRACE_SCOPE("diff");
+
+    int error = requireRepo(ctx);
+    if (error != KEEP_OK) {
+        return error;
+    }
+
+    int latestVersion = readLatestVersion(ctx);
+    if (latestVersion < 0) {
+        return KEEP_ERR_IO;
+    }
+    if (from <= 0 || from > latestVersion || to <= 0 || to > latestVersion) {
+        return setError(ctx, KEEP_ERR_INVALID_VERSION, "Invalid version number");
+    }
+    if (min_similarity < 0 || min_similarity > 100) {
+        return setError(ctx, KEEP_ERR_INVALID_ARGUMENT, "Invalid similarity");
+    }
+
+    // Both versions are streamed in path order. Paths on both sides are
+    // modified when their content differs; the rest are additions and
+    // removals until matched up as renames. Only changed files are kept.
+    struct manifestStream oldStream;
+    struct manifestStream newStream;
+    if (openManifestStream(ctx, from, 1, &oldStream) != 0) {
+        return KEEP_ERR_IO;
+    }
+    if (openManifestStream(ctx, to, 1, &newStream) != 0) {
+        closeManifestStream(&oldStream);
+        return KEEP_ERR_IO;
+    }
+    oldStream.hashLegacy = 1;
+    newStream.hashLegacy = 1;
+
+    struct versionFile* removedFiles = NULL;
+    struct versionFile* addedFiles = NULL;
+    struct versionFile* modifiedFiles = NULL;
+    int numRemoved = 0;
+    int numAdded = 0;
+    int numModified = 0;
+    int capacities[3] = {0, 0, 0};
+    int haveOld = nextManifestEntry(ctx, &oldStream);
+    int haveNew = nextManifestEntry(ctx, &newStream);
+    int result = KEEP_OK;
+    while (result == KEEP_OK && haveOld >= 0 && haveNew >= 0 && (haveOld > 0 || haveNew > 0)) {
+        const struct versionFile* oldFile = &oldStream.entry;
+        const struct versionFile* newFile = &newStream.entry;
+        int order = haveOld == 0 ? 1 : haveNew == 0 ? -1 : strcmp(oldFile->path, newFile->path);
+        if (order < 0) {
+            result = appendVersionFile(ctx, &removedFiles, &numRemoved, &capacities[0], oldFile);
+        } else if (order > 0) {
+            result = appendVersionFile(ctx, &addedFiles, &numAdded, &capacities[1], newFile);
+        } else if (strcmp(oldFile->hash, newFile->hash) != 0) {
+            result = appendVersionFile(ctx, &modifiedFiles, &numModified, &capacities[2], newFile);
+        }
+        if (order <= 0) {
+            haveOld = nextManifestEntry(ctx, &oldStream);
+        }
+        if (order >= 0) {
+            haveNew = nextManifestEntry(ctx, &newStream);
+        }
+    }
+    closeManifestStream(&oldStream);
+    closeManifestStream(&newStream);
+
+    struct diffSide* removed = calloc(numRemoved + 1, sizeof(struct diffSide));
+    struct diffSide* added = calloc(numAdded + 1, sizeof(struct diffSide));
+    struct keep_diff_entry* entries = calloc(numRemoved + numAdded + numModified + 1, sizeof(struct keep_diff_entry));
+    if (result != KEEP_OK || haveOld < 0 || haveNew < 0 || removed == NULL || added == NULL || entries == NULL) {
+        if (result == KEEP_OK && (haveOld < 0 || haveNew < 0)) {
+            result = KEEP_ERR_IO;
+        } else if (result == KEEP_OK) {
+            result = setError(ctx, KEEP_ERR_NO_MEMORY, "Out of memory");
+        }
+        free(removed);
+        free(added);
+        free(entries);
+        free(removedFiles);
+        free(addedFiles);
+        free(modifiedFiles);
+        return result;
+    }
+
+    int numEntries = 0;
+    for (int i = 0; i < numRemoved; i++) {
+        removed[i].file = &removedFiles[i];
+    }
+    for (int i = 0; i < numAdded; i++) {
+        added[i].file = &addedFiles[i];
+    }
+    for (int i = 0; i < numModified; i++) {
+        entries[numEntries++] = (struct keep_diff_entry){KEEP_MODIFIED, modifiedFiles[i].path, NULL, 0};
+    }
+
+    matchRenames(ctx, from, to, removed, numRemoved, added, numAdded, min_similarity);
+
+    for (int i = 0; i < numAdded; i++) {
+        if (added[i].matched > 0) {
+            struct diffSide* source = &removed[added[i].matched - 1];
+            entries[numEntries++] = (struct keep_diff_entry){KEEP_RENAMED, added[i].file->path, source->file->path,
+                                                             source->matched};
+        } else {
+            entries[numEntries++] = (struct keep_diff_entry){KEEP_ADDED, added[i].file->path, NULL, 0};
+        }
+        free(added[i].prints);
+    }
+    for (int i = 0; i < numRemoved; i++) {
+        if (removed[i].matched == 0) {
+            entries[numEntries++] = (struct keep_diff_entry){KEEP_REMOVED, removed[i].file->path, NULL, 0};
+        }
+        free(removed[i].prints);
+    }
+
+    qsort(entries, numEntries, sizeof(struct keep_diff_entry), compareDiffEntries);
+    for (int i = 0; i < numEntries && result == KEEP_OK; i++) {
+        result = callback(&entries[i], arg);
+    }
+
+    free(entries);
+    free(removed);
+    free(added);
+    free(removedFiles);
+    free(addedFiles);
+    free(modifiedFiles);
+    return result;
+}
+
+int keep_fsck(keep_ctx* ctx, const struct keep_fsck_options* options, keep_fsck_callback callback, void* arg,
+              struct keep_fsck_result* result) {
+    TRACE_SCOPE("fsck");
+    memset(result, 0, sizeof(*result));
+
+    int error = requireRepo(ctx);
+    if (error != KEEP_OK) {
+        return error;
+    }
+
+    struct fsckRun run = {ctx, callback, arg, result};
+    int latestVersion = readLatestVersion(ctx);
+    if (latestVersion < 0) {
+        fsckProblem(&run, "latest-version is missing or unreadable");
+        return KEEP_OK;
+    }
+
+    // Every published version must be complete. Consecutive versions share
+    // most of their files, so an object is only looked at again when its
+    // path or hash differs from the version before.
+    struct versionFile* previous = NULL;
+    int numPrevious = 0;
+    for (int version = 1; version <= latestVersion; version++) {
+        fsckVersion(&run, version, &previous, &numPrevious);
+        result->versions++;
+    }
+    free(previous);
+
+    if (options != NULL && options->scrub && scrubObjects(&run, options->restart) != 0) {
+        return KEEP_ERR_IO;
+    }
+    return KEEP_OK;
+}
+
+int keep_stats(keep_ctx* ctx, enum keep_stats_format format, int fd) {
+    TRACE_SCOPE("stats");
+
+    int error = requireRepo(ctx);
+    if (error != KEEP_OK) {
+        return error;
+    }
+
+    struct metrics metrics;
+    loadMetrics(ctx, &metrics);
+    int result = format == KEEP_STATS_PROMETHEUS ? writeMetrics(fd, &metrics, 1) : writeMetricsSummary(fd, &metrics);
+    if (result != 0) {
+        return setError(ctx, KEEP_ERR_IO, "Failed to write statistics");
+    }
+    return KEEP_OK;
+}
+
+int keep_tier(keep_ctx* ctx, const struct keep_tier_options* options, struct keep_tier_result* result) {
+    TRACE_SCOPE("tier");
+    memset(result, 0, sizeof(*result));
+
+    int error = requireRepo(ctx);
+    if (error != KEEP_OK) {
+        return error;
+    }
+
+    int lockFd = lockRepo(ctx);
+    if (lockFd < 0) {
+        return KEEP_ERR_IO;
+    }
+
+    error = tierObjects(ctx, options, result);
+    unlockRepo(lockFd);
+    return error;
+}
+
+int keep_auto(keep_ctx* ctx, const struct keep_auto_options* options, keep_auto_callback callback, void* arg) {
+    TRACE_SCOPE("auto");
+
+    int error = requireRepo(ctx);
+    if (error != KEEP_OK) {
+        return error;
+    }
+
+    struct autoState state = {-1, 0, NULL, 0, 0, NULL, NULL, 0};
+    state.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    state.polling = state.fd < 0;
+    if (watchTrackedFiles(ctx, &state) != 0) {
+        error = KEEP_ERR_IO;
+    }
+
+    // Changes made while nothing was watching are picked up by a first
+    // store once the quiet period has passed.
+    long long second = 1000000;
+    long long now = monotonicMicros();
+    long long firstChange = now;
+    long long lastChange = now;
+    long long lastStore = LLONG_MIN / 2;
+    long long retry = 0;
+    int dirty = 1;
+    while (error == KEEP_OK) {
+        // A store is due once nothing changed for the quiet period, or the
+        // first change is max_staleness old, but never sooner than
+        // min_interval after the last one. After a failed store, the wait
+        // before retrying doubles each time, even with no min_interval.
+        long long due = lastChange + options->quiet_period * second;
+        if (options->max_staleness > 0 && firstChange + options->max_staleness * second < due) {
+            due = firstChange + options->max_staleness * second;
+        }
+        if (lastStore + options->min_interval * second > due) {
+            due = lastStore + options->min_interval * second;
+        }
+        if (lastStore + retry > due) {
+            due = lastStore + retry;
+        }
+
+        now = monotonicMicros();
+        if (!dirty || now < due) {
+            int timeout = -1;
+            if (dirty || state.polling) {
+                long long interval = options->min_interval;
+                if (interval < AUTO_RETRY_SECONDS) {
+                    interval = AUTO_RETRY_SECONDS;
+                }
+                long long wait = state.polling && !dirty ? interval * second : due - now;
+                timeout = wait > INT_MAX / 1000 ? INT_MAX : (int)((wait + 999) / 1000);
+            }
+            struct pollfd pfd = {state.fd, POLLIN, 0};
+            int ready = poll(&pfd, state.fd >= 0 ? 1 : 0, timeout);
+            if (ready < 0 && errno == EINTR) {
+                if (callback(KEEP_OK, NULL, NULL, arg) != 0) {
+                    break;
+                }
+                continue;
+            }
+
+            int rewatch = 0;
+            int changes = ready > 0 ? readAutoEvents(&state, &rewatch) : 0;
+            if (rewatch && watchTrackedFiles(ctx, &state) != 0) {
+                error = KEEP_ERR_IO;
+                break;
+            }
+            if (state.polling && ready == 0 && !dirty) {
+                changes = 1;
+            }
+            if (changes > 0) {
+                now = monotonicMicros();
+                if (!dirty) {
+                    firstChange = now;
+                }
+                lastChange = now;
+                dirty = 1;
+            }
+            continue;
+        }
+
+        char note[MAX_ERROR_LENGTH];
+        autoNote(&state, note, sizeof(note));
+        struct keep_store_result result;
+        int stored = keep_store(ctx, note, &result);
+        lastStore = monotonicMicros();
+        if (stored == KEEP_OK) {
+            dirty = 0;
+            retry = 0;
+            memset(state.changed, 0, state.numPaths);
+        } else {
+            retry = retry == 0 ? AUTO_RETRY_SECONDS * second : retry * 2;
+            if (retry > AUTO_MAX_RETRY_SECONDS * second) {
+                retry = AUTO_MAX_RETRY_SECONDS * second;
+            }
+        }
+        if (callback(stored, &result, note, arg) != 0) {
+            break;
+        }
+    }
+
+    if (state.fd >= 0) {
+        close(state.fd);
+    }
+    free(state.watches);
+    free(state.paths);
+    free(state.changed);
+    return error;
+}
+
+int keep_bisect(keep_ctx* ctx, const struct keep_bisect_options* options, keep_bisect_callback callback, void* arg,
+                struct keep_bisect_result* result) {
+    TRACE_SCOPE("bisect");
+
+    int error = requireRepo(ctx);
+    if (error != KEEP_OK) {
+        return error;
+    }
+
+    int latestVersion = readLatestVersion(ctx);
+    if (latestVersion < 0) {
+        return KEEP_ERR_IO;
+    }
+    if (options->good <= 0 || options->good > latestVersion || options->bad <= 0 || options->bad > latestVersion) {
+        return setError(ctx, KEEP_ERR_INVALID_VERSION, "Invalid version number");
+    }
+    if (options->good >= options->bad) {
+        return setError(ctx, KEEP_ERR_INVALID_ARGUMENT, "The good version must be older than the bad one");
+    }
+    if (options->command == NULL || options->command[0] == '\0') {
+        return setError(ctx, KEEP_ERR_INVALID_ARGUMENT, "No command to run");
+    }
+
+    // Bisecting only reads published versions, so it does not take the
+    // repository lock; its own lock keeps two bisects out of one worktree.
+    if (makeParentDirs(ctx, BISECT_LOCK_PATH) != 0) {
+        return KEEP_ERR_IO;
+    }
+    int lockFd = openat(ctx->rootFd, BISECT_LOCK_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lockFd < 0) {
+        return setError(ctx, KEEP_ERR_IO, "Failed to open bisect lock file");
+    }
+    if (flock(lockFd, LOCK_EX | LOCK_NB) != 0) {
+        close(lockFd);
+        return setError(ctx, KEEP_ERR_IO, "Another bisect is running");
+    }
+
+    char* skipped = calloc(options->bad - options->good + 1, 1);
+    if (skipped == NULL) {
+        close(lockFd);
+        return setError(ctx, KEEP_ERR_NO_MEMORY, "Out of memory");
+    }
+
+    // The worktree is left at whatever version the last bisect tested and
+    // reused from there.
+    int current = 0;
+    FILE* versionFile = repoOpen(ctx, BISECT_VERSION_PATH, "r");
+    if (versionFile != NULL) {
+        if (fscanf(versionFile, "%d", &current) != 1 || current <= 0 || current > latestVersion) {
+            current = 0;
+        }
+        fclose(versionFile);
+    }
+
+    int good = options->good;
+    int bad = options->bad;
+    int steps = 0;
+    for (int version; error == KEEP_OK && (version = nextBisectVersion(good, bad, skipped, options->good)) > 0;) {
+        enum keep_bisect_verdict verdict = KEEP_BISECT_SKIP;
+        if (checkoutBisectVersion(ctx, &current, version) != 0 ||
+            runBisectCommand(ctx, options->command, version, &verdict) != 0) {
+            error = KEEP_ERR_IO;
+            break;
+        }
+
+        steps++;
+        if (verdict == KEEP_BISECT_GOOD) {
+            good = version;
+        } else if (verdict == KEEP_BISECT_BAD) {
+            bad = version;
+        } else {
+            skipped[version - options->good] = 1;
+        }
+        if (callback != NULL) {
+            error = callback(version, verdict, arg);
+        }
+    }
+
+    // The first bad version is left in the worktree for a closer look.
+    if (error == KEEP_OK && checkoutBisectVersion(ctx, &current, bad) != 0) {
+        error = KEEP_ERR_IO;
+    }
+    if (error == KEEP_OK && result != NULL) {
+        result->first_bad = bad;
+        result->last_good = good;
+        result->steps = steps;
+    }
+
+    free(skipped);
+    close(lockFd);
+    recordMetrics(ctx);
+    return error;
+}
+
+int keep_push(keep_ctx* ctx, const char* dir, struct keep_mirror_result* result) {
+    TRACE_SCOPE("push");
+    return mirrorRepo(ctx, dir, 1, result);
+}
+
+int keep_pull(keep_ctx* ctx, const char* dir, struct keep_mirror_result* result) {
+    TRACE_SCOPE("pull");
+    return mirrorRepo(ctx, dir, 0, result);
+}
+
+int keep_import(keep_ctx* ctx, int fd, int* version) {
+    TRACE_SCOPE("import");
+
+    int error = requireRepo(ctx);
+    if (error != KEEP_OK) {
+        return error;
+    }
+
+    int lockFd = lockRepo(ctx);
+    if (lockFd < 0) {
+        return KEEP_ERR_IO;
+    }
+
+    error = importVersion(ctx, fd, version);
+    unlockRepo(lockFd);
+    recordMetrics(ctx);
+    return error;
+}
+
+static int importVersion(keep_ctx* ctx, int fd, int* version) {
+    int latestVersion = readLatestVersion(ctx);
+    if (latestVersion < 0) {
+        return KEEP_ERR_IO;
+    }
+
+    char stagingDir[MAX_FILE_PATH_LENGTH];
+    if (prepareStagingDir(ctx, latestVersion + 1, stagingDir, sizeof(stagingDir)) != 0) {
+        return KEEP_ERR_IO;
+    }
+
+    char targetDir[MAX_FILE_PATH_LENGTH];
+    snprintf(targetDir, sizeof(targetDir), "%s/target", stagingDir);
+
+    // Archives need not list files in path order, so their manifest lines
+    // are sorted before the manifest is written.
+    FILE* lines = createSortFile(ctx);
+    if (lines == NULL) {
+        removeTree(ctx, stagingDir);
+        return KEEP_ERR_IO;
+    }
+
+    // Archives made by other tools have no note; their versions get an
+    // empty one.
+    char emptyNote[MAX_FILE_PATH_LENGTH];
+    snprintf(emptyNote, sizeof(emptyNote), "%s/note", targetDir);
+    int emptyNoteFd = openat(ctx->rootFd, emptyNote, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (emptyNoteFd < 0 || writeFully(emptyNoteFd, "\n", 1) != 0) {
+        if (emptyNoteFd >= 0) {
+            close(emptyNoteFd);
+        }
+        fclose(lines);
+        removeTree(ctx, stagingDir);
+        return setError(ctx, KEEP_ERR_IO, "Failed to create target file '%s'", emptyNote);
+    }
+    close(emptyNoteFd);
+
+    // Extended headers of pax and GNU tar override the name, size or time
+    // of the entry after them.
+    char extendedName[MAX_FILE_PATH_LENGTH] = "";
+    long long extendedSize = -1;
+    long extendedMtime = -1;
+
+    int result = setError(ctx, KEEP_ERR_IO, "Truncated archive");
+    unsigned char header[TAR_BLOCK_SIZE];
+    while (readFully(fd, header, sizeof(header)) == 0) {
+        char name[MAX_FILE_PATH_LENGTH];
+        long long size;
+        long mtime;
+
+        if (header[0] == '\0') {
+            result = KEEP_OK;
+            break;
+        }
+
+        if (parseTarHeader(header, name, sizeof(name), &size, &mtime) != 0) {
+            result = setError(ctx, KEEP_ERR_INVALID_ARGUMENT, "Invalid archive header");
+            break;
+        }
+
+        // Global pax headers and GNU long link names say nothing that a
+        // version records.
+        char type = header[156];
+        if (type == 'x' || type == 'g' || type == 'L' || type == 'K') {
+            char* data = readTarExtension(fd, size);
+            if (data == NULL) {
+                result = setError(ctx, KEEP_ERR_INVALID_ARGUMENT, "Invalid extended header '%s'", name);
+                break;
+            }
+            int parsed = 0;
+            if (type == 'x') {
+                parsed = parsePaxRecords(data, size, extendedName, sizeof(extendedName), &extendedSize,
+                                         &extendedMtime);
+            } else if (type == 'L' && strlen(data) < sizeof(extendedName)) {
+                snprintf(extendedName, sizeof(extendedName), "%s", data);
+            } else if (type == 'L') {
+                parsed = -1;
+            }
+            free(data);
+            if (parsed != 0) {
+                result = setError(ctx, KEEP_ERR_INVALID_ARGUMENT, "Path in extended header '%s' is too long", name);
+                break;
+            }
+            continue;
+        }
+        if (extendedName[0] != '\0') {
+            snprintf(name, sizeof(name), "%s", extendedName);
+            extendedName[0] = '\0';
+        }
+        if (extendedSize >= 0) {
+            size = extendedSize;
+            extendedSize = -1;
+        }
+        if (extendedMtime >= 0) {
+            mtime = extendedMtime;
+            extendedMtime = -1;
+        }
+
+        // Directories come into being with the files in them. Links and
+        // special files have no content to keep.
+        if (type == '5' && size == 0) {
+            continue;
+        }
+        if (type != '0' && type != '\0' && type != '7') {
+            result = setError(ctx, KEEP_ERR_INVALID_ARGUMENT, "Refusing to import '%s', which is not a file", name);
+            break;
+        }
+        while (strncmp(name, "./", 2) == 0) {
+            memmove(name, name + 2, strlen(name + 2) + 1);
+        }
+
+        if (!isSafeRelativePath(name)) {
+            result = setError(ctx, KEEP_ERR_INVALID_ARGUMENT, "Refusing to import '%s'", name);
+            break;
+        }
+
+        int copied;
+        if (strcmp(name, NOTE_ENTRY_NAME) == 0) {
+            char noteFile[MAX_FILE_PATH_LENGTH];
+            snprintf(noteFile, sizeof(noteFile), "%s/note", targetDir);
+
+            int noteFd = openat(ctx->rootFd, noteFile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (noteFd < 0) {
+                result = setError(ctx, KEEP_ERR_IO, "Failed to create target file '%s'", noteFile);
+                break;
+            }
+            copied = forwardBytes(fd, noteFd, size);
+            close(noteFd);
+        } else {
+            char hash[HASH_HEX_LENGTH + 1];
+            long long stored;
+            copied = ingestFd(ctx, fd, size, hash, &stored);
+            if (copied == 0) {
+                fprintf(lines, "%s %lld %ld %s\n", hash, stored, mtime, name);
+            }
+        }
+
+        char padding[TAR_BLOCK_SIZE];
+        size_t paddingSize = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+        if (copied != 0 || readFully(fd, padding, paddingSize) != 0) {
+            result = setError(ctx, KEEP_ERR_IO, "Truncated archive while reading '%s'", name);
+            break;
+        }
+    }
+
+    FILE* sorted = NULL;
+    if (result == KEEP_OK && (ferror(lines) || fflush(lines) != 0)) {
+        fclose(lines);
+        result = setError(ctx, KEEP_ERR_IO, "Failed to write a temporary file");
+    } else if (result == KEEP_OK) {
+        sorted = sortLines(ctx, lines, compareManifestLines);
+        result = sorted != NULL ? KEEP_OK : KEEP_ERR_IO;
+    } else {
+        fclose(lines);
+    }
+
+    char manifestPath[MAX_FILE_PATH_LENGTH];
+    snprintf(manifestPath, sizeof(manifestPath), "%s/manifest", stagingDir);
+    FILE* manifest = sorted != NULL ? repoOpen(ctx, manifestPath, "w") : NULL;
+    if (sorted != NULL && manifest == NULL) {
+        result = setError(ctx, KEEP_ERR_IO, "Failed to create manifest file");
+    }
+    if (manifest != NULL) {
+        char line[MANIFEST_LINE_LENGTH];
+        while (fgets(line, sizeof(line), sorted) != NULL) {
+            fputs(line, manifest);
+        }
+        int failed = ferror(sorted);
+        if (fclose(manifest) != 0) {
+            failed = 1;
+        }
+        if (failed && result == KEEP_OK) {
+            result = setError(ctx, KEEP_ERR_IO, "Failed to write manifest file");
+        }
+    }
+    if (sorted != NULL) {
+        fclose(sorted);
+    }
+
+    if (result != KEEP_OK) {
+        removeTree(ctx, stagingDir);
+        return result;
+    }
+
+    if (publishVersion(ctx, stagingDir, latestVersion + 1) != 0) {
+        return KEEP_ERR_IO;
+    }
+
+    if (version != NULL) {
+        *version = latestVersion + 1;
+    }
+    return KEEP_OK;
+}
+
+static int setError(keep_ctx* ctx, int code, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(ctx->error, sizeof(ctx->error), format, args);
+    va_end(args);
+    return code;
+}
+
+static int requireRepo(keep_ctx* ctx) {
+    struct stat st;
+    if (fstatat(ctx->rootFd, ".keep", &st, 0) != 0 || !S_ISDIR(st.st_mode)) {
+        return setError(ctx, KEEP_ERR_NO_REPO, "No .keep directory found. Run 'keep init' first");
+    }
+    return KEEP_OK;
+}
+
+static int lockRepo(keep_ctx* ctx) {
+    TRACE_SCOPE("lockRepo");
+
+    // Writers take an exclusive lock for the whole operation. Readers never
+    // lock: they only look at versions already named by latest-version, and
+    // those are complete and never change.
+    int lockFd = openat(ctx->rootFd, LOCK_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lockFd < 0) {
+        return setError(ctx, -1, "Failed to open lock file");
+    }
+
+    while (flock(lockFd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            close(lockFd);
+            return setError(ctx, -1, "Failed to lock repository");
+        }
+    }
+
+    // Another writer may have rewritten the object index since this
+    // context last held the lock.
+    closeObjectIndex(ctx);
+    return lockFd;
+}
+
+static void unlockRepo(int lockFd) {
+    close(lockFd);
+}
+
+static int removeTree(keep_ctx* ctx, const char* path) {
+    if (unlinkat(ctx->rootFd, path, 0) == 0 || errno == ENOENT) {
+        return 0;
+    }
+
+    DIR* dir = repoOpenDir(ctx, path);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    int result = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        char child[MAX_FILE_PATH_LENGTH];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        if (removeTree(ctx, child) != 0) {
+            result = -1;
+        }
+    }
+    closedir(dir);
+
+    if (unlinkat(ctx->rootFd, path, AT_REMOVEDIR) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+static int syncVersionData(keep_ctx* ctx, const char* stagingDir) {
+    // Object files are synced as they are linked in; their directories, the
+    // packs directory and the staged version are synced here.
+    int result = 0;
+    int anyObjects = 0;
+    for (int i = 0; i < 256; i++) {
+        if (ctx->unsyncedObjectDirs[i / 8] & (1 << (i % 8))) {
+            char path[MAX_FILE_PATH_LENGTH];
+            snprintf(path, sizeof(path), "%s/%02x", OBJECTS_DIR, i);
+            result |= syncPath(ctx, path);
+            anyObjects = 1;
+        }
+    }
+    if (anyObjects) {
+        result |= syncPath(ctx, OBJECTS_DIR);
+    }
+    memset(ctx->unsyncedObjectDirs, 0, sizeof(ctx->unsyncedObjectDirs));
+
+    const char* names[] = {"manifest", "target/note", "target", "."};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        char path[MAX_FILE_PATH_LENGTH];
+        snprintf(path, sizeof(path), "%s/%s", stagingDir, names[i]);
+        result |= syncPath(ctx, path);
+    }
+    result |= syncPath(ctx, PACKS_DIR);
+    return result;
+}
+
+static int syncPath(keep_ctx* ctx, const char* path) {
+    // fsync() for a file or directory; one that does not exist is fine.
+    int fd = openat(ctx->rootFd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    TRACE_COUNT(TRACE_SYSCALLS, 3);
+    int result = fsync(fd);
+    close(fd);
+    return result;
+}
+
+static int prepareStagingDir(keep_ctx* ctx, int version, char* stagingDir, size_t size) {
+    // A new version is assembled in .keep/N.tmp and renamed into place when
+    // complete. Anything numbered above latest-version was left behind by an
+    // interrupted writer and is discarded.
+    char versionDir[MAX_FILE_PATH_LENGTH];
+    snprintf(versionDir, sizeof(versionDir), ".keep/%d", version);
+    snprintf(stagingDir, size, "%s.tmp", versionDir);
+
+    if (removeTree(ctx, stagingDir) != 0 || removeTree(ctx, versionDir) != 0) {
+        return setError(ctx, -1, "Failed to remove incomplete version %d", version);
+    }
+
+    char targetDir[MAX_FILE_PATH_LENGTH];
+    snprintf(targetDir, sizeof(targetDir), "%s/target", stagingDir);
+
+    if (mkdirat(ctx->rootFd, stagingDir, 0700) != 0 || mkdirat(ctx->rootFd, targetDir, 0700) != 0) {
+        return setError(ctx, -1, "Failed to create version directory");
+    }
+    return 0;
+}
+
+static int publishVersion(keep_ctx* ctx, const char* stagingDir, int version) {
+    TRACE_SCOPE("publishVersion");
+
+    char versionDir[MAX_FILE_PATH_LENGTH];
+    snprintf(versionDir, sizeof(versionDir), ".keep/%d", version);
+
+    // What the version refers to reaches the disk before the version does,
+    // and the version before latest-version names it, so that a crash
+    // never leaves a published version with missing or truncated content.
+    if (syncVersionData(ctx, stagingDir) != 0) {
+        return setError(ctx, -1, "Failed to write version %d to disk", version);
+    }
+    if (renameat(ctx->rootFd, stagingDir, ctx->rootFd, versionDir) != 0 || syncPath(ctx, ".keep") != 0) {
+        return setError(ctx, -1, "Failed to publish version %d", version);
+    }
+    if (updateLatestVersion(ctx, version - 1) != 0) {
+        return -1;
+    }
+
+    // The version is published either way; an index left behind is caught
+    // up by the next writer, and readers fill the gap from the manifests.
+    updatePathIndex(ctx);
+    return 0;
+}
+
+static int updatePathIndex(keep_ctx* ctx) {
+    TRACE_SCOPE("updatePathIndex");
+
+    // .keep/paths/xx/<sha256 of path> starts with the path and then gets a
+    // "version hash" line for every version that added, changed ("-" when
+    // it removed) the file. .keep/paths/version is the last version whose
+    // changes are all in. Called with the repository lock held.
+    int latestVersion = readLatestVersion(ctx);
+    int indexed = readIndexedVersion(ctx);
+    if (latestVersion < 0 || indexed >= latestVersion) {
+        return latestVersion < 0 ? -1 : 0;
+    }
+
+    struct manifestStream previous = {0};
+    if (indexed > 0 && openManifestStream(ctx, indexed, 1, &previous) != 0) {
+        return -1;
+    }
+    previous.hashLegacy = 1;
+
+    int result = 0;
+    for (int version = indexed + 1; version <= latestVersion && result == 0; version++) {
+        struct manifestStream files;
+        if (openManifestStream(ctx, version, 1, &files) != 0) {
+            result = -1;
+            break;
+        }
+        files.hashLegacy = 1;
+
+        result = indexVersionChanges(ctx, version, &previous, &files);
+        closeManifestStream(&previous);
+        previous = files;
+        rewind(previous.file);
+
+        FILE* marker = result == 0 ? repoOpen(ctx, INDEXED_VERSION_PATH ".temp", "w") : NULL;
+        if (result == 0 && marker == NULL) {
+            result = setError(ctx, -1, "Failed to write the path index");
+        } else if (result == 0) {
+            fprintf(marker, "%d", version);
+            if (fclose(marker) != 0 ||
+                renameat(ctx->rootFd, INDEXED_VERSION_PATH ".temp", ctx->rootFd, INDEXED_VERSION_PATH) != 0) {
+                result = setError(ctx, -1, "Failed to write the path index");
+            }
+        }
+    }
+
+    closeManifestStream(&previous);
+    return result;
+}
+
+static int indexVersionChanges(keep_ctx* ctx, int version, struct manifestStream* previous,
+                               struct manifestStream* files) {
+    // Both lists come in path order, so one merge pass finds every file
+    // that was added, changed or removed.
+    int havePrevious = nextManifestEntry(ctx, previous);
+    int haveFile = nextManifestEntry(ctx, files);
+    while (havePrevious >= 0 && haveFile >= 0 && (havePrevious > 0 || haveFile > 0)) {
+        const struct versionFile* before = &previous->entry;
+        const struct versionFile* after = &files->entry;
+        int order = havePrevious == 0 ? 1 : haveFile == 0 ? -1 : strcmp(before->path, after->path);
+        int result = 0;
+        if (order < 0) {
+            result = appendPathChange(ctx, before->path, version, "-");
+        } else if (order > 0 || strcmp(before->hash, after->hash) != 0) {
+            result = appendPathChange(ctx, after->path, version, after->hash);
+        }
+        if (result != 0) {
+            return -1;
+        }
+        if (order <= 0) {
+            havePrevious = nextManifestEntry(ctx, previous);
+        }
+        if (order >= 0) {
+            haveFile = nextManifestEntry(ctx, files);
+        }
+    }
+    return havePrevious < 0 || haveFile < 0 ? -1 : 0;
+}
+
+static int appendPathChange(keep_ctx* ctx, const char* path, int version, const char* hash) {
+    char indexPath[MAX_FILE_PATH_LENGTH];
+    pathIndexPath(path, indexPath, sizeof(indexPath));
+    if (makeParentDirs(ctx, indexPath) != 0) {
+        return -1;
+    }
+
+    FILE* index = repoOpen(ctx, indexPath, "a");
+    struct stat indexStat;
+    if (index == NULL || fstat(fileno(index), &indexStat) != 0) {
+        if (index != NULL) {
+            fclose(index);
+        }
+        return setError(ctx, -1, "Failed to open the path index of '%s'", path);
+    }
+
+    if (indexStat.st_size == 0) {
+        fprintf(index, "%s\n", path);
+    }
+    fprintf(index, "%d %s\n", version, hash);
+    if (fclose(index) != 0) {
+        return setError(ctx, -1, "Failed to write the path index of '%s'", path);
+    }
+    return 0;
+}
+
+static int readIndexedVersion(keep_ctx* ctx) {
+    // Repositories from before the index, or whose index was removed, start
+    // over from version 0.
+    FILE* marker = repoOpen(ctx, INDEXED_VERSION_PATH, "r");
+    int version = 0;
+    if (marker != NULL) {
+        if (fscanf(marker, "%d", &version) != 1 || version < 0) {
+            version = 0;
+        }
+        fclose(marker);
+    }
+    return version;
+}
+
+static void pathIndexPath(const char* path, char* indexPath, size_t size) {
+    struct sha256 sha;
+    char hash[HASH_HEX_LENGTH + 1];
+    sha256Init(&sha);
+    sha256Update(&sha, path, strlen(path));
+    sha256Final(&sha, hash);
+    snprintf(indexPath, size, "%s/%.2s/%s", PATHS_DIR, hash, hash + 2);
+}
+
+static int loadIndexedVersionFiles(keep_ctx* ctx, int version, struct versionFile** files, int* count) {
+    // Files of a version sorted by path, with a hash for every one of them:
+    // versions stored before the object store have their files hashed here.
+    if (loadVersionFiles(ctx, version, files, count) != 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < *count; i++) {
+        struct versionFile* file = &(*files)[i];
+        if (file->hash[0] == '\0') {
+            char source[MAX_FILE_PATH_LENGTH];
+            versionFileSource(ctx, version, file, source, sizeof(source));
+            if (hashFile(ctx, source, file->hash, &file->size) != 0) {
+                free(*files);
+                return -1;
+            }
+        }
+    }
+
+    if (*count > 0) {
+        qsort(*files, *count, sizeof(struct versionFile), compareVersionFiles);
+    }
+    return 0;
+}
+
+static const struct versionFile* findVersionFile(const struct versionFile* files, int count, const char* path) {
+    if (count == 0) {
+        return NULL;
+    }
+    struct versionFile key;
+    snprintf(key.path, sizeof(key.path), "%s", path);
+    return bsearch(&key, files, count, sizeof(struct versionFile), compareVersionFiles);
+}
+
+static int addChange(keep_ctx* ctx, int** changes, int* count, int* capacity, int change) {
+    if (*count == *capacity) {
+        int grownCapacity = *capacity == 0 ? 64 : *capacity * 2;
+        int* grown = realloc(*changes, grownCapacity * sizeof(int));
+        if (grown == NULL) {
+            return setError(ctx, -1, "Out of memory");
+        }
+        *changes = grown;
+        *capacity = grownCapacity;
+    }
+    (*changes)[(*count)++] = change;
+    return 0;
+}
+
+static int collectGrepRefs(keep_ctx* ctx, const struct keep_grep_options* options, int first, int last,
+                           struct grepRef** refs, int* count) {
+    // One reference per selected file of every version in [first, last], in
+    // version order. Its key names the blob: the object, or the file itself
+    // for versions stored before the object store.
+    int capacity = 64;
+    int numRefs = 0;
+    struct grepRef* list = malloc(capacity * sizeof(struct grepRef));
+
+    for (int version = first; version <= last && list != NULL; version++) {
+        struct versionFile* files;
+        int numFiles;
+        if (loadVersionFiles(ctx, version, &files, &numFiles) != 0) {
+            free(list);
+            return -1;
+        }
+
+        for (int i = 0; i < numFiles; i++) {
+            if (!grepPathSelected(options, files[i].path)) {
+                continue;
+            }
+            if (numRefs == capacity) {
+                capacity *= 2;
+                struct grepRef* grown = realloc(list, capacity * sizeof(struct grepRef));
+                if (grown == NULL) {
+                    free(list);
+                    list = NULL;
+                    break;
+                }
+                list = grown;
+            }
+
+            struct grepRef* ref = &list[numRefs++];
+            ref->version = version;
+            snprintf(ref->path, sizeof(ref->path), "%s", files[i].path);
+            snprintf(ref->hash, sizeof(ref->hash), "%s", files[i].hash);
+            versionFileSource(ctx, version, &files[i], ref->key, sizeof(ref->key));
+        }
+        free(files);
+    }
+
+    if (list == NULL) {
+        return setError(ctx, -1, "Out of memory");
+    }
+
+    *refs = list;
+    *count = numRefs;
+    return 0;
+}
+
+static int grepPathSelected(const struct keep_grep_options* options, const char* path) {
+    // A selected path matches itself and, as a directory, everything below.
+    if (options->paths == NULL || options->num_paths == 0) {
+        return 1;
+    }
+    for (int i = 0; i < options->num_paths; i++) {
+        size_t length = strlen(options->paths[i]);
+        while (length > 1 && options->paths[i][length - 1] == '/') {
+            length--;
+        }
+        if (strncmp(path, options->paths[i], length) == 0 && (path[length] == '\0' || path[length] == '/')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int compareGrepRefKeys(const void* a, const void* b) {
+    return strcmp((*(struct grepRef* const*)a)->key, (*(struct grepRef* const*)b)->key);
+}
+
+static void regexLiteral(const char* pattern, char* literal, size_t size) {
+    // Finds the longest run of ordinary characters that every match of an
+    // extended regular expression contains: outside groups and brackets,
+    // and not made optional by a following quantifier. Alternation makes
+    // no run mandatory, so it yields an empty literal.
+    literal[0] = '\0';
+    if (strchr(pattern, '|') != NULL) {
+        return;
+    }
+
+    size_t best = 0;
+    size_t runStart = 0;
+    size_t runLength = 0;
+    int depth = 0;
+    for (size_t i = 0;; i++) {
+        char c = pattern[i];
+        int ordinary = c != '\0' && depth == 0 && strchr(".[]()*+?{}|^$\\", c) == NULL;
+        int quantified = pattern[i + (c != '\0')] == '*' || pattern[i + (c != '\0')] == '?' ||
+                         pattern[i + (c != '\0')] == '{';
+        if (ordinary && !quantified) {
+            if (runLength == 0) {
+                runStart = i;
+            }
+            runLength++;
+            continue;
+        }
+
+        if (runLength > best && runLength < size) {
+            best = runLength;
+            memcpy(literal, pattern + runStart, runLength);
+            literal[runLength] = '\0';
+        }
+        runLength = 0;
+
+        if (c == '\0') {
+            break;
+        } else if (c == '\\' && pattern[i + 1] != '\0') {
+            i++;
+        } else if (c == '[') {
+            // A ']' right after '[' or '[^' is part of the set.
+            i += pattern[i + 1] == '^' ? 2 : 1;
+            if (pattern[i] == ']') {
+                i++;
+            }
+            while (pattern[i] != '\0' && pattern[i] != ']') {
+                i++;
+            }
+            if (pattern[i] == '\0') {
+                break;
+            }
+        } else if (c == '{') {
+            // The bounds of an interval are not text to match.
+            while (pattern[i] != '\0' && pattern[i] != '}') {
+                i++;
+            }
+            if (pattern[i] == '\0') {
+                break;
+            }
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')' && depth > 0) {
+            depth--;
+        }
+    }
+}
+
+static void* grepWorker(void* arg) {
+    struct grepScan* scan = arg;
+    for (;;) {
+        int next = __atomic_fetch_add(&scan->nextBlob, 1, __ATOMIC_RELAXED);
+        if (next >= scan->numBlobs) {
+            return NULL;
+        }
+        grepBlob(scan, &scan->blobs[next]);
+    }
+}
+
+static void grepBlob(struct grepScan* scan, struct grepBlob* blob) {
+    // Runs on worker threads: only this blob is written, and failures are
+    // flagged for keep_grep to report. Blobs kept inline are decoded from
+    // their pack.
+    int fd = -1;
+    struct stat blobStat;
+    const char* data;
+    if (blob->inlined) {
+        blobStat.st_size = blob->entry.size;
+        data = (const char*)readPackedObject(scan->ctx, blob->source, &blob->entry);
+        if (data == NULL) {
+            blob->failed = 1;
+            return;
+        }
+    } else {
+        fd = openat(scan->ctx->rootFd, blob->source, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &blobStat) != 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            blob->failed = 1;
+            return;
+        }
+        if (blobStat.st_size == 0) {
+            close(fd);
+            return;
+        }
+
+        data = mmap(NULL, blobStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            blob->failed = 1;
+            return;
+        }
+        madvise((void*)data, blobStat.st_size, MADV_SEQUENTIAL);
+    }
+
+    // Like grep, files with a NUL byte near the start are taken as binary
+    // and skipped.
+    const char* end = data + blobStat.st_size;
+    size_t probe = blobStat.st_size < GREP_BINARY_PROBE ? blobStat.st_size : GREP_BINARY_PROBE;
+    const char* position = memchr(data, '\0', probe) == NULL ? data : end;
+
+    // Line numbers are counted lazily, only up to lines that match.
+    const char* counted = data;
+    long line = 1;
+    while (position < end) {
+        const char* lineStart = position;
+        if (scan->literalLength > 0) {
+            const char* hit = memmem(position, end - position, scan->literal, scan->literalLength);
+            if (hit == NULL) {
+                break;
+            }
+            lineStart = memrchr(position, '\n', hit - position);
+            lineStart = lineStart == NULL ? position : lineStart + 1;
+        }
+        const char* lineEnd = memchr(lineStart, '\n', end - lineStart);
+        if (lineEnd == NULL) {
+            lineEnd = end;
+        }
+
+        int matched = 1;
+        if (scan->regex != NULL) {
+            regmatch_t range = {0, lineEnd - lineStart};
+            matched = regexec(scan->regex, lineStart, 1, &range, REG_STARTEND) == 0;
+        }
+        if (matched) {
+            for (const char* p = counted; (p = memchr(p, '\n', lineStart - p)) != NULL; p++) {
+                line++;
+            }
+            counted = lineStart;
+            if (addGrepMatch(blob, line, lineStart, lineEnd - lineStart) != 0) {
+                blob->failed = 1;
+                break;
+            }
+        }
+        position = lineEnd + 1;
+    }
+
+    if (blob->inlined) {
+        free((void*)data);
+        TRACE_COUNT(TRACE_FILES, 1);
+        return;
+    }
+    if (scan->ctx->cachePolicy != KEEP_CACHE_NORMAL) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    munmap((void*)data, blobStat.st_size);
+    close(fd);
+    TRACE_COUNT(TRACE_BYTES, blobStat.st_size);
+    TRACE_COUNT(TRACE_FILES, 1);
+}
+
+static int addGrepMatch(struct grepBlob* blob, long line, const char* text, size_t length) {
+    if ((blob->numMatches & (blob->numMatches - 1)) == 0) {
+        int capacity = blob->numMatches == 0 ? 1 : blob->numMatches * 2;
+        struct grepMatch* grown = realloc(blob->matches, capacity * sizeof(struct grepMatch));
+        if (grown == NULL) {
+            return -1;
+        }
+        blob->matches = grown;
+    }
+
+    char* copy = strndup(text, length);
+    if (copy == NULL) {
+        return -1;
+    }
+    blob->matches[blob->numMatches].line = line;
+    blob->matches[blob->numMatches].text = copy;
+    blob->numMatches++;
+    return 0;
+}
+
+static void matchRenames(keep_ctx* ctx, int from, int to, struct diffSide* removed, int numRemoved,
+                         struct diffSide* added, int numAdded, int minSimilarity) {
+    // A match sets added->matched to the index of the removed file plus one
+    // and removed->matched to the similarity in percent. Identical content
+    // is matched first by hash; with minSimilarity below 100, leftovers are
+    // then paired greedily by chunk similarity, unless there are so many
+    // that comparing every pair would take too long.
+    qsort(removed, numRemoved, sizeof(struct diffSide), compareDiffSideHashes);
+    for (int i = 0; i < numAdded; i++) {
+        struct diffSide* found = bsearch(&added[i], removed, numRemoved, sizeof(struct diffSide),
+                                         compareDiffSideHashes);
+        while (found != NULL && found > removed && strcmp(found[-1].file->hash, added[i].file->hash) == 0) {
+            found--;
+        }
+        while (found != NULL && found < removed + numRemoved && found->matched != 0 &&
+               strcmp(found->file->hash, added[i].file->hash) == 0) {
+            found++;
+        }
+        if (found != NULL && found < removed + numRemoved && strcmp(found->file->hash, added[i].file->hash) == 0) {
+            found->matched = 100;
+            added[i].matched = found - removed + 1;
+        }
+    }
+
+    if (minSimilarity <= 0 || minSimilarity >= 100 ||
+        (long long)numAdded * numRemoved > (long long)DIFF_RENAME_LIMIT * DIFF_RENAME_LIMIT) {
+        return;
+    }
+
+    for (int i = 0; i < numAdded; i++) {
+        if (added[i].matched != 0) {
+            continue;
+        }
+
+        int best = -1;
+        int bestSimilarity = minSimilarity - 1;
+        for (int j = 0; j < numRemoved; j++) {
+            // The smaller file over the larger one bounds the similarity.
+            long long smaller = added[i].file->size < removed[j].file->size ? added[i].file->size : removed[j].file->size;
+            long long larger = added[i].file->size < removed[j].file->size ? removed[j].file->size : added[i].file->size;
+            if (removed[j].matched != 0 || larger == 0 || smaller * 100 / larger <= bestSimilarity) {
+                continue;
+            }
+            if (fingerprintFile(ctx, to, &added[i]) != 0 || fingerprintFile(ctx, from, &removed[j]) != 0) {
+                continue;
+            }
+
+            int similarity = chunkSimilarity(&added[i], &removed[j]);
+            if (similarity > bestSimilarity) {
+                best = j;
+                bestSimilarity = similarity;
+            }
+        }
+
+        if (best >= 0) {
+            removed[best].matched = bestSimilarity;
+            added[i].matched = best + 1;
+        }
+    }
+}
+
+static int compareDiffSideHashes(const void* a, const void* b) {
+    return strcmp(((const struct diffSide*)a)->file->hash, ((const struct diffSide*)b)->file->hash);
+}
+
+static int fingerprintFile(keep_ctx* ctx, int version, struct diffSide* side) {
+    if (side->prints != NULL || side->numPrints < 0) {
+        return side->numPrints < 0 ? -1 : 0;
+    }
+
+    // Empty and very large files are left out of similarity matching.
+    // Small files kept inline are decoded rather than mapped.
+    const struct pack* pack;
+    const struct packEntry* entry;
+    const unsigned char* data;
+    struct stat fileStat;
+    int inlined = findInlineObject(ctx, side->file->hash, &pack, &entry) == 0;
+    if (inlined) {
+        fileStat.st_size = entry->size;
+        data = fileStat.st_size == 0 ? NULL : readPackedObject(ctx, pack->path, entry);
+        if (data == NULL) {
+            side->numPrints = -1;
+            return -1;
+        }
+    } else {
+        char source[MAX_FILE_PATH_LENGTH];
+        versionFileSource(ctx, version, side->file, source, sizeof(source));
+        int fd = openat(ctx->rootFd, source, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &fileStat) != 0 || fileStat.st_size == 0 ||
+            fileStat.st_size > DIFF_MAX_SIMILARITY_SIZE) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            side->numPrints = -1;
+            return -1;
+        }
+
+        data = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            side->numPrints = -1;
+            return -1;
+        }
+    }
+
+    // FNV-1a over each piece.
+    int capacity = 0;
+    uint32_t hash = 2166136261u;
+    uint32_t length = 0;
+    for (off_t i = 0; i < fileStat.st_size && side->numPrints >= 0; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+        length++;
+        if (data[i] != '\n' && length < DIFF_CHUNK_LENGTH && i < fileStat.st_size - 1) {
+            continue;
+        }
+
+        if (side->numPrints == capacity) {
+            capacity = capacity == 0 ? fileStat.st_size / 32 + 16 : capacity * 2;
+            struct chunkPrint* grown = realloc(side->prints, capacity * sizeof(struct chunkPrint));
+            if (grown == NULL) {
+                free(side->prints);
+                side->prints = NULL;
+                side->numPrints = -1;
+                break;
+            }
+            side->prints = grown;
+        }
+        side->prints[side->numPrints++] = (struct chunkPrint){hash, length};
+        hash = 2166136261u;
+        length = 0;
+    }
+    if (inlined) {
+        free((void*)data);
+    } else {
+        munmap((void*)data, fileStat.st_size);
+    }
+    if (side->numPrints < 0) {
+        return -1;
+    }
+
+    qsort(side->prints, side->numPrints, sizeof(struct chunkPrint), compareChunkPrints);
+    return 0;
+}
+
+static int compareChunkPrints(const void* a, const void* b) {
+    const struct chunkPrint* x = a;
+    const struct chunkPrint* y = b;
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return x->length < y->length ? -1 : x->length > y->length;
+}
+
+static int chunkSimilarity(const struct diffSide* a, const struct diffSide* b) {
+    // Bytes in pieces both files have, over the size of the larger file.
+    long long common = 0;
+    for (int i = 0, j = 0; i < a->numPrints && j < b->numPrints;) {
+        int order = compareChunkPrints(&a->prints[i], &b->prints[j]);
+        if (order == 0) {
+            common += a->prints[i].length;
+            i++;
+            j++;
+        } else if (order < 0) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+
+    long long larger = a->file->size > b->file->size ? a->file->size : b->file->size;
+    return larger > 0 ? (int)(common * 100 / larger) : 0;
+}
+
+static int compareDiffEntries(const void* a, const void* b) {
+    return strcmp(((const struct keep_diff_entry*)a)->path, ((const struct keep_diff_entry*)b)->path);
+}
+
+static void fsckProblem(struct fsckRun* run, const char* format, ...) {
+    char message[MAX_ERROR_LENGTH];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    run->result->problems++;
+    if (run->callback != NULL) {
+        run->callback(message, run->arg);
+    }
+}
+
+static void fsckVersion(struct fsckRun* run, int version, struct versionFile** previous, int* numPrevious) {
+    keep_ctx* ctx = run->ctx;
+    char path[MAX_FILE_PATH_LENGTH];
+    struct stat st;
+
+    snprintf(path, sizeof(path), ".keep/%d", version);
+    if (fstatat(ctx->rootFd, path, &st, 0) != 0 || !S_ISDIR(st.st_mode)) {
+        fsckProblem(run, "Version %d is missing", version);
+        return;
+    }
+    snprintf(path, sizeof(path), ".keep/%d/target/note", version);
+    if (fstatat(ctx->rootFd, path, &st, 0) != 0) {
+        fsckProblem(run, "Version %d has no note", version);
+    }
+
+    // loadVersionFiles skips lines it cannot parse, so the manifest is read
+    // once more here to find them.
+    snprintf(path, sizeof(path), ".keep/%d/manifest", version);
+    FILE* manifest = repoOpen(ctx, path, "r");
+    if (manifest != NULL) {
+        char line[MAX_FILE_PATH_LENGTH + 128];
+        int lineNumber = 0;
+        while (fgets(line, sizeof(line), manifest) != NULL) {
+            struct versionFile file;
+            lineNumber++;
+            if (parseManifestLine(line, &file) != 0 || !isSafeRelativePath(file.path)) {
+                fsckProblem(run, "Manifest of version %d has a malformed line %d", version, lineNumber);
+            }
+        }
+        fclose(manifest);
+    }
+
+    struct versionFile* files;
+    int numFiles;
+    if (loadVersionFiles(ctx, version, &files, &numFiles) != 0) {
+        fsckProblem(run, "Version %d has no readable file list", version);
+        return;
+    }
+    qsort(files, numFiles, sizeof(struct versionFile), compareVersionFiles);
+
+    for (int i = 0; i < numFiles; i++) {
+        const struct versionFile* file = &files[i];
+        const struct versionFile* before = findVersionFile(*previous, *numPrevious, file->path);
+        if (before != NULL && file->hash[0] != '\0' && strcmp(before->hash, file->hash) == 0 &&
+            before->size == file->size) {
+            continue;
+        }
+
+        // Versions stored before the object store have no hash to check
+        // their copies against; they can only be checked for presence.
+        // Packed objects, in this repository's packs or an alternate's, are
+        // checked against the pack index rather than unpacked.
+        char source[MAX_FILE_PATH_LENGTH];
+        const struct packEntry* packed;
+        if (file->hash[0] != '\0' && findObject(ctx, file->hash, source, sizeof(source)) != 0 &&
+            (findPackedObject(ctx, file->hash, NULL, &packed) == 0 ||
+             findAlternatePackedObject(ctx, file->hash, NULL, &packed) == 0)) {
+            if ((long long)packed->size != file->size) {
+                fsckProblem(run, "'%s' of version %d has %lld packed bytes instead of %lld", file->path, version,
+                            (long long)packed->size, file->size);
+            }
+            continue;
+        }
+
+        versionFileSource(ctx, version, file, source, sizeof(source));
+        TRACE_COUNT(TRACE_SYSCALLS, 1);
+        if (fstatat(ctx->rootFd, source, &st, 0) != 0) {
+            fsckProblem(run, "'%s' of version %d is missing (%s)", file->path, version, source);
+        } else if (file->hash[0] != '\0' && st.st_size != file->size) {
+            fsckProblem(run, "'%s' of version %d has %lld bytes instead of %lld (%s)", file->path, version,
+                        (long long)st.st_size, file->size, source);
+        }
+    }
+
+    free(*previous);
+    *previous = files;
+    *numPrevious = numFiles;
+}
+
+static int scrubObjects(struct fsckRun* run, int restart) {
+    TRACE_SCOPE("scrubObjects");
+    keep_ctx* ctx = run->ctx;
+
+    // Progress is saved after each of the 256 object directories, so an
+    // interrupted scrub continues where it stopped unless told to restart.
+    // The packs come last, as 0x100.
+    int prefix = 0;
+    FILE* progress = restart ? NULL : repoOpen(ctx, SCRUB_PROGRESS_PATH, "r");
+    if (progress != NULL) {
+        if (fscanf(progress, "%x", &prefix) != 1 || prefix < 0 || prefix > 0x100) {
+            prefix = 0;
+        }
+        fclose(progress);
+    }
+    run->result->resumed_at = prefix;
+
+    struct scrubBatch batch = {ctx, NULL, NULL, NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    int numThreads = processors < 1 ? 1 : processors > SCRUB_MAX_THREADS ? SCRUB_MAX_THREADS : (int)processors;
+    int result = 0;
+
+    for (; prefix <= 0xff && result == 0; prefix++) {
+        if (loadScrubBatch(&batch, prefix) != 0) {
+            result = setError(ctx, -1, "Out of memory");
+            break;
+        }
+
+        pthread_t threads[SCRUB_MAX_THREADS];
+        int started = 0;
+        while (started < numThreads - 1 && started < batch.numNames - 1 &&
+               pthread_create(&threads[started], NULL, scrubWorker, &batch) == 0) {
+            started++;
+        }
+        scrubWorker(&batch);
+        for (int i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        for (int i = 0; i < batch.numNames; i++) {
+            if (batch.states[i] == 1) {
+                fsckProblem(run, "Object %s is corrupt", batch.names[i]);
+            } else if (batch.states[i] == 2) {
+                fsckProblem(run, "Object %s cannot be read", batch.names[i]);
+            }
+            run->result->objects++;
+            run->result->bytes += batch.sizes[i];
+        }
+
+        progress = repoOpen(ctx, SCRUB_PROGRESS_PATH, "w");
+        if (progress != NULL) {
+            fprintf(progress, "%02x\n", prefix + 1);
+            fclose(progress);
+        }
+    }
+
+    if (result == 0) {
+        result = scrubPacks(run);
+    }
+    if (result == 0) {
+        unlinkat(ctx->rootFd, SCRUB_PROGRESS_PATH, 0);
+    }
+    free(batch.names);
+    free(batch.states);
+    free(batch.sizes);
+    pthread_mutex_destroy(&batch.throttleLock);
+    return result;
+}
+
+static int loadScrubBatch(struct scrubBatch* batch, int prefix) {
+    // Lists the objects under .keep/objects/xx. Arrays grow as needed and
+    // are reused for the next directory.
+    batch->numNames = 0;
+    batch->next = 0;
+
+    char dirPath[MAX_FILE_PATH_LENGTH];
+    snprintf(dirPath, sizeof(dirPath), "%s/%02x", OBJECTS_DIR, prefix);
+    DIR* dir = repoOpenDir(batch->ctx, dirPath);
+    if (dir == NULL) {
+        return 0;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strlen(entry->d_name) != HASH_HEX_LENGTH - 2 ||
+            strspn(entry->d_name, "0123456789abcdef") != HASH_HEX_LENGTH - 2) {
+            continue;
+        }
+        if (batch->numNames == batch->capacity) {
+            int grownCapacity = batch->capacity == 0 ? 256 : batch->capacity * 2;
+            char (*names)[HASH_HEX_LENGTH + 1] = realloc(batch->names, grownCapacity * sizeof(*names));
+            if (names != NULL) {
+                batch->names = names;
+            }
+            char* states = realloc(batch->states, grownCapacity);
+            if (states != NULL) {
+                batch->states = states;
+            }
+            long long* sizes = realloc(batch->sizes, grownCapacity * sizeof(long long));
+            if (sizes != NULL) {
+                batch->sizes = sizes;
+            }
+            if (names == NULL || states == NULL || sizes == NULL) {
+                closedir(dir);
+                return -1;
+            }
+            batch->capacity = grownCapacity;
+        }
+        snprintf(batch->names[batch->numNames], HASH_HEX_LENGTH + 1, "%02x%s", prefix, entry->d_name);
+        batch->states[batch->numNames] = 0;
+        batch->sizes[batch->numNames] = 0;
+        batch->numNames++;
+    }
+    closedir(dir);
+
+    // Workers take objects in turn, so on a rotational disk they are handed
+    // out in the order of their place on it.
+    if (!useLayoutOrder(batch->ctx) || batch->numNames < 2) {
+        return 0;
+    }
+    struct layoutKey* keys = malloc(batch->numNames * sizeof(struct layoutKey));
+    char (*names)[HASH_HEX_LENGTH + 1] = malloc(batch->numNames * sizeof(*names));
+    if (keys == NULL || names == NULL) {
+        free(keys);
+        free(names);
+        return 0;
+    }
+    for (int i = 0; i < batch->numNames; i++) {
+        char path[MAX_FILE_PATH_LENGTH];
+        objectPath(batch->names[i], path, sizeof(path));
+        int fd = openat(batch->ctx->rootFd, path, O_RDONLY | O_CLOEXEC);
+        keys[i].physical = fd >= 0 ? physicalOffset(fd, 0) : ULLONG_MAX;
+        keys[i].index = i;
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    qsort(keys, batch->numNames, sizeof(struct layoutKey), compareLayoutKeys);
+    for (int i = 0; i < batch->numNames; i++) {
+        memcpy(names[i], batch->names[keys[i].index], sizeof(names[i]));
+    }
+    memcpy(batch->names, names, batch->numNames * sizeof(*names));
+    free(keys);
+    free(names);
+    return 0;
+}
+
+static void* scrubWorker(void* arg) {
+    struct scrubBatch* batch = arg;
+    for (;;) {
+        int next = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        if (next >= batch->numNames) {
+            return NULL;
+        }
+        batch->states[next] = scrubObject(batch, next);
+    }
+}
+
+static int scrubObject(struct scrubBatch* batch, int index) {
+    // Runs on worker threads. Returns 0 when the content matches the name,
+    // 1 when it does not and 2 when it cannot be read. The throttle is
+    // shared, so it is only touched under the lock.
+    keep_ctx* ctx = batch->ctx;
+    char path[MAX_FILE_PATH_LENGTH];
+    objectPath(batch->names[index], path, sizeof(path));
+
+    int fd = openat(ctx->rootFd, path, O_RDONLY | O_CLOEXEC);
+    struct stat objectStat;
+    if (fd < 0 || fstat(fd, &objectStat) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 2;
+    }
+    batch->sizes[index] = objectStat.st_size;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (useLayoutOrder(ctx)) {
+        posix_fadvise(fd, 0, LAYOUT_READAHEAD, POSIX_FADV_WILLNEED);
+    }
+
+    struct sha256 sha;
+    sha256Init(&sha);
+
+    char buf[COPY_CHUNK_SIZE];
+    off_t offset = 0;
+    int state = 0;
+    while (offset < objectStat.st_size && state == 0) {
+        off_t start;
+        off_t end;
+        nextDataExtent(fd, offset, objectStat.st_size, &start, &end);
+        hashZeros(&sha, start - offset);
+        offset = start;
+
+        while (offset < end) {
+            size_t length = end - offset < (off_t)sizeof(buf) ? end - offset : (off_t)sizeof(buf);
+            pthread_mutex_lock(&batch->throttleLock);
+            long long started = throttleBegin(ctx, length, 1);
+            pthread_mutex_unlock(&batch->throttleLock);
+
+            ssize_t n = pread(fd, buf, length, offset);
+
+            pthread_mutex_lock(&batch->throttleLock);
+            throttleEnd(ctx, started, 1);
+            pthread_mutex_unlock(&batch->throttleLock);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                state = 2;
+                break;
+            }
+            sha256Update(&sha, buf, n);
+            offset += n;
+        }
+    }
+
+    if (ctx->cachePolicy != KEEP_CACHE_NORMAL) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    close(fd);
+    if (state != 0) {
+        return state;
+    }
+
+    char hash[HASH_HEX_LENGTH + 1];
+    sha256Final(&sha, hash);
+    return strcmp(hash, batch->names[index]) == 0 ? 0 : 1;
+}
+
+static int mirrorRepo(keep_ctx* ctx, const char* dir, int push, struct keep_mirror_result* result) {
+    memset(result, 0, sizeof(*result));
+
+    int error = requireRepo(ctx);
+    if (error != KEEP_OK) {
+        return error;
+    }
+
+    keep_ctx* other = keep_open(dir, NULL);
+    if (other == NULL || requireRepo(other) != KEEP_OK) {
+        keep_close(other);
+        return setError(ctx, KEEP_ERR_NO_REPO, "'%s' is not a keep repository", dir);
+    }
+
+    // Only the receiving side changes, so only it is locked; the sending
+    // side is read like any other reader.
+    keep_ctx* source = push ? ctx : other;
+    keep_ctx* target = push ? other : ctx;
+    ctx->error[0] = '\0';
+
+    int lockFd = lockRepo(target);
+    if (lockFd < 0) {
+        error = KEEP_ERR_IO;
+    } else {
+        error = copyMissingVersions(source, target, result);
+        unlockRepo(lockFd);
+        recordMetrics(target);
+    }
+
+    if (error != KEEP_OK && other->error[0] != '\0') {
+        snprintf(ctx->error, sizeof(ctx->error), "%s", other->error);
+    }
+    keep_close(other);
+    return error;
+}
+
+static int copyMissingVersions(keep_ctx* source, keep_ctx* target, struct keep_mirror_result* result) {
+    int sourceLatest = readLatestVersion(source);
+    int targetLatest = readLatestVersion(target);
+    if (sourceLatest < 0 || targetLatest < 0) {
+        return KEEP_ERR_IO;
+    }
+
+    // Versions are numbered the same way on both sides, so the receiver only
+    // lacks the versions after its latest one, provided that one matches.
+    if (targetLatest > sourceLatest) {
+        return setError(target, KEEP_ERR_EXISTS, "Destination has versions that the source lacks");
+    }
+    if (targetLatest > 0) {
+        int same = sameVersion(source, target, targetLatest);
+        if (same < 0) {
+            return KEEP_ERR_IO;
+        }
+        if (!same) {
+            return setError(target, KEEP_ERR_EXISTS, "Repositories differ at version %d", targetLatest);
+        }
+    }
+
+    for (int version = targetLatest + 1; version <= sourceLatest; version++) {
+        if (copyVersion(source, target, version, result) != 0) {
+            return KEEP_ERR_IO;
+        }
+        result->versions++;
+    }
+    return KEEP_OK;
+}
+
+static int copyVersion(keep_ctx* source, keep_ctx* target, int version, struct keep_mirror_result* result) {
+    TRACE_SCOPE("copyVersion");
+
+    struct versionFile* files;
+    int numFiles;
+    if (loadVersionFiles(source, version, &files, &numFiles) != 0) {
+        return -1;
+    }
+
+    char stagingDir[MAX_FILE_PATH_LENGTH];
+    if (prepareStagingDir(target, version, stagingDir, sizeof(stagingDir)) != 0) {
+        free(files);
+        return -1;
+    }
+
+    // Objects the receiver already has, itself or through an alternate,
+    // are skipped. Everything else is hashed again on the way in, which
+    // also converts versions stored before the object store. Objects from
+    // inline packs go into one of the receiver's, a group at a time.
+    struct inlineBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.fd = -1;
+    FILE* inlinePlan = NULL;
+    int copied = 0;
+    for (int i = 0; i < numFiles && copied == 0; i++) {
+        struct versionFile* file = &files[i];
+        if (file->hash[0] != '\0' && borrowObject(target, file->hash) == 0) {
+            continue;
+        }
+
+        char sourceFile[MAX_FILE_PATH_LENGTH];
+        int deferred = planFileSource(source, version, file, &inlinePlan, sourceFile, sizeof(sourceFile));
+        if (deferred != 0) {
+            copied = deferred < 0 ? -1 : 0;
+            continue;
+        }
+
+        int sourceFd = openat(source->rootFd, sourceFile, O_RDONLY | O_CLOEXEC);
+        if (sourceFd < 0) {
+            copied = setError(source, -1, "Failed to open file '%s'", sourceFile);
+            break;
+        }
+
+        char hash[HASH_HEX_LENGTH + 1];
+        copied = ingestFd(target, sourceFd, -1, hash, &file->size);
+        close(sourceFd);
+
+        if (copied == 0 && file->hash[0] != '\0' && strcmp(hash, file->hash) != 0) {
+            copied = setError(source, -1, "Object %s is corrupt", file->hash);
+        }
+        memcpy(file->hash, hash, sizeof(file->hash));
+        result->objects++;
+        result->bytes += file->size;
+    }
+
+    if (copied == 0 && inlinePlan != NULL) {
+        struct inlineMirror mirror = {target, &batch, result};
+        copied = readInlineFiles(source, inlinePlan, mirrorInlineFile, &mirror);
+    } else if (inlinePlan != NULL) {
+        fclose(inlinePlan);
+    }
+    if (finishInlineBatch(target, &batch, copied == 0) != 0) {
+        copied = -1;
+    }
+
+    if (copied == 0) {
+        char sourceNote[MAX_FILE_PATH_LENGTH];
+        snprintf(sourceNote, sizeof(sourceNote), ".keep/%d/target/note", version);
+        char targetNote[MAX_FILE_PATH_LENGTH];
+        snprintf(targetNote, sizeof(targetNote), "%s/target/note", stagingDir);
+
+        int sourceFd = openat(source->rootFd, sourceNote, O_RDONLY | O_CLOEXEC);
+        int targetFd = openat(target->rootFd, targetNote, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        struct stat noteStat;
+        if (sourceFd < 0 || targetFd < 0 || fstat(sourceFd, &noteStat) != 0 ||
+            forwardBytes(sourceFd, targetFd, noteStat.st_size) != 0) {
+            copied = setError(target, -1, "Failed to copy the note of version %d", version);
+        }
+        if (sourceFd >= 0) {
+            close(sourceFd);
+        }
+        if (targetFd >= 0) {
+            close(targetFd);
+        }
+    }
+
+    if (copied == 0) {
+        copied = writeManifest(target, stagingDir, files, numFiles);
+    }
+    free(files);
+
+    if (copied != 0) {
+        removeTree(target, stagingDir);
+        return -1;
+    }
+    return publishVersion(target, stagingDir, version);
+}
+
+static int sameVersion(keep_ctx* source, keep_ctx* target, int version) {
+    char sourceNote[MAX_ERROR_LENGTH];
+    char targetNote[MAX_ERROR_LENGTH];
+    if (keep_note(source, version, sourceNote, sizeof(sourceNote)) != KEEP_OK ||
+        keep_note(target, version, targetNote, sizeof(targetNote)) != KEEP_OK) {
+        return -1;
+    }
+
+    struct versionFile* sourceFiles;
+    struct versionFile* targetFiles;
+    int numSourceFiles;
+    int numTargetFiles;
+    if (loadVersionFiles(source, version, &sourceFiles, &numSourceFiles) != 0) {
+        return -1;
+    }
+    if (loadVersionFiles(target, version, &targetFiles, &numTargetFiles) != 0) {
+        free(sourceFiles);
+        return -1;
+    }
+
+    // Versions stored before the object store carry no hashes; for those
+    // the note and the file list have to do.
+    int same = strcmp(sourceNote, targetNote) == 0 && numSourceFiles == numTargetFiles;
+    for (int i = 0; i < numSourceFiles && same; i++) {
+        const struct versionFile* a = &sourceFiles[i];
+        const struct versionFile* b = &targetFiles[i];
+        same = strcmp(a->path, b->path) == 0 &&
+               (a->hash[0] == '\0' || b->hash[0] == '\0' || strcmp(a->hash, b->hash) == 0);
+    }
+
+    free(sourceFiles);
+    free(targetFiles);
+    return same;
+}
+
+static int readBaseVersion(keep_ctx* ctx) {
+    FILE* baseVersionFile = repoOpen(ctx, BASE_VERSION_PATH, "r");
+    if (baseVersionFile == NULL) {
+        return 0;
+    }
+
+    int baseVersion;
+    if (fscanf(baseVersionFile, "%d", &baseVersion) != 1) {
+        baseVersion = 0;
+    }
+    fclose(baseVersionFile);
+    return baseVersion;
+}
+
+static int updateBaseVersion(keep_ctx* ctx, int version) {
+    // The version the working tree last matched, by store or restore. The
+    // next store takes unmodified files from it without reading them.
+    FILE* baseVersionFile = repoOpen(ctx, BASE_VERSION_PATH, "w");
+    if (baseVersionFile == NULL) {
+        return setError(ctx, -1, "Failed to open base-version file");
+    }
+
+    fprintf(baseVersionFile, "%d", version);
+    fclose(baseVersionFile);
+    return 0;
+}
+
+static FILE* repoOpen(keep_ctx* ctx, const char* path, const char* mode) {
+    int flags = O_RDONLY;
+    if (mode[0] == 'w') {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (mode[0] == 'a') {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    }
+
+    int fd = openat(ctx->rootFd, path, flags | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    FILE* file = fdopen(fd, mode);
+    if (file == NULL) {
+        close(fd);
+    }
+    return file;
+}
+
+static DIR* repoOpenDir(keep_ctx* ctx, const char* path) {
+    int fd = openat(ctx->rootFd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    DIR* dir = fdopendir(fd);
+    if (dir == NULL) {
+        close(fd);
+    }
+    return dir;
+}
+
+static int readStamp(keep_ctx* ctx, const char* path, struct fileStamp* stamp) {
+    struct stat st;
+    if (fstatat(ctx->rootFd, path, &st, 0) != 0) {
+        stamp->valid = 0;
+        return -1;
+    }
+
+    stamp->valid = 1;
+    stamp->ino = st.st_ino;
+    stamp->size = st.st_size;
+    stamp->mtime = st.st_mtim;
+    return 0;
+}
+
+static int sameStamp(const struct fileStamp* a, const struct fileStamp* b) {
+    return a->valid && b->valid && a->ino == b->ino && a->size == b->size &&
+           a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+static int readLatestVersion(keep_ctx* ctx) {
+    TRACE_SCOPE("readLatestVersion");
+
+    struct fileStamp stamp;
+    if (readStamp(ctx, ".keep/latest-version", &stamp) == 0 &&
+        sameStamp(&stamp, &ctx->latestVersionStamp) && ctx->latestVersion >= 0) {
+        return ctx->latestVersion;
+    }
+
+    FILE* latestVersionFile = repoOpen(ctx, ".keep/latest-version", "r");
+    if (latestVersionFile == NULL) {
+        return setError(ctx, -1, "Failed to open latest-version file");
+    }
+
+    int latestVersion;
+    if (fscanf(latestVersionFile, "%d", &latestVersion) != 1) {
+        fclose(latestVersionFile);
+        return setError(ctx, -1, "Failed to read latest-version file");
+    }
+    fclose(latestVersionFile);
+
+    ctx->latestVersion = latestVersion;
+    ctx->latestVersionStamp = stamp;
+    return latestVersion;
+}
+
+static int updateLatestVersion(keep_ctx* ctx, int latestVersion) {
+    TRACE_SCOPE("updateLatestVersion");
+
+    // Replaced by rename so that a concurrent reader sees either the old or
+    // the new number, never a truncated file.
+    FILE* latestVersionFile = repoOpen(ctx, ".keep/latest-version.temp", "w");
+    if (latestVersionFile == NULL) {
+        return setError(ctx, -1, "Failed to open latest-version file");
+    }
+
+    fprintf(latestVersionFile, "%d", latestVersion + 1);
+    if (fflush(latestVersionFile) != 0 || fsync(fileno(latestVersionFile)) != 0) {
+        fclose(latestVersionFile);
+        return setError(ctx, -1, "Failed to write latest-version file");
+    }
+    fclose(latestVersionFile);
+
+    if (renameat(ctx->rootFd, ".keep/latest-version.temp", ctx->rootFd, ".keep/latest-version") != 0 ||
+        syncPath(ctx, ".keep") != 0) {
+        return setError(ctx, -1, "Failed to update latest-version file");
+    }
+
+    ctx->latestVersion = latestVersion + 1;
+    readStamp(ctx, ".keep/latest-version", &ctx->latestVersionStamp);
+    return 0;
+}
+
+static int loadTrackedFiles(keep_ctx* ctx) {
+    struct fileStamp stamp;
+    if (readStamp(ctx, ".keep/tracking-files", &stamp) == 0 && sameStamp(&stamp, &ctx->trackingFilesStamp)) {
+        return KEEP_OK;
+    }
+
+    FILE* trackingFiles = repoOpen(ctx, ".keep/tracking-files", "r");
+    if (trackingFiles == NULL) {
+        return setError(ctx, KEEP_ERR_IO, "Failed to open tracking-files file");
+    }
+
+    ctx->numTrackedFiles = 0;
+    char line[MAX_FILE_PATH_LENGTH];
+    while (fgets(line, sizeof(line), trackingFiles) != NULL) {
+        char* filePath;
+        long mtime;
+        if (parseTrackingLine(line, &filePath, &mtime) != 0) {
+            continue;
+        }
+
+        if (addTrackedFile(ctx, filePath, mtime) != KEEP_OK) {
+            fclose(trackingFiles);
+            ctx->trackingFilesStamp.valid = 0;
+            return KEEP_ERR_NO_MEMORY;
+        }
+    }
+
+    fclose(trackingFiles);
+    ctx->trackingFilesStamp = stamp;
+    return KEEP_OK;
+}
+
+static int saveTrackedFiles(keep_ctx* ctx) {
+    FILE* tempFile = repoOpen(ctx, ".keep/tracking-files.temp", "w");
+    if (tempFile == NULL) {
+        return setError(ctx, KEEP_ERR_IO, "Failed to create temporary file");
+    }
+
+    for (int i = 0; i < ctx->numTrackedFiles; i++) {
+        fprintf(tempFile, "%s %ld\n", ctx->trackedFiles[i].path, ctx->trackedFiles[i].mtime);
+    }
+
+    if (fclose(tempFile) != 0 ||
+        renameat(ctx->rootFd, ".keep/tracking-files.temp", ctx->rootFd, ".keep/tracking-files") != 0) {
+        ctx->trackingFilesStamp.valid = 0;
+        return setError(ctx, KEEP_ERR_IO, "Failed to update tracking-files file");
+    }
+
+    readStamp(ctx, ".keep/tracking-files", &ctx->trackingFilesStamp);
+    return KEEP_OK;
+}
+
+static int addTrackedFile(keep_ctx* ctx, const char* path, long mtime) {
+    if (ctx->numTrackedFiles == ctx->trackedFilesCapacity) {
+        int capacity = ctx->trackedFilesCapacity > 0 ? ctx->trackedFilesCapacity * 2 : 64;
+        struct trackedFile* trackedFiles = realloc(ctx->trackedFiles, capacity * sizeof(struct trackedFile));
+        if (trackedFiles == NULL) {
+            return setError(ctx, KEEP_ERR_NO_MEMORY, "Out of memory");
+        }
+        ctx->trackedFiles = trackedFiles;
+        ctx->trackedFilesCapacity = capacity;
+    }
+
+    struct trackedFile* trackedFile = &ctx->trackedFiles[ctx->numTrackedFiles++];
+    snprintf(trackedFile->path, sizeof(trackedFile->path), "%s", path);
+    trackedFile->mtime = mtime;
+    return KEEP_OK;
+}
+
+static int trackPath(keep_ctx* ctx, const char* path, int* added) {
+    struct stat st;
+    if (fstatat(ctx->rootFd, path, &st, 0) != 0) {
+        return setError(ctx, KEEP_ERR_IO, "Failed to get information for file '%s'", path);
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        for (int i = 0; i < ctx->numTrackedFiles; i++) {
+            if (strcmp(ctx->trackedFiles[i].path, path) == 0) {
+                return KEEP_OK;
+            }
+        }
+
+        if (addTrackedFile(ctx, path, st.st_mtime) != KEEP_OK) {
+            return KEEP_ERR_NO_MEMORY;
+        }
+        (*added)++;
+        return KEEP_OK;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        return KEEP_OK;
+    }
+
+    DIR* dir = repoOpenDir(ctx, path);
+    if (dir == NULL) {
+        return setError(ctx, KEEP_ERR_IO, "Failed to open '%s' directory", path);
+    }
+
+    int result = KEEP_OK;
+    struct dirent* entry;
+    while (result == KEEP_OK && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        char subPath[MAX_FILE_PATH_LENGTH];
+        snprintf(subPath, sizeof(subPath), "%s/%s", path, entry->d_name);
+        result = trackPath(ctx, subPath, added);
+    }
+
+    closedir(dir);
+    return result;
+}
+
+static int checkModifiedFiles(keep_ctx* ctx) {
+    TRACE_SCOPE("checkModifiedFiles");
+
+    if (loadTrackedFiles(ctx) != KEEP_OK) {
+        return -1;
+    }
+
+    long* mtimes = malloc((ctx->numTrackedFiles + 1) * sizeof(long));
+    if (mtimes == NULL) {
+        return setError(ctx, -1, "Out of memory");
+    }
+
+    int modifiedFiles = 0;
+    if (statTrackedFiles(ctx, mtimes) == 0) {
+        for (int i = 0; i < ctx->numTrackedFiles; i++) {
+            if (mtimes[i] > ctx->trackedFiles[i].mtime) {
+                modifiedFiles++;
+            }
+        }
+    } else {
+        modifiedFiles = -1;
+    }
+
+    free(mtimes);
+    return modifiedFiles;
+}
+
+static int storeNoteForVersion(keep_ctx* ctx, const char* versionDir, const char* note) {
+    TRACE_SCOPE("storeNoteForVersion");
+
+    FILE* noteFile = repoOpen(ctx, ".keep/note", "w");
+    if (noteFile == NULL) {
+        return setError(ctx, -1, "Failed to open note file");
+    }
+
+    fprintf(noteFile, "%s\n", note);
+    fclose(noteFile);
+
+    char targetNoteFile[MAX_FILE_PATH_LENGTH];
+    snprintf(targetNoteFile, sizeof(targetNoteFile), "%s/target/note", versionDir);
+
+    return copyFileToTarget(ctx, ".keep/note", targetNoteFile);
+}
+
+static int storeObjects(keep_ctx* ctx, const char* stagingDir, int* movedFiles) {
+    TRACE_SCOPE("storeObjects");
+
+    // Tracked files are visited in path order next to the base version's
+    // manifest, which is streamed rather than loaded, and the new manifest
+    // is written as they go, sorted too.
+    int numFiles = ctx->numTrackedFiles;
+    const struct trackedFile** tracked = malloc((numFiles + 1) * sizeof(*tracked));
+    long* mtimes = malloc((numFiles + 1) * sizeof(long));
+    struct versionFile* pending = malloc(URING_BATCH_FILES * sizeof(struct versionFile));
+    if (tracked == NULL || mtimes == NULL || pending == NULL) {
+        free(tracked);
+        free(mtimes);
+        free(pending);
+        return setError(ctx, -1, "Out of memory");
+    }
+    for (int i = 0; i < numFiles; i++) {
+        tracked[i] = &ctx->trackedFiles[i];
+    }
+    qsort(tracked, numFiles, sizeof(*tracked), compareTrackedFiles);
+
+    // A file whose mtime has not moved since the working tree last matched
+    // a version still has that version's content, so it keeps its object
+    // and is not read at all.
+    struct manifestStream base = {0};
+    int baseVersion = readBaseVersion(ctx);
+    if (baseVersion > 0 && openManifestStream(ctx, baseVersion, 1, &base) != 0) {
+        base.file = NULL;
+    }
+
+    // A new path with the size of a file that is no longer tracked was
+    // most likely moved or copied. It is hashed first, which only reads it,
+    // and stored only if its content turns out to be new.
+    int numGoneSizes = 0;
+    long long* goneSizes = goneFileSizes(ctx, tracked, numFiles, &base, &numGoneSizes);
+    *movedFiles = 0;
+
+    char manifestPath[MAX_FILE_PATH_LENGTH];
+    snprintf(manifestPath, sizeof(manifestPath), "%s/manifest", stagingDir);
+    FILE* manifest = repoOpen(ctx, manifestPath, "w");
+
+    // Files wait in pending until the batch in front of them is stored, so
+    // that manifest lines go out in order.
+    struct copyJob jobs[URING_BATCH_FILES];
+    struct versionFile* jobFiles[URING_BATCH_FILES];
+    int numJobs = 0;
+    int numPending = 0;
+
+    // New small files go into one inline pack instead of an object file
+    // each, read synchronously whichever backend is in use.
+    struct inlineBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.fd = -1;
+
+    int result = manifest != NULL ? statTrackedFiles(ctx, mtimes) : setError(ctx, -1, "Failed to create manifest file");
+    int haveBase = nextManifestEntry(ctx, &base);
+    for (int i = 0; i < numFiles && result == 0; i++) {
+        while (haveBase > 0 && strcmp(base.entry.path, tracked[i]->path) < 0) {
+            haveBase = nextManifestEntry(ctx, &base);
+        }
+        if (haveBase < 0) {
+            result = -1;
+            break;
+        }
+        const struct versionFile* baseFile = haveBase > 0 && strcmp(base.entry.path, tracked[i]->path) == 0
+                                                 ? &base.entry
+                                                 : NULL;
+
+        long mtime = mtimes[tracked[i] - ctx->trackedFiles];
+        struct versionFile* file = &pending[numPending++];
+        memset(file, 0, sizeof(*file));
+        snprintf(file->path, sizeof(file->path), "%s", tracked[i]->path);
+        file->mtime = mtime;
+
+        int stored = 0;
+        struct stat fileStat;
+        if (baseFile != NULL && baseFile->hash[0] != '\0' && mtime >= 0 && mtime <= tracked[i]->mtime) {
+            memcpy(file->hash, baseFile->hash, sizeof(file->hash));
+            file->size = baseFile->size;
+            ctx->metrics.counters[METRIC_STORE_FILES_REUSED]++;
+            ctx->metrics.counters[METRIC_BYTES_REUSED] += file->size;
+            stored = 1;
+        } else if (baseFile == NULL && numGoneSizes > 0 && fstatat(ctx->rootFd, file->path, &fileStat, 0) == 0 &&
+                   bsearch(&(long long){fileStat.st_size}, goneSizes, numGoneSizes, sizeof(long long),
+                           compareSizes) != NULL) {
+            result = hashFile(ctx, file->path, file->hash, &file->size);
+            if (result == 0 && borrowObject(ctx, file->hash) == 0) {
+                (*movedFiles)++;
+                ctx->metrics.counters[METRIC_STORE_FILES_REUSED]++;
+                ctx->metrics.counters[METRIC_BYTES_REUSED] += file->size;
+                stored = 1;
+            }
+        }
+
+        if (result == 0 && !stored && ctx->inlineLimit > 0 && fstatat(ctx->rootFd, file->path, &fileStat, 0) == 0 &&
+            S_ISREG(fileStat.st_mode) && fileStat.st_size <= ctx->inlineLimit) {
+            int inlined = inlineFile(ctx, &batch, file);
+            result = inlined < 0 ? -1 : 0;
+            stored = inlined == 0;
+        }
+
+        if (result == 0 && !stored && !ctx->useRing) {
+            int sourceFd = openat(ctx->rootFd, file->path, O_RDONLY | O_CLOEXEC);
+            if (sourceFd < 0) {
+                result = setError(ctx, -1, "Failed to open file '%s'", file->path);
+                break;
+            }
+            result = ingestFd(ctx, sourceFd, -1, file->hash, &file->size);
+            close(sourceFd);
+        } else if (result == 0 && !stored) {
+            snprintf(jobs[numJobs].source, sizeof(jobs[numJobs].source), "%s", file->path);
+            tempObjectPath(ctx, jobs[numJobs].target, sizeof(jobs[numJobs].target));
+            jobFiles[numJobs++] = file;
+        }
+
+        if (result == 0 && numPending == URING_BATCH_FILES) {
+            result = flushPendingFiles(ctx, manifest, pending, numPending, jobs, jobFiles, numJobs);
+            numPending = 0;
+            numJobs = 0;
+        }
+    }
+
+    if (result == 0) {
+        result = flushPendingFiles(ctx, manifest, pending, numPending, jobs, jobFiles, numJobs);
+    }
+    if (manifest != NULL && fclose(manifest) != 0 && result == 0) {
+        result = setError(ctx, -1, "Failed to write manifest file");
+    }
+    if (finishInlineBatch(ctx, &batch, result == 0) != 0) {
+        result = -1;
+    }
+
+    closeManifestStream(&base);
+    free(goneSizes);
+    free(pending);
+    free(mtimes);
+    free(tracked);
+    return result;
+}
+
+static long long* goneFileSizes(keep_ctx* ctx, const struct trackedFile** tracked, int numTracked,
+                                struct manifestStream* base, int* count) {
+    // Sorted sizes of the files of the base version that are not tracked
+    // any more, from one merge pass over both lists; base is rewound
+    // afterwards. NULL, with a zero count, when there are none.
+    *count = 0;
+    if (base->file == NULL) {
+        return NULL;
+    }
+
+    long long* sizes = NULL;
+    int capacity = 0;
+    int i = 0;
+    for (int status; (status = nextManifestEntry(ctx, base)) > 0;) {
+        while (i < numTracked && strcmp(tracked[i]->path, base->entry.path) < 0) {
+            i++;
+        }
+        if ((i == numTracked || strcmp(tracked[i]->path, base->entry.path) != 0) && base->entry.hash[0] != '\0') {
+            long long* grown = growArray(sizes, &capacity, *count, sizeof(long long));
+            if (grown == NULL) {
+                break;
+            }
+            sizes = grown;
+            sizes[(*count)++] = base->entry.size;
+        }
+    }
+    rewind(base->file);
+
+    if (*count > 0) {
+        qsort(sizes, *count, sizeof(long long), compareSizes);
+    }
+    return sizes;
+}
+
+static int compareTrackedFiles(const void* a, const void* b) {
+    return strcmp((*(const struct trackedFile* const*)a)->path, (*(const struct trackedFile* const*)b)->path);
+}
+
+static int flushPendingFiles(keep_ctx* ctx, FILE* manifest, const struct versionFile* files, int count,
+                             struct copyJob* jobs, struct versionFile** jobFiles, int numJobs) {
+    int result = numJobs > 0 ? ingestFilesBatched(ctx, jobs, jobFiles, numJobs) : 0;
+    for (int i = 0; i < count && result == 0; i++) {
+        fprintf(manifest, "%s %lld %ld %s\n", files[i].hash, files[i].size, files[i].mtime, files[i].path);
+    }
+    return result;
+}
+
+static int compareSizes(const void* a, const void* b) {
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int inlineFile(keep_ctx* ctx, struct inlineBatch* batch, struct versionFile* file) {
+    // Reads a small file into the group being filled and sets its hash and
+    // size. Returns 1 without keeping anything when the file has grown past
+    // the limit, so that it is stored as usual.
+    if (reserveInlineSpace(ctx, batch, ctx->inlineLimit) != 0) {
+        return -1;
+    }
+
+    int fd = openat(ctx->rootFd, file->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return setError(ctx, -1, "Failed to open file '%s'", file->path);
+    }
+    unsigned char* data = batch->group + batch->groupSize;
+    size_t length = 0;
+    ssize_t n = 1;
+    long long started = throttleBegin(ctx, ctx->inlineLimit, 1);
+    while (n > 0 && length <= (size_t)ctx->inlineLimit) {
+        n = read(fd, data + length, ctx->inlineLimit + 1 - length);
+        if (n < 0 && errno == EINTR) {
+            n = 1;
+        } else if (n > 0) {
+            length += n;
+        }
+    }
+    throttleEnd(ctx, started, 1);
+    if (ctx->cachePolicy != KEEP_CACHE_NORMAL) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    close(fd);
+    TRACE_COUNT(TRACE_SYSCALLS, 3);
+    TRACE_COUNT(TRACE_BYTES, length);
+    TRACE_COUNT(TRACE_FILES, 1);
+    if (n < 0) {
+        return setError(ctx, -1, "Failed to read file '%s'", file->path);
+    }
+    if (length > (size_t)ctx->inlineLimit) {
+        return 1;
+    }
+
+    struct sha256 sha;
+    sha256Init(&sha);
+    sha256Update(&sha, data, length);
+    sha256Final(&sha, file->hash);
+    file->size = length;
+    return addInlineObject(ctx, batch, file->hash, length);
+}
+
+static int reserveInlineSpace(keep_ctx* ctx, struct inlineBatch* batch, size_t length) {
+    // Makes room for length bytes, and one more, after the group being
+    // filled, starting a new group when they do not fit.
+    if (batch->group == NULL && (batch->group = malloc(INLINE_GROUP_SIZE + 1)) == NULL) {
+        return setError(ctx, -1, "Out of memory");
+    }
+    if (batch->groupSize + length > INLINE_GROUP_SIZE) {
+        return flushInlineGroup(ctx, batch);
+    }
+    return 0;
+}
+
+static int addInlineObject(keep_ctx* ctx, struct inlineBatch* batch, const char* hash, size_t length) {
+    // Keeps the length bytes after the group being filled as the object
+    // hash, unless the repository has that already. Content that comes up
+    // twice within one batch is kept twice in the group, where it
+    // compresses away, and indexed once.
+    if (borrowObject(ctx, hash) == 0) {
+        ctx->metrics.counters[METRIC_BYTES_REUSED] += length;
+        return 0;
+    }
+
+    unsigned char binary[OBJECT_HASH_SIZE];
+    parseObjectHash(hash, binary);
+    if (appendInlineEntry(ctx, batch, binary, length) != 0) {
+        return -1;
+    }
+    ctx->metrics.counters[METRIC_OBJECTS_NEW]++;
+    ctx->metrics.counters[METRIC_BYTES_NEW] += length;
+    return 0;
+}
+
+static int appendInlineEntry(keep_ctx* ctx, struct inlineBatch* batch, const unsigned char* hash, size_t length) {
+    // Adds the length bytes after the group being filled to it.
+    struct packEntry* grown = growArray(batch->entries, &batch->capacity, batch->count, sizeof(struct packEntry));
+    if (grown == NULL) {
+        return setError(ctx, -1, "Out of memory");
+    }
+    batch->entries = grown;
+    struct packEntry* entry = &batch->entries[batch->count++];
+    memset(entry, 0, sizeof(*entry));
+    memcpy(entry->hash, hash, OBJECT_HASH_SIZE);
+    entry->offset = batch->groupSize;
+    entry->size = length;
+    batch->groupSize += length;
+    return 0;
+}
+
+static int mirrorInlineFile(keep_ctx* ctx, const struct versionFile* file, const unsigned char* data, void* arg) {
+    // Adds a file read from an inline pack of ctx to the inline batch of
+    // the receiving repository; see copyVersion.
+    struct inlineMirror* mirror = arg;
+    size_t size = file->size;
+    if (size > INLINE_GROUP_SIZE) {
+        return setError(ctx, -1, "Inline object of '%s' is too large", file->path);
+    }
+    if (reserveInlineSpace(mirror->target, mirror->batch, size) != 0) {
+        return -1;
+    }
+    struct inlineBatch* batch = mirror->batch;
+    memcpy(batch->group + batch->groupSize, data, size);
+    TRACE_COUNT(TRACE_BYTES, size);
+
+    struct sha256 sha;
+    char hash[HASH_HEX_LENGTH + 1];
+    sha256Init(&sha);
+    sha256Update(&sha, data, size);
+    sha256Final(&sha, hash);
+    int count = batch->count;
+    if (addInlineObject(mirror->target, batch, hash, size) != 0) {
+        return -1;
+    }
+    if (batch->count > count) {
+        mirror->result->objects++;
+        mirror->result->bytes += size;
+    }
+    return 0;
+}
+
+static int flushInlineGroup(keep_ctx* ctx, struct inlineBatch* batch) {
+    // Compresses the group being filled onto the end of the pack, which is
+    // created on first use.
+    if (batch->groupFirst == batch->count) {
+        batch->groupSize = 0;
+        return 0;
+    }
+    if (batch->fd < 0) {
+        newPackPaths(ctx, "inline", batch->packPath, batch->indexPath, sizeof(batch->packPath));
+        batch->fd = makeParentDirs(ctx, batch->packPath) != 0 ? -1 :
+                    openat(ctx->rootFd, batch->packPath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (batch->fd < 0) {
+            return setError(ctx, -1, "Failed to create pack '%s'", batch->packPath);
+        }
+    }
+
+    lzma_stream stream = LZMA_STREAM_INIT;
+    uint64_t groupStart = batch->packOffset;
+    long long started = throttleBegin(ctx, batch->groupSize, 1);
+    int failed = lzma_easy_encoder(&stream, INLINE_PRESET, LZMA_CHECK_CRC64) != LZMA_OK ||
+                 (batch->groupSize > 0 &&
+                  encodeChunk(&stream, batch->group, batch->groupSize, LZMA_RUN, batch->fd, &batch->packOffset) != 0) ||
+                 encodeChunk(&stream, NULL, 0, LZMA_FINISH, batch->fd, &batch->packOffset) != 0;
+    throttleEnd(ctx, started, 1);
+    lzma_end(&stream);
+    if (failed) {
+        return setError(ctx, -1, "Failed to write pack '%s'", batch->packPath);
+    }
+
+    for (int i = batch->groupFirst; i < batch->count; i++) {
+        batch->entries[i].group = groupStart;
+        batch->entries[i].groupLength = batch->packOffset - groupStart;
+    }
+    batch->groupFirst = batch->count;
+    batch->groupSize = 0;
+    return 0;
+}
+
+static int finishInlineBatch(keep_ctx* ctx, struct inlineBatch* batch, int commit) {
+    // With commit, writes the last group and the index, which publishes
+    // the pack, and only then lists its objects in the object index.
+    // Otherwise, or when that fails, the pack is removed.
+    int result = 0;
+    if (commit && flushInlineGroup(ctx, batch) != 0) {
+        result = -1;
+    }
+    if (batch->fd >= 0) {
+        if (result == 0 && commit && (fsync(batch->fd) != 0 || close(batch->fd) != 0)) {
+            result = setError(ctx, -1, "Failed to write pack '%s'", batch->packPath);
+        } else if (result != 0 || !commit) {
+            close(batch->fd);
+        }
+        if (result == 0 && commit && writePackIndex(ctx, batch->indexPath, batch->entries, batch->count) != 0) {
+            result = setError(ctx, -1, "Failed to write pack '%s'", batch->packPath);
+        }
+        if (result != 0 || !commit) {
+            unlinkat(ctx->rootFd, batch->packPath, 0);
+        }
+    }
+
+    for (int i = 0; i < batch->count && result == 0 && commit; i++) {
+        char hash[HASH_HEX_LENGTH + 1];
+        formatObjectHash(batch->entries[i].hash, hash);
+        objectIndexAdd(ctx, hash);
+    }
+    free(batch->group);
+    free(batch->entries);
+    return result;
+}
+
+static int ingestFilesBatched(keep_ctx* ctx, struct copyJob* jobs, struct versionFile** files, int count) {
+    // io_uring copies the batch into temporary object files, which are then
+    // hashed from the page cache and moved to their final names.
+    int result = makeParentDirs(ctx, jobs[0].target);
+    if (result == 0) {
+        result = copyFilesBatched(ctx, jobs, count);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (result == 0) {
+            result = hashFile(ctx, jobs[i].target, files[i]->hash, &files[i]->size);
+        }
+        if (result == 0) {
+            result = linkObject(ctx, jobs[i].target, files[i]->hash, files[i]->size);
+        } else {
+            unlinkat(ctx->rootFd, jobs[i].target, 0);
+        }
+    }
+    return result;
+}
+
+static int ingestFd(keep_ctx* ctx, int sourceFd, long long limit, char* hash, long long* size) {
+    // Copies up to limit bytes (all of them when negative) from sourceFd into
+    // the object store, hashing on the way. Holes and zero-filled blocks are
+    // left as holes in the object.
+    char tempPath[MAX_FILE_PATH_LENGTH];
+    tempObjectPath(ctx, tempPath, sizeof(tempPath));
+    if (makeParentDirs(ctx, tempPath) != 0) {
+        return -1;
+    }
+
+    int direct = ctx->cachePolicy == KEEP_CACHE_DIRECT;
+    int tempFd = openat(ctx->rootFd, tempPath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (tempFd < 0) {
+        return setError(ctx, -1, "Failed to create object file");
+    }
+    direct = direct && setDirect(tempFd, 1) == 0;
+
+    struct sha256 sha;
+    sha256Init(&sha);
+
+    // A regular file is walked by data extent, so its holes are hashed as
+    // zeros without being read. Streams are read as they come.
+    struct stat sourceStat;
+    int seekable = limit < 0 && fstat(sourceFd, &sourceStat) == 0 && S_ISREG(sourceStat.st_mode);
+    long long end = seekable ? sourceStat.st_size : limit;
+
+    // Sources are read once, front to back. Under KEEP_CACHE_DROP the pages
+    // read here are dropped again unless they were cached beforehand, when
+    // someone else is presumably using them; KEEP_CACHE_DIRECT bypasses the
+    // cache where the filesystem allows it.
+    unsigned char* residency = NULL;
+    int directSource = 0;
+    if (seekable) {
+        posix_fadvise(sourceFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if (ctx->cachePolicy == KEEP_CACHE_DROP) {
+            residency = snapshotResidency(sourceFd, end);
+        } else if (ctx->cachePolicy == KEEP_CACHE_DIRECT) {
+            directSource = setDirect(sourceFd, 1) == 0;
+        }
+    }
+
+    // O_DIRECT needs aligned buffers, offsets and lengths; the spare block
+    // lets the last chunk be padded up to the alignment.
+    char buf[COPY_CHUNK_SIZE + DIRECT_ALIGNMENT] __attribute__((aligned(DIRECT_ALIGNMENT)));
+    long long total = 0;
+    long long written = 0;
+    int padded = 0;
+    off_t dropStart = -1;
+    int anyCached = 0;
+    off_t dataEnd = 0;
+    int result = 0;
+    while (end < 0 || total < end) {
+        size_t length = COPY_CHUNK_SIZE;
+        if (seekable && total >= dataEnd) {
+            off_t dataStart;
+            nextDataExtent(sourceFd, total, end, &dataStart, &dataEnd);
+            hashZeros(&sha, dataStart - total);
+            total = dataStart;
+            if (total >= end) {
+                break;
+            }
+        }
+        if (seekable && dataEnd - total < (long long)length) {
+            length = dataEnd - total;
+        } else if (!seekable && end >= 0 && end - total < (long long)length) {
+            length = end - total;
+        }
+
+        int cached = residency != NULL && isRangeResident(residency, end, total, length);
+
+        long long started = throttleBegin(ctx, length, 1);
+        ssize_t n;
+        if (directSource) {
+            size_t alignedLength = (length + DIRECT_ALIGNMENT - 1) & ~(size_t)(DIRECT_ALIGNMENT - 1);
+            n = pread(sourceFd, buf, alignedLength, total);
+            if (n < 0 && errno == EINVAL) {
+                directSource = 0;
+                setDirect(sourceFd, 0);
+                continue;
+            }
+            if (n > (ssize_t)length) {
+                n = length;
+            }
+        } else {
+            n = seekable ? pread(sourceFd, buf, length, total) : read(sourceFd, buf, length);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n == 0 && (seekable || limit < 0)) {
+            break;
+        }
+        if (n <= 0) {
+            result = setError(ctx, -1, "Failed to read object data");
+            break;
+        }
+
+        // Pages are dropped in windows trailing the reads: readahead fills the
+        // cache with large folios, and a folio only partly inside the range
+        // passed to fadvise is left alone.
+        if (residency != NULL && cached) {
+            anyCached = 1;
+            if (dropStart >= 0) {
+                posix_fadvise(sourceFd, dropStart, total - dropStart, POSIX_FADV_DONTNEED);
+                dropStart = -1;
+            }
+        } else if (residency != NULL) {
+            if (dropStart < 0) {
+                dropStart = total;
+            }
+            if (total + n - dropStart >= DROP_WINDOW) {
+                posix_fadvise(sourceFd, dropStart, total + n - dropStart, POSIX_FADV_DONTNEED);
+                dropStart = total + n;
+            }
+        }
+
+        sha256Update(&sha, buf, n);
+        if (!isZeroBlock(buf, n)) {
+            size_t writeLength = n;
+            if (direct && total % DIRECT_ALIGNMENT != 0) {
+                direct = 0;
+                setDirect(tempFd, 0);
+            }
+            if (direct && writeLength % DIRECT_ALIGNMENT != 0) {
+                writeLength = (writeLength + DIRECT_ALIGNMENT - 1) & ~(size_t)(DIRECT_ALIGNMENT - 1);
+                memset(buf + n, 0, writeLength - n);
+                padded = 1;
+            }
+
+            if ((written != total && lseek(tempFd, total, SEEK_SET) < 0) || writeFully(tempFd, buf, writeLength) != 0) {
+                result = setError(ctx, -1, "Failed to write object file");
+                break;
+            }
+            written = total + writeLength;
+            TRACE_COUNT(TRACE_SYSCALLS, 1);
+        }
+        throttleEnd(ctx, started, 1);
+        total += n;
+        TRACE_COUNT(TRACE_SYSCALLS, 1);
+        TRACE_COUNT(TRACE_BYTES, n);
+    }
+
+    if (residency != NULL && !anyCached) {
+        posix_fadvise(sourceFd, 0, 0, POSIX_FADV_DONTNEED);
+    } else if (residency != NULL && dropStart >= 0) {
+        posix_fadvise(sourceFd, dropStart, total - dropStart, POSIX_FADV_DONTNEED);
+    }
+    free(residency);
+    if (directSource) {
+        setDirect(sourceFd, 0);
+    }
+
+    if (result == 0 && (written != total || padded) && ftruncate(tempFd, total) != 0) {
+        result = setError(ctx, -1, "Failed to write object file");
+    }
+    if (result == 0 && ctx->cachePolicy != KEEP_CACHE_NORMAL) {
+        dropWrittenPages(tempFd);
+    }
+    if (close(tempFd) != 0 && result == 0) {
+        result = setError(ctx, -1, "Failed to write object file");
+    }
+    if (result != 0) {
+        unlinkat(ctx->rootFd, tempPath, 0);
+        return result;
+    }
+
+    sha256Final(&sha, hash);
+    *size = total;
+    TRACE_COUNT(TRACE_FILES, 1);
+    return linkObject(ctx, tempPath, hash, total);
+}
+
+static int hashFile(keep_ctx* ctx, const char* path, char* hash, long long* size) {
+    int fd = openat(ctx->rootFd, path, O_RDONLY | O_CLOEXEC);
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return setError(ctx, -1, "Failed to open file '%s'", path);
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    struct sha256 sha;
+    sha256Init(&sha);
+
+    char buf[65536];
+    off_t offset = 0;
+    while (offset < fileStat.st_size) {
+        off_t start;
+        off_t end;
+        nextDataExtent(fd, offset, fileStat.st_size, &start, &end);
+        hashZeros(&sha, start - offset);
+        offset = start;
+
+        while (offset < end) {
+            size_t length = end - offset < (off_t)sizeof(buf) ? end - offset : (off_t)sizeof(buf);
+            long long started = throttleBegin(ctx, length, 1);
+            ssize_t n = pread(fd, buf, length, offset);
+            throttleEnd(ctx, started, 1);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                close(fd);
+                return setError(ctx, -1, "Failed to read file '%s'", path);
+            }
+            sha256Update(&sha, buf, n);
+            offset += n;
+        }
+    }
+
+    if (ctx->cachePolicy != KEEP_CACHE_NORMAL) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    close(fd);
+
+    sha256Final(&sha, hash);
+    *size = fileStat.st_size;
+    return 0;
+}
+
+static int linkObject(keep_ctx* ctx, const char* tempPath, const char* hash, long long size) {
+    char path[MAX_FILE_PATH_LENGTH];
+    objectPath(hash, path, sizeof(path));
+
+    if (makeParentDirs(ctx, path) != 0) {
+        unlinkat(ctx->rootFd, tempPath, 0);
+        return -1;
+    }
+
+    // Objects are named by content, so one that is already there, here or
+    // in an alternate, is kept.
+    if (borrowObject(ctx, hash) == 0) {
+        unlinkat(ctx->rootFd, tempPath, 0);
+        ctx->metrics.counters[METRIC_BYTES_REUSED] += size;
+        return 0;
+    }
+
+    // The content is synced before the name, which publishVersion syncs.
+    if (syncPath(ctx, tempPath) != 0 || renameat(ctx->rootFd, tempPath, ctx->rootFd, path) != 0) {
+        unlinkat(ctx->rootFd, tempPath, 0);
+        return setError(ctx, -1, "Failed to store object %s", hash);
+    }
+    unsigned int dir = 0;
+    sscanf(hash, "%2x", &dir);
+    ctx->unsyncedObjectDirs[dir / 8] |= 1 << (dir % 8);
+    ctx->metrics.counters[METRIC_OBJECTS_NEW]++;
+    ctx->metrics.counters[METRIC_BYTES_NEW] += size;
+    objectIndexAdd(ctx, hash);
+    return 0;
+}
+
+static int copyDataExtents(keep_ctx* ctx, int sourceFd, int targetFd, off_t size) {
+    // Only the data extents of the source are copied. The target starts out
+    // empty, so skipping over a hole and extending the file at the end
+    // leaves the same hole in the copy. Under a throttle the copy goes in
+    // steps small enough for the limit to be felt.
+    const struct throttle* t = &ctx->throttle;
+    off_t step = t->bytesPerSecond > 0 || t->opsPerSecond > 0 || t->adaptive ? THROTTLE_CHUNK_SIZE : size;
+    off_t offset = 0;
+    while (offset < size) {
+        off_t start;
+        off_t end;
+        nextDataExtent(sourceFd, offset, size, &start, &end);
+        if (start >= size) {
+            break;
+        }
+
+        off_t in = start;
+        off_t out = start;
+        while (in < end) {
+            size_t length = end - in < step ? end - in : step;
+            long long started = throttleBegin(ctx, length, 1);
+            ssize_t n = copy_file_range(sourceFd, &in, targetFd, &out, length, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                char buf[65536];
+                n = pread(sourceFd, buf, length < sizeof(buf) ? length : sizeof(buf), in);
+                if (n > 0 && (lseek(targetFd, out, SEEK_SET) < 0 || writeFully(targetFd, buf, n) != 0)) {
+                    return -1;
+                }
+                if (n > 0) {
+                    in += n;
+                    out += n;
+                }
+            }
+            if (n == 0) {
+                // The source shrank while being copied.
+                size = in;
+                break;
+            }
+            if (n < 0) {
+                return -1;
+            }
+            throttleEnd(ctx, started, 1);
+            TRACE_COUNT(TRACE_SYSCALLS, 1);
+            TRACE_COUNT(TRACE_BYTES, n);
+        }
+        offset = in;
+    }
+
+    return ftruncate(targetFd, size);
+}
+
+static void nextDataExtent(int fd, off_t offset, off_t size, off_t* start, off_t* end) {
+    // Filesystems without SEEK_DATA report the rest of the file as data.
+    off_t data = lseek(fd, offset, SEEK_DATA);
+    if (data < 0) {
+        *start = errno == ENXIO ? size : offset;
+        *end = size;
+        return;
+    }
+
+    off_t hole = lseek(fd, data, SEEK_HOLE);
+    *start = data < size ? data : size;
+    *end = hole < 0 || hole > size ? size : hole;
+    TRACE_COUNT(TRACE_SYSCALLS, 2);
+}
+
+static void hashZeros(struct sha256* sha, long long count) {
+    static const char zeros[65536];
+    while (count > 0) {
+        size_t length = count < (long long)sizeof(zeros) ? count : (long long)sizeof(zeros);
+        sha256Update(sha, zeros, length);
+        count -= length;
+    }
+}
+
+static int isZeroBlock(const char* buf, size_t size) {
+    return size > 0 && buf[0] == 0 && memcmp(buf, buf + 1, size - 1) == 0;
+}
+
+static unsigned char* snapshotResidency(int fd, off_t size) {
+    // Records which pages of the file are in the page cache before it is
+    // read. It has to be taken up front: readahead pulls in pages ahead of
+    // each read, and those would look cached by the time they are reached.
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (size <= 0) {
+        return NULL;
+    }
+
+    void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    unsigned char* residency = malloc((size + pageSize - 1) / pageSize);
+    if (residency != NULL && mincore(map, size, residency) != 0) {
+        free(residency);
+        residency = NULL;
+    }
+    munmap(map, size);
+    return residency;
+}
+
+static int isRangeResident(const unsigned char* residency, off_t size, off_t offset, off_t length) {
+    long pageSize = sysconf(_SC_PAGESIZE);
+    off_t end = offset + length < size ? offset + length : size;
+
+    for (off_t page = offset / pageSize; page * pageSize < end; page++) {
+        if (residency[page] & 1) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void dropWrittenPages(int fd) {
+    // Dirty pages cannot be dropped, so write them back first.
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    TRACE_COUNT(TRACE_SYSCALLS, 2);
+}
+
+static int setDirect(int fd, int direct) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, direct ? flags | O_DIRECT : flags & ~O_DIRECT);
+}
+
+static long long throttleBegin(keep_ctx* ctx, long long bytes, int ops) {
+    // Charges an operation moving bytes against the buckets and sleeps off
+    // any debt. Returns the time the operation starts, for throttleEnd.
+    struct throttle* t = &ctx->throttle;
+    if (t->bytesPerSecond == 0 && t->opsPerSecond == 0 && !t->adaptive) {
+        return 0;
+    }
+
+    long long now = monotonicMicros();
+    double elapsed = (now - t->lastRefill) / 1e6;
+    t->lastRefill = now;
+
+    long long wait = 0;
+    if (t->bytesPerSecond > 0) {
+        double rate = t->bytesPerSecond * t->factor;
+        t->byteTokens += elapsed * rate;
+        if (t->byteTokens > rate) {
+            t->byteTokens = rate;
+        }
+        t->byteTokens -= bytes;
+        if (t->byteTokens < 0) {
+            wait = (long long)(-t->byteTokens / rate * 1e6);
+        }
+    }
+    if (t->opsPerSecond > 0) {
+        double rate = t->opsPerSecond * t->factor;
+        t->opTokens += elapsed * rate;
+        if (t->opTokens > rate) {
+            t->opTokens = rate;
+        }
+        t->opTokens -= ops;
+        if (t->opTokens < 0 && (long long)(-t->opTokens / rate * 1e6) > wait) {
+            wait = (long long)(-t->opTokens / rate * 1e6);
+        }
+    }
+
+    if (wait > 0) {
+        sleepMicros(wait);
+        now = monotonicMicros();
+    }
+    return now;
+}
+
+static void throttleEnd(keep_ctx* ctx, long long started, int ops) {
+    struct throttle* t = &ctx->throttle;
+    if (!t->adaptive || started == 0 || ops <= 0) {
+        return;
+    }
+
+    long long now = monotonicMicros();
+    double latency = (double)(now - started) / ops;
+    if (t->slowLatency == 0) {
+        t->fastLatency = latency;
+        t->slowLatency = latency;
+    }
+    t->fastLatency += (latency - t->fastLatency) / 8;
+    t->slowLatency += (latency - t->slowLatency) / 256;
+
+    // Back off hard while recent operations are much slower than usual and
+    // recover slowly once they are not, a few times a second at most.
+    if (now - t->lastAdjust >= THROTTLE_ADJUST_INTERVAL) {
+        t->lastAdjust = now;
+        if (t->fastLatency > 2 * t->slowLatency) {
+            t->factor = t->factor / 2 < 1.0 / 64 ? 1.0 / 64 : t->factor / 2;
+        } else if (t->fastLatency < 1.25 * t->slowLatency) {
+            t->factor = t->factor + 1.0 / 16 > 1.0 ? 1.0 : t->factor + 1.0 / 16;
+        }
+    }
+
+    // Without explicit rates the factor is a duty cycle: the operation just
+    // done is followed by enough idle time to keep the device busy only
+    // that fraction of the time.
+    if (t->bytesPerSecond == 0 && t->opsPerSecond == 0 && t->factor < 1.0) {
+        sleepMicros((long long)((now - started) * (1 / t->factor - 1)));
+    }
+}
+
+static long long monotonicMicros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void sleepMicros(long long micros) {
+    struct timespec ts = {micros / 1000000, (micros % 1000000) * 1000};
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+static void observeLatency(struct metrics* metrics, enum latency latency, long long micros) {
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        if (micros <= latencyBounds[i]) {
+            metrics->buckets[latency][i]++;
+        }
+    }
+    metrics->buckets[latency][LATENCY_BUCKETS]++;
+    metrics->latencyMicros[latency] += micros;
+}
+
+static void recordMetrics(keep_ctx* ctx) {
+    TRACE_SCOPE("recordMetrics");
+
+    // Adds the counts of the command that just finished to .keep/metrics.
+    // Restores into a separate directory do not hold the repository lock,
+    // so the file has a lock of its own. The counters are informational:
+    // failing to update them never fails the command.
+    struct metrics counted = ctx->metrics;
+    memset(&ctx->metrics, 0, sizeof(ctx->metrics));
+
+    int lockFd = openat(ctx->rootFd, METRICS_LOCK_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lockFd < 0) {
+        return;
+    }
+    while (flock(lockFd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            close(lockFd);
+            return;
+        }
+    }
+
+    struct metrics metrics;
+    loadMetrics(ctx, &metrics);
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        metrics.counters[i] += counted.counters[i];
+    }
+    for (int i = 0; i < LATENCY_COUNT; i++) {
+        for (int j = 0; j <= LATENCY_BUCKETS; j++) {
+            metrics.buckets[i][j] += counted.buckets[i][j];
+        }
+        metrics.latencyMicros[i] += counted.latencyMicros[i];
+    }
+
+    // Replaced by rename, like latest-version, so that keep stats never
+    // sees a partly written file.
+    int fd = openat(ctx->rootFd, METRICS_PATH ".temp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd >= 0) {
+        int result = writeMetrics(fd, &metrics, 0);
+        if (close(fd) != 0 || result != 0 ||
+            renameat(ctx->rootFd, METRICS_PATH ".temp", ctx->rootFd, METRICS_PATH) != 0) {
+            unlinkat(ctx->rootFd, METRICS_PATH ".temp", 0);
+        }
+    }
+    close(lockFd);
+}
+
+static void loadMetrics(keep_ctx* ctx, struct metrics* metrics) {
+    // A missing file, or a line this version does not know, counts as zero.
+    memset(metrics, 0, sizeof(*metrics));
+    FILE* file = repoOpen(ctx, METRICS_PATH, "r");
+    if (file == NULL) {
+        return;
+    }
+
+    char line[MAX_FILE_PATH_LENGTH];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char* value = strchr(line, ' ');
+        if (value == NULL) {
+            continue;
+        }
+        *value++ = '\0';
+
+        int micros;
+        long long* counter = findMetric(metrics, line, &micros);
+        if (counter != NULL) {
+            // Seconds are always written with six decimals.
+            char* end;
+            *counter = strtoll(value, &end, 10);
+            if (micros) {
+                *counter = *counter * 1000000 + (*end == '.' ? strtoll(end + 1, NULL, 10) : 0);
+            }
+        }
+    }
+    fclose(file);
+}
+
+static long long* findMetric(struct metrics* metrics, const char* name, int* micros) {
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        if (strcmp(name, metricInfos[i].name) == 0) {
+            *micros = metricInfos[i].micros;
+            return &metrics->counters[i];
+        }
+    }
+
+    for (int i = 0; i < LATENCY_COUNT; i++) {
+        char bucketName[MAX_FILE_PATH_LENGTH];
+        for (int j = 0; j <= LATENCY_BUCKETS; j++) {
+            latencyBucketName(i, j, bucketName, sizeof(bucketName));
+            if (strcmp(name, bucketName) == 0) {
+                *micros = 0;
+                return &metrics->buckets[i][j];
+            }
+        }
+
+        snprintf(bucketName, sizeof(bucketName), "%s_sum", latencyInfos[i].name);
+        if (strcmp(name, bucketName) == 0) {
+            *micros = 1;
+            return &metrics->latencyMicros[i];
+        }
+    }
+    return NULL;
+}
+
+static void latencyBucketName(enum latency latency, int bucket, char* name, size_t size) {
+    snprintf(name, size, "%s_bucket{le=\"%s\"}", latencyInfos[latency].name, latencyBoundNames[bucket]);
+}
+
+static int writeMetrics(int fd, const struct metrics* metrics, int prometheus) {
+    // .keep/metrics uses the Prometheus text format itself, without the
+    // keep_ prefix and the HELP and TYPE comments.
+    const char* prefix = prometheus ? "keep_" : "";
+    int failed = 0;
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        const struct metricInfo* info = &metricInfos[i];
+        long long value = metrics->counters[i];
+        if (prometheus) {
+            failed |= dprintf(fd, "# HELP keep_%s %s\n# TYPE keep_%s counter\n", info->name, info->help, info->name) < 0;
+        }
+        if (info->micros) {
+            failed |= dprintf(fd, "%s%s %lld.%06lld\n", prefix, info->name, value / 1000000, value % 1000000) < 0;
+        } else {
+            failed |= dprintf(fd, "%s%s %lld\n", prefix, info->name, value) < 0;
+        }
+    }
+
+    for (int i = 0; i < LATENCY_COUNT; i++) {
+        const struct metricInfo* info = &latencyInfos[i];
+        if (prometheus) {
+            failed |= dprintf(fd, "# HELP keep_%s %s\n# TYPE keep_%s histogram\n", info->name, info->help, info->name) < 0;
+        }
+        for (int j = 0; j <= LATENCY_BUCKETS; j++) {
+            char bucketName[MAX_FILE_PATH_LENGTH];
+            latencyBucketName(i, j, bucketName, sizeof(bucketName));
+            failed |= dprintf(fd, "%s%s %lld\n", prefix, bucketName, metrics->buckets[i][j]) < 0;
+        }
+        long long micros = metrics->latencyMicros[i];
+        failed |= dprintf(fd, "%s%s_sum %lld.%06lld\n%s%s_count %lld\n", prefix, info->name, micros / 1000000,
+                          micros % 1000000, prefix, info->name, metrics->buckets[i][LATENCY_BUCKETS]) < 0;
+    }
+    return failed ? -1 : 0;
+}
+
+static int writeMetricsSummary(int fd, const struct metrics* metrics) {
+    const long long* counters = metrics->counters;
+    long long stores = counters[METRIC_STORES];
+    long long restores = counters[METRIC_RESTORES];
+    long long bytesNew = counters[METRIC_BYTES_NEW];
+    long long bytesReused = counters[METRIC_BYTES_REUSED];
+
+    int failed = dprintf(fd, "Stores: %lld (%lld files scanned, %lld changed, %lld reused)\n", stores,
+                         counters[METRIC_STORE_FILES_SCANNED], counters[METRIC_STORE_FILES_CHANGED],
+                         counters[METRIC_STORE_FILES_REUSED]) < 0;
+    if (stores > 0) {
+        failed |= dprintf(fd, "Store time: %.3f s scanning, %.3f s storing objects, %.3f s publishing\n",
+                          counters[METRIC_STORE_SCAN_MICROS] / 1e6, counters[METRIC_STORE_OBJECTS_MICROS] / 1e6,
+                          counters[METRIC_STORE_PUBLISH_MICROS] / 1e6) < 0;
+        char median[32];
+        char tail[32];
+        latencyQuantile(metrics, LATENCY_STORE, 0.5, median, sizeof(median));
+        latencyQuantile(metrics, LATENCY_STORE, 0.99, tail, sizeof(tail));
+        failed |= dprintf(fd, "Store latency: mean %.3f s, p50 %s, p99 %s\n",
+                          metrics->latencyMicros[LATENCY_STORE] / 1e6 / stores, median, tail) < 0;
+    }
+
+    failed |= dprintf(fd, "Restores: %lld (%lld files, %lld bytes)\n", restores, counters[METRIC_RESTORE_FILES],
+                      counters[METRIC_RESTORE_BYTES]) < 0;
+    if (restores > 0) {
+        char median[32];
+        char tail[32];
+        latencyQuantile(metrics, LATENCY_RESTORE, 0.5, median, sizeof(median));
+        latencyQuantile(metrics, LATENCY_RESTORE, 0.99, tail, sizeof(tail));
+        failed |= dprintf(fd, "Restore latency: mean %.3f s, p50 %s, p99 %s\n",
+                          metrics->latencyMicros[LATENCY_RESTORE] / 1e6 / restores, median, tail) < 0;
+    }
+
+    // Bytes reused are bytes that would have been stored again without
+    // content addressing, so together with the new ones they give the
+    // deduplication ratio.
+    failed |= dprintf(fd, "Objects stored: %lld (%lld bytes)\n", counters[METRIC_OBJECTS_NEW], bytesNew) < 0;
+    failed |= dprintf(fd, "Bytes reused: %lld\n", bytesReused) < 0;
+    if (bytesNew > 0) {
+        failed |= dprintf(fd, "Deduplication ratio: %.2f\n", (double)(bytesNew + bytesReused) / bytesNew) < 0;
+    }
+    return failed ? -1 : 0;
+}
+
+static void latencyQuantile(const struct metrics* metrics, enum latency latency, double quantile, char* text,
+                            size_t size) {
+    // Upper bound of the first bucket holding the quantile, which is as
+    // precise as the histogram gets.
+    const long long* buckets = metrics->buckets[latency];
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        if (buckets[i] >= quantile * buckets[LATENCY_BUCKETS]) {
+            snprintf(text, size, "<= %s s", latencyBoundNames[i]);
+            return;
+        }
+    }
+    snprintf(text, size, "> %s s", latencyBoundNames[LATENCY_BUCKETS - 1]);
+}
+
+static void objectPath(const char* hash, char* path, size_t size) {
+    snprintf(path, size, "%s/%.2s/%s", OBJECTS_DIR, hash, hash + 2);
+}
+
+static void tempObjectPath(keep_ctx* ctx, char* path, size_t size) {
+    snprintf(path, size, "%s/incoming/%d.%d", OBJECTS_DIR, (int)getpid(), ctx->tempCounter++);
+}
+
+static int loadAlternates(keep_ctx* ctx) {
+    // .keep/alternates names one object directory per line, as written by
+    // keep_add_alternate. A missing file means there are none.
+    struct fileStamp stamp;
+    if (readStamp(ctx, ALTERNATES_PATH, &stamp) != 0) {
+        ctx->numAlternates = 0;
+        ctx->alternatesStamp.valid = 0;
+        return 0;
+    }
+    if (sameStamp(&stamp, &ctx->alternatesStamp)) {
+        return 0;
+    }
+
+    FILE* alternates = repoOpen(ctx, ALTERNATES_PATH, "r");
+    if (alternates == NULL) {
+        return setError(ctx, -1, "Failed to open alternates file");
+    }
+
+    int capacity = 0;
+    ctx->numAlternates = 0;
+    char line[MAX_FILE_PATH_LENGTH];
+    while (fgets(line, sizeof(line), alternates) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] != '/') {
+            continue;
+        }
+
+        if (ctx->numAlternates == capacity) {
+            capacity = capacity == 0 ? 4 : capacity * 2;
+            char (*grown)[MAX_FILE_PATH_LENGTH] = realloc(ctx->alternates, capacity * sizeof(*grown));
+            if (grown == NULL) {
+                fclose(alternates);
+                ctx->numAlternates = 0;
+                return setError(ctx, -1, "Out of memory");
+            }
+            ctx->alternates = grown;
+        }
+        snprintf(ctx->alternates[ctx->numAlternates++], MAX_FILE_PATH_LENGTH, "%s", line);
+    }
+
+    fclose(alternates);
+    ctx->alternatesStamp = stamp;
+    return 0;
+}
+
+static int findObject(keep_ctx* ctx, const char* hash, char* path, size_t size) {
+    // Sets path to where the object can be read from: this repository when
+    // it has it, otherwise the first alternate that does. Alternates are
+    // absolute, so the path works with openat() on any directory.
+    objectPath(hash, path, size);
+    TRACE_COUNT(TRACE_SYSCALLS, 1);
+    if (faccessat(ctx->rootFd, path, F_OK, 0) == 0) {
+        return 0;
+    }
+
+    loadAlternates(ctx);
+    for (int i = 0; i < ctx->numAlternates; i++) {
+        char alternatePath[MAX_FILE_PATH_LENGTH];
+        snprintf(alternatePath, sizeof(alternatePath), "%s/%.2s/%s", ctx->alternates[i], hash, hash + 2);
+        TRACE_COUNT(TRACE_SYSCALLS, 1);
+        if (access(alternatePath, F_OK) == 0) {
+            snprintf(path, size, "%s", alternatePath);
+            return 0;
+        }
+    }
+
+    objectPath(hash, path, size);
+    return -1;
+}
+
+static int borrowObject(keep_ctx* ctx, const char* hash) {
+    // Returns 0 when the object is available without storing it again. One
+    // found in an alternate on the same filesystem is hard-linked in, so
+    // that this repository keeps it even if the alternate drops it later;
+    // across filesystems the alternate is simply relied upon, and so are
+    // its packs, from which readers unpack the object on first use.
+    //
+    // The object index answers for this repository. Only when it does not
+    // list the object are the alternates asked, and the object directories
+    // only when there is no index. An object missing from the index, say
+    // one stored by an older keep, is at worst stored again.
+    int indexed = objectIndexLookup(ctx, hash);
+    if (indexed == 1) {
+        return 0;
+    }
+    if (indexed == 0 && loadAlternates(ctx) == 0 && ctx->numAlternates == 0) {
+        return -1;
+    }
+
+    char path[MAX_FILE_PATH_LENGTH];
+    if (findObject(ctx, hash, path, sizeof(path)) != 0) {
+        if (findPackedObject(ctx, hash, NULL, NULL) == 0) {
+            return 0;
+        }
+        return findAlternatePackedObject(ctx, hash, NULL, NULL);
+    }
+    if (path[0] == '/') {
+        char localPath[MAX_FILE_PATH_LENGTH];
+        objectPath(hash, localPath, sizeof(localPath));
+        if (makeParentDirs(ctx, localPath) == 0 && linkat(AT_FDCWD, path, ctx->rootFd, localPath, 0) == 0) {
+            objectIndexAdd(ctx, hash);
+        }
+    } else if (indexed == 0) {
+        objectIndexAdd(ctx, hash);
+    }
+    return 0;
+}
+
+static int openObjectIndex(keep_ctx* ctx) {
+    // Maps the index for reading and writing, building it from the object
+    // directories the first time. Only writers use it, under the lock.
+    struct objectIndex* index = &ctx->objectIndex;
+    if (index->map != NULL) {
+        return 0;
+    }
+    if (index->failed) {
+        return -1;
+    }
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int fd = openat(ctx->rootFd, OBJECT_INDEX_PATH, O_RDWR | O_CLOEXEC);
+        struct stat indexStat;
+        if (fd >= 0 && fstat(fd, &indexStat) == 0 && indexStat.st_size >= (off_t)sizeof(struct objectIndexHeader)) {
+            index->size = indexStat.st_size;
+            index->map = mmap(NULL, index->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (index->map == MAP_FAILED) {
+                index->map = NULL;
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        if (index->map != NULL) {
+            struct objectIndexHeader* header = (struct objectIndexHeader*)index->map;
+            uint64_t blocks = header->bloomBlocks;
+            uint64_t slots = header->journalSlots;
+            uint64_t sortedOffset = sizeof(*header) + blocks * BLOOM_BLOCK_SIZE;
+            uint64_t journalOffset = sortedOffset + header->sortedCount * OBJECT_HASH_SIZE;
+            if (memcmp(header->magic, OBJECT_INDEX_MAGIC, sizeof(header->magic)) == 0 &&
+                blocks > 0 && (blocks & (blocks - 1)) == 0 && slots > 0 && (slots & (slots - 1)) == 0 &&
+                journalOffset + slots * OBJECT_HASH_SIZE == index->size) {
+                index->header = header;
+                index->bloom = index->map + sizeof(*header);
+                index->sorted = (const unsigned char (*)[OBJECT_HASH_SIZE])(index->map + sortedOffset);
+                index->journal = (unsigned char (*)[OBJECT_HASH_SIZE])(index->map + journalOffset);
+                return 0;
+            }
+            closeObjectIndex(ctx);
+        }
+
+        if (attempt == 0 && buildObjectIndex(ctx) != 0) {
+            break;
+        }
+    }
+    index->failed = 1;
+    return -1;
+}
+
+static void closeObjectIndex(keep_ctx* ctx) {
+    struct objectIndex* index = &ctx->objectIndex;
+    if (index->map != NULL) {
+        munmap(index->map, index->size);
+    }
+    memset(index, 0, sizeof(*index));
+}
+
+static int objectIndexLookup(keep_ctx* ctx, const char* hash) {
+    // 1 when the index lists the object, 0 when it does not and -1 when
+    // there is no usable index. Most objects asked about are new, and for
+    // those the answer normally comes from a single cache line.
+    unsigned char key[OBJECT_HASH_SIZE];
+    if (parseObjectHash(hash, key) != 0 || openObjectIndex(ctx) != 0) {
+        return -1;
+    }
+
+    struct objectIndex* index = &ctx->objectIndex;
+    if (!bloomTest(index->bloom, index->header->bloomBlocks, key)) {
+        return 0;
+    }
+    if (bsearch(key, index->sorted, index->header->sortedCount, OBJECT_HASH_SIZE, compareObjectHashes) != NULL) {
+        return 1;
+    }
+
+    uint64_t mask = index->header->journalSlots - 1;
+    for (uint64_t slot = hashWord(key, 2) & mask;; slot = (slot + 1) & mask) {
+        if (memcmp(index->journal[slot], key, OBJECT_HASH_SIZE) == 0) {
+            return 1;
+        }
+        if (memcmp(index->journal[slot], emptySlot, OBJECT_HASH_SIZE) == 0) {
+            return 0;
+        }
+    }
+}
+
+static void objectIndexAdd(keep_ctx* ctx, const char* hash) {
+    // The entry goes in before the filter bits and the count, so that an
+    // interrupted update leaves at worst an object the index misses.
+    unsigned char key[OBJECT_HASH_SIZE];
+    if (objectIndexLookup(ctx, hash) != 0 || parseObjectHash(hash, key) != 0) {
+        return;
+    }
+
+    // A journal that could not be merged keeps one slot free, which ends
+    // every probe sequence.
+    struct objectIndex* index = &ctx->objectIndex;
+    if (index->header->journalCount + 2 > index->header->journalSlots) {
+        return;
+    }
+    uint64_t mask = index->header->journalSlots - 1;
+    uint64_t slot = hashWord(key, 2) & mask;
+    while (memcmp(index->journal[slot], emptySlot, OBJECT_HASH_SIZE) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    memcpy(index->journal[slot], key, OBJECT_HASH_SIZE);
+    bloomAdd(index->bloom, index->header->bloomBlocks, key);
+    index->header->journalCount++;
+
+    if (index->header->journalCount * 2 >= index->header->journalSlots) {
+        mergeObjectIndex(ctx);
+    }
+}
+
+static int buildObjectIndex(keep_ctx* ctx) {
+    TRACE_SCOPE("buildObjectIndex");
+
+    // Lists .keep/objects/xx and the packs once, for repositories that
+    // predate the index or lost it.
+    unsigned char (*hashes)[OBJECT_HASH_SIZE] = NULL;
+    uint64_t count = 0;
+    uint64_t capacity = 0;
+    int result = 0;
+    for (int prefix = 0; prefix <= 0xff && result == 0; prefix++) {
+        char dirPath[MAX_FILE_PATH_LENGTH];
+        snprintf(dirPath, sizeof(dirPath), "%s/%02x", OBJECTS_DIR, prefix);
+        DIR* dir = repoOpenDir(ctx, dirPath);
+        if (dir == NULL) {
+            continue;
+        }
+
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strlen(entry->d_name) != HASH_HEX_LENGTH - 2) {
+                continue;
+            }
+            char hex[HASH_HEX_LENGTH + 1];
+            snprintf(hex, sizeof(hex), "%02x%s", prefix, entry->d_name);
+            if (count == capacity) {
+                uint64_t grownCapacity = capacity == 0 ? 1024 : capacity * 2;
+                unsigned char (*grown)[OBJECT_HASH_SIZE] = realloc(hashes, grownCapacity * OBJECT_HASH_SIZE);
+                if (grown == NULL) {
+                    result = setError(ctx, -1, "Out of memory");
+                    break;
+                }
+                hashes = grown;
+                capacity = grownCapacity;
+            }
+            if (parseObjectHash(hex, hashes[count]) == 0) {
+                count++;
+            }
+        }
+        closedir(dir);
+    }
+
+    loadPacks(ctx);
+    for (int i = 0; i < ctx->numPacks && result == 0; i++) {
+        const struct pack* pack = &ctx->packs[i];
+        for (uint64_t j = 0; j < pack->count; j++) {
+            if (count == capacity) {
+                uint64_t grownCapacity = capacity == 0 ? 1024 : capacity * 2;
+                unsigned char (*grown)[OBJECT_HASH_SIZE] = realloc(hashes, grownCapacity * OBJECT_HASH_SIZE);
+                if (grown == NULL) {
+                    result = setError(ctx, -1, "Out of memory");
+                    break;
+                }
+                hashes = grown;
+                capacity = grownCapacity;
+            }
+            memcpy(hashes[count++], pack->entries[j].hash, OBJECT_HASH_SIZE);
+        }
+    }
+
+    if (result == 0 && count > 0) {
+        qsort(hashes, count, OBJECT_HASH_SIZE, compareObjectHashes);
+    }
+    if (result == 0) {
+        result = writeObjectIndex(ctx, NULL, 0, (const unsigned char (*)[OBJECT_HASH_SIZE])hashes, count);
+    }
+    free(hashes);
+    return result;
+}
+
+static int mergeObjectIndex(keep_ctx* ctx) {
+    TRACE_SCOPE("mergeObjectIndex");
+
+    struct objectIndex* index = &ctx->objectIndex;
+    uint64_t slots = index->header->journalSlots;
+    unsigned char (*added)[OBJECT_HASH_SIZE] = malloc((index->header->journalCount + 1) * OBJECT_HASH_SIZE);
+    if (added == NULL) {
+        return setError(ctx, -1, "Out of memory");
+    }
+
+    uint64_t count = 0;
+    for (uint64_t slot = 0; slot < slots && count < index->header->journalCount; slot++) {
+        if (memcmp(index->journal[slot], emptySlot, OBJECT_HASH_SIZE) != 0) {
+            memcpy(added[count++], index->journal[slot], OBJECT_HASH_SIZE);
+        }
+    }
+    if (count > 0) {
+        qsort(added, count, OBJECT_HASH_SIZE, compareObjectHashes);
+    }
+
+    int result = writeObjectIndex(ctx, index->sorted, index->header->sortedCount,
+                                  (const unsigned char (*)[OBJECT_HASH_SIZE])added, count);
+    free(added);
+    closeObjectIndex(ctx);
+    return result;
+}
+
+static int writeObjectIndex(keep_ctx* ctx, const unsigned char (*a)[OBJECT_HASH_SIZE], uint64_t numA,
+                            const unsigned char (*b)[OBJECT_HASH_SIZE], uint64_t numB) {
+    // Writes the union of two sorted lists as a new index with an empty
+    // journal. The journal takes an eighth of the objects listed before the
+    // next merge, which keeps the cost of merging constant per object, and
+    // the filter is sized for the objects the index will hold by then.
+    uint64_t slots = INDEX_MIN_JOURNAL_SLOTS;
+    while (slots < (numA + numB) / 4) {
+        slots *= 2;
+    }
+    uint64_t blocks = 1;
+    while (blocks * BLOOM_BLOCK_SIZE * 8 < (numA + numB + slots / 2) * BLOOM_BITS_PER_OBJECT) {
+        blocks *= 2;
+    }
+
+    unsigned char* bloom = calloc(blocks, BLOOM_BLOCK_SIZE);
+    unsigned char (*buffer)[OBJECT_HASH_SIZE] = malloc(1024 * OBJECT_HASH_SIZE);
+    int fd = makeParentDirs(ctx, OBJECT_INDEX_PATH ".temp") != 0 ? -1 : openat(ctx->rootFd, OBJECT_INDEX_PATH ".temp", O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (bloom == NULL || buffer == NULL || fd < 0) {
+        free(bloom);
+        free(buffer);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return setError(ctx, -1, "Failed to write the object index");
+    }
+
+    struct objectIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, OBJECT_INDEX_MAGIC, sizeof(header.magic));
+    header.bloomBlocks = blocks;
+    header.journalSlots = slots;
+
+    off_t offset = sizeof(header) + blocks * BLOOM_BLOCK_SIZE;
+    int result = 0;
+    int buffered = 0;
+    unsigned char last[OBJECT_HASH_SIZE];
+    uint64_t i = 0;
+    uint64_t j = 0;
+    while ((i < numA || j < numB) && result == 0) {
+        const unsigned char* next;
+        if (j == numB || (i < numA && memcmp(a[i], b[j], OBJECT_HASH_SIZE) <= 0)) {
+            next = a[i++];
+        } else {
+            next = b[j++];
+        }
+        if (header.sortedCount > 0 && memcmp(last, next, OBJECT_HASH_SIZE) == 0) {
+            continue;
+        }
+
+        memcpy(last, next, OBJECT_HASH_SIZE);
+        memcpy(buffer[buffered++], next, OBJECT_HASH_SIZE);
+        bloomAdd(bloom, blocks, next);
+        header.sortedCount++;
+        if (buffered == 1024) {
+            if (pwrite(fd, buffer, buffered * OBJECT_HASH_SIZE, offset) != buffered * OBJECT_HASH_SIZE) {
+                result = -1;
+            }
+            offset += buffered * OBJECT_HASH_SIZE;
+            buffered = 0;
+        }
+    }
+    if (result == 0 && buffered > 0) {
+        if (pwrite(fd, buffer, buffered * OBJECT_HASH_SIZE, offset) != buffered * OBJECT_HASH_SIZE) {
+            result = -1;
+        }
+        offset += buffered * OBJECT_HASH_SIZE;
+    }
+
+    // The journal is left as a hole of zeros, which mark free slots.
+    if (result == 0 && (ftruncate(fd, offset + slots * OBJECT_HASH_SIZE) != 0 ||
+                        pwrite(fd, bloom, blocks * BLOOM_BLOCK_SIZE, sizeof(header)) != (ssize_t)(blocks * BLOOM_BLOCK_SIZE) ||
+                        pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || fsync(fd) != 0)) {
+        result = -1;
+    }
+    free(bloom);
+    free(buffer);
+    if (close(fd) != 0) {
+        result = -1;
+    }
+
+    if (result != 0 || renameat(ctx->rootFd, OBJECT_INDEX_PATH ".temp", ctx->rootFd, OBJECT_INDEX_PATH) != 0) {
+        unlinkat(ctx->rootFd, OBJECT_INDEX_PATH ".temp", 0);
+        return setError(ctx, -1, "Failed to write the object index");
+    }
+    return 0;
+}
+
+static int parseObjectHash(const char* hex, unsigned char* hash) {
+    for (int i = 0; i < OBJECT_HASH_SIZE; i++) {
+        int value = 0;
+        for (int k = 0; k < 2; k++) {
+            char c = hex[i * 2 + k];
+            int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+            if (digit < 0) {
+                return -1;
+            }
+            value = value * 16 + digit;
+        }
+        hash[i] = value;
+    }
+    return hex[OBJECT_HASH_SIZE * 2] == '\0' ? 0 : -1;
+}
+
+static int compareObjectHashes(const void* a, const void* b) {
+    return memcmp(a, b, OBJECT_HASH_SIZE);
+}
+
+static uint64_t hashWord(const unsigned char* hash, int word) {
+    uint64_t value;
+    memcpy(&value, hash + word * sizeof(value), sizeof(value));
+    return value;
+}
+
+static void bloomAdd(unsigned char* bloom, uint64_t blocks, const unsigned char* hash) {
+    unsigned char* block = bloom + (hashWord(hash, 0) & (blocks - 1)) * BLOOM_BLOCK_SIZE;
+    uint64_t bits = hashWord(hash, 1);
+    for (int i = 0; i < BLOOM_PROBES; i++, bits >>= 9) {
+        block[(bits & 511) >> 3] |= 1 << (bits & 7);
+    }
+}
+
+static int bloomTest(const unsigned char* bloom, uint64_t blocks, const unsigned char* hash) {
+    const unsigned char* block = bloom + (hashWord(hash, 0) & (blocks - 1)) * BLOOM_BLOCK_SIZE;
+    uint64_t bits = hashWord(hash, 1);
+    for (int i = 0; i < BLOOM_PROBES; i++, bits >>= 9) {
+        if (!(block[(bits & 511) >> 3] & (1 << (bits & 7)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int tierObjects(keep_ctx* ctx, const struct keep_tier_options* options, struct keep_tier_result* result) {
+    int latestVersion = readLatestVersion(ctx);
+    if (latestVersion < 0) {
+        return KEEP_ERR_IO;
+    }
+    int baseVersion = readBaseVersion(ctx);
+    time_t now = time(NULL);
+
+    // The latest version, the one the working tree is based on and the
+    // recent or recently restored ones are hot, the rest cold. A file is
+    // only looked at again when it changed since the version before or
+    // that version was of the other kind.
+    char (*hot)[HASH_HEX_LENGTH + 1] = NULL;
+    int numHot = 0;
+    int hotCapacity = 0;
+    struct tierObject* cold = NULL;
+    int numCold = 0;
+    int coldCapacity = 0;
+    struct versionFile* previous = NULL;
+    int numPrevious = 0;
+    int previousHot = -1;
+    int error = KEEP_OK;
+    for (int version = 1; version <= latestVersion && error == KEEP_OK; version++) {
+        struct versionFile* files;
+        int numFiles;
+        if (loadVersionFiles(ctx, version, &files, &numFiles) != 0) {
+            error = KEEP_ERR_IO;
+            break;
+        }
+        qsort(files, numFiles, sizeof(struct versionFile), compareVersionFiles);
+
+        int isHot = version == latestVersion || version == baseVersion || !isColdVersion(ctx, version, now, options);
+        result->cold_versions += !isHot;
+        for (int i = 0; i < numFiles; i++) {
+            const struct versionFile* file = &files[i];
+            const struct versionFile* before = findVersionFile(previous, numPrevious, file->path);
+            if (file->hash[0] == '\0' ||
+                (isHot == previousHot && before != NULL && strcmp(before->hash, file->hash) == 0)) {
+                continue;
+            }
+
+            if (isHot) {
+                void* grown = growArray(hot, &hotCapacity, numHot, sizeof(*hot));
+                if (grown == NULL) {
+                    error = setError(ctx, KEEP_ERR_NO_MEMORY, "Out of memory");
+                    break;
+                }
+                hot = grown;
+                memcpy(hot[numHot++], file->hash, sizeof(*hot));
+            } else {
+                void* grown = growArray(cold, &coldCapacity, numCold, sizeof(*cold));
+                if (grown == NULL) {
+                    error = setError(ctx, KEEP_ERR_NO_MEMORY, "Out of memory");
+                    break;
+                }
+                cold = grown;
+                struct tierObject* object = &cold[numCold++];
+                memcpy(object->hash, file->hash, sizeof(object->hash));
+                snprintf(object->path, sizeof(object->path), "%s", file->path);
+                object->version = version;
+            }
+        }
+
+        free(previous);
+        previous = files;
+        numPrevious = numFiles;
+        previousHot = isHot;
+    }
+    free(previous);
+
+    if (error == KEEP_OK && numHot > 0) {
+        qsort(hot, numHot, sizeof(*hot), compareHashes);
+    }
+
+    // An object goes into the new pack when no hot version refers to it and
+    // it is only stored loose. Loose copies of packed objects, left by
+    // reading them, are removed. Anything that changed within the grace
+    // period is left alone, as a reader may have just unpacked it.
+    int numPacked = 0;
+    if (error == KEEP_OK && numCold > 0) {
+        qsort(cold, numCold, sizeof(struct tierObject), compareTierObjects);
+        for (int i = 0; i < numCold; i++) {
+            if ((i > 0 && strcmp(cold[i].hash, cold[i - 1].hash) == 0) ||
+                (numHot > 0 && bsearch(cold[i].hash, hot, numHot, sizeof(*hot), compareHashes) != NULL)) {
+                continue;
+            }
+
+            char path[MAX_FILE_PATH_LENGTH];
+            objectPath(cold[i].hash, path, sizeof(path));
+            struct stat objectStat;
+            if (fstatat(ctx->rootFd, path, &objectStat, 0) != 0 || now - objectStat.st_mtime < TIER_GRACE_SECONDS) {
+                continue;
+            }
+            if (findPackedObject(ctx, cold[i].hash, NULL, NULL) == 0) {
+                if (unlinkat(ctx->rootFd, path, 0) == 0) {
+                    result->dropped_objects++;
+                }
+                continue;
+            }
+
+            cold[i].size = objectStat.st_size;
+            cold[numPacked++] = cold[i];
+        }
+    }
+
+    if (error == KEEP_OK && numPacked > 0 && writePack(ctx, cold, numPacked, result) != 0) {
+        error = KEEP_ERR_IO;
+    }
+
+    // Packed objects that hot versions refer to again, because a recent
+    // version brought the content back, are unpacked so that restoring
+    // those versions stays fast. Inline packs are where small objects live
+    // for good, so loose copies of theirs, left by reading them, are
+    // removed instead.
+    for (int i = 0; i < ctx->numPacks && error == KEEP_OK; i++) {
+        const struct pack* pack = &ctx->packs[i];
+        for (uint64_t j = 0; j < pack->count && error == KEEP_OK; j++) {
+            char hash[HASH_HEX_LENGTH + 1];
+            formatObjectHash(pack->entries[j].hash, hash);
+            char path[MAX_FILE_PATH_LENGTH];
+            objectPath(hash, path, sizeof(path));
+            struct stat objectStat;
+            if (pack->isInline) {
+                if (fstatat(ctx->rootFd, path, &objectStat, 0) == 0 &&
+                    now - objectStat.st_mtime >= TIER_GRACE_SECONDS && unlinkat(ctx->rootFd, path, 0) == 0) {
+                    result->dropped_objects++;
+                }
+                continue;
+            }
+            if (bsearch(hash, hot, numHot, sizeof(*hot), compareHashes) == NULL ||
+                faccessat(ctx->rootFd, path, F_OK, 0) == 0) {
+                continue;
+            }
+            if (thawObject(ctx, hash) != 0) {
+                error = KEEP_ERR_IO;
+                break;
+            }
+            result->thawed_objects++;
+        }
+    }
+
+    if (error == KEEP_OK && mergeInlinePacks(ctx, now, result) != 0) {
+        error = KEEP_ERR_IO;
+    }
+
+    free(hot);
+    free(cold);
+    return error;
+}
+
+static int isColdVersion(keep_ctx* ctx, int version, time_t now, const struct keep_tier_options* options) {
+    // A version is as old as its manifest; versions stored before the
+    // object store have none, and no objects either.
+    char path[MAX_FILE_PATH_LENGTH];
+    snprintf(path, sizeof(path), ".keep/%d/manifest", version);
+    struct stat versionStat;
+    if (fstatat(ctx->rootFd, path, &versionStat, 0) != 0 || now - versionStat.st_mtime < options->min_age) {
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "%s/%d", ACCESS_DIR, version);
+    return fstatat(ctx->rootFd, path, &versionStat, 0) != 0 || now - versionStat.st_mtime >= options->min_idle;
+}
+
+static void* growArray(void* array, int* capacity, int count, size_t itemSize) {
+    // Returns array, reallocated to hold one more item if it is full, or
+    // NULL, leaving array as it was.
+    if (count < *capacity) {
+        return array;
+    }
+    int grownCapacity = *capacity == 0 ? 256 : *capacity * 2;
+    void* grown = realloc(array, grownCapacity * itemSize);
+    if (grown != NULL) {
+        *capacity = grownCapacity;
+    }
+    return grown;
+}
+
+static int compareTierObjects(const void* a, const void* b) {
+    // By hash, then oldest version first.
+    const struct tierObject* x = a;
+    const struct tierObject* y = b;
+    int order = strcmp(x->hash, y->hash);
+    return order != 0 ? order : x->version - y->version;
+}
+
+static int compareTierLayout(const void* a, const void* b) {
+    const struct tierObject* x = a;
+    const struct tierObject* y = b;
+    int order = strcmp(x->path, y->path);
+    return order != 0 ? order : x->version - y->version;
+}
+
+static int compareHashes(const void* a, const void* b) {
+    return strcmp(a, b);
+}
+
+static int writePack(keep_ctx* ctx, struct tierObject* objects, int count, struct keep_tier_result* result) {
+    TRACE_SCOPE("writePack");
+    qsort(objects, count, sizeof(struct tierObject), compareTierLayout);
+
+    char packPath[MAX_FILE_PATH_LENGTH];
+    char indexPath[MAX_FILE_PATH_LENGTH];
+    newPackPaths(ctx, "cold", packPath, indexPath, sizeof(packPath));
+
+    struct packEntry* entries = calloc(count, sizeof(struct packEntry));
+    int fd = makeParentDirs(ctx, packPath) != 0 ? -1 :
+             openat(ctx->rootFd, packPath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (entries == NULL || fd < 0) {
+        free(entries);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return setError(ctx, -1, "Failed to create pack '%s'", packPath);
+    }
+
+    int failed = 0;
+    uint64_t packOffset = 0;
+    unsigned char buf[COPY_CHUNK_SIZE];
+    for (int first = 0; first < count && !failed;) {
+        lzma_stream stream = LZMA_STREAM_INIT;
+        if (lzma_easy_encoder(&stream, TIER_PRESET, LZMA_CHECK_CRC64) != LZMA_OK) {
+            failed = 1;
+            break;
+        }
+
+        uint64_t groupStart = packOffset;
+        uint64_t groupSize = 0;
+        int last = first;
+        while (last < count && !failed && (last == first || groupSize + objects[last].size <= TIER_GROUP_SIZE)) {
+            struct tierObject* object = &objects[last];
+            struct packEntry* entry = &entries[last++];
+            parseObjectHash(object->hash, entry->hash);
+            entry->group = groupStart;
+            entry->offset = groupSize;
+
+            char path[MAX_FILE_PATH_LENGTH];
+            objectPath(object->hash, path, sizeof(path));
+            int objectFd = openat(ctx->rootFd, path, O_RDONLY | O_CLOEXEC);
+            if (objectFd < 0) {
+                failed = 1;
+                break;
+            }
+            posix_fadvise(objectFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            for (;;) {
+                long long started = throttleBegin(ctx, sizeof(buf), 1);
+                ssize_t n = read(objectFd, buf, sizeof(buf));
+                throttleEnd(ctx, started, 1);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    failed = n < 0;
+                    break;
+                }
+                if (encodeChunk(&stream, buf, n, LZMA_RUN, fd, &packOffset) != 0) {
+                    failed = 1;
+                    break;
+                }
+                groupSize += n;
+            }
+            if (ctx->cachePolicy != KEEP_CACHE_NORMAL) {
+                posix_fadvise(objectFd, 0, 0, POSIX_FADV_DONTNEED);
+            }
+            close(objectFd);
+            entry->size = groupSize - entry->offset;
+        }
+
+        if (!failed && encodeChunk(&stream, NULL, 0, LZMA_FINISH, fd, &packOffset) != 0) {
+            failed = 1;
+        }
+        lzma_end(&stream);
+        for (int i = first; i < last; i++) {
+            entries[i].groupLength = packOffset - groupStart;
+            result->packed_objects++;
+            result->packed_bytes += entries[i].size;
+        }
+        first = last;
+    }
+    result->pack_bytes = packOffset;
+
+    if (fsync(fd) != 0) {
+        failed = 1;
+    }
+    if (close(fd) != 0) {
+        failed = 1;
+    }
+
+    // The index makes the pack visible, so it goes in place only once the
+    // pack is complete, and the loose objects go only after that.
+    if (!failed && writePackIndex(ctx, indexPath, entries, count) != 0) {
+        failed = 1;
+    }
+    free(entries);
+
+    if (failed) {
+        unlinkat(ctx->rootFd, packPath, 0);
+        return setError(ctx, -1, "Failed to write pack '%s'", packPath);
+    }
+
+    for (int i = 0; i < count; i++) {
+        char path[MAX_FILE_PATH_LENGTH];
+        objectPath(objects[i].hash, path, sizeof(path));
+        unlinkat(ctx->rootFd, path, 0);
+    }
+    return 0;
+}
+
+static int mergeInlinePacks(keep_ctx* ctx, time_t now, struct keep_tier_result* result) {
+    TRACE_SCOPE("mergeInlinePacks");
+
+    // Every store adds an inline pack and object lookups search each pack
+    // in turn, so once there are INLINE_MERGE_PACKS of them they are
+    // combined into one. Their indexes are removed as soon as the new one
+    // is in place. The packs stay for readers that found them before,
+    // until a keep tier TIER_GRACE_SECONDS later.
+    if (removeAbandonedPacks(ctx, now) != 0 || loadPacks(ctx) != 0) {
+        return -1;
+    }
+    int numInline = 0;
+    for (int i = 0; i < ctx->numPacks; i++) {
+        numInline += ctx->packs[i].isInline;
+    }
+    if (numInline < INLINE_MERGE_PACKS) {
+        return 0;
+    }
+
+    struct inlineBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.fd = -1;
+    struct groupBuffer buffer = {NULL, 0, 0};
+    int failed = 0;
+    for (int i = 0; i < ctx->numPacks && !failed; i++) {
+        const struct pack* pack = &ctx->packs[i];
+        if (!pack->isInline) {
+            continue;
+        }
+
+        // Entries are sorted by hash; by group, each group is decoded once.
+        const struct packEntry** byGroup = malloc((pack->count + 1) * sizeof(*byGroup));
+        int packFd = openat(ctx->rootFd, pack->path, O_RDONLY | O_CLOEXEC);
+        failed = byGroup == NULL || packFd < 0;
+        for (uint64_t j = 0; j < pack->count && !failed; j++) {
+            byGroup[j] = &pack->entries[j];
+        }
+        if (!failed) {
+            qsort(byGroup, pack->count, sizeof(*byGroup), comparePackEntryOffsets);
+        }
+
+        uint64_t group = UINT64_MAX;
+        for (uint64_t j = 0; j < pack->count && !failed; j++) {
+            const struct packEntry* entry = byGroup[j];
+            if (entry->group != group) {
+                buffer.length = 0;
+                failed = decodePackGroup(ctx, packFd, entry, consumeGroup, &buffer) != 0;
+                group = entry->group;
+            }
+            failed = failed || entry->size > INLINE_GROUP_SIZE || entry->offset + entry->size > buffer.length ||
+                     reserveInlineSpace(ctx, &batch, entry->size) != 0;
+            if (!failed) {
+                memcpy(batch.group + batch.groupSize, buffer.data + entry->offset, entry->size);
+                TRACE_COUNT(TRACE_BYTES, entry->size);
+                failed = appendInlineEntry(ctx, &batch, entry->hash, entry->size) != 0;
+            }
+        }
+        free(byGroup);
+        if (packFd >= 0) {
+            close(packFd);
+        }
+        if (failed) {
+            setError(ctx, -1, "Failed to read pack '%s'", pack->path);
+        }
+    }
+    free(buffer.data);
+
+    // The objects are in the object index already.
+    if (!failed && flushInlineGroup(ctx, &batch) != 0) {
+        failed = 1;
+    }
+    if (batch.fd >= 0) {
+        if (!failed && (fsync(batch.fd) != 0 || close(batch.fd) != 0 ||
+                        writePackIndex(ctx, batch.indexPath, batch.entries, batch.count) != 0)) {
+            failed = setError(ctx, -1, "Failed to write pack '%s'", batch.packPath);
+        } else if (failed) {
+            close(batch.fd);
+        }
+        if (failed) {
+            unlinkat(ctx->rootFd, batch.packPath, 0);
+        }
+    }
+    free(batch.group);
+    free(batch.entries);
+    if (failed) {
+        return -1;
+    }
+
+    // The grace period of a pack starts when its index goes.
+    for (int i = 0; i < ctx->numPacks; i++) {
+        const struct pack* pack = &ctx->packs[i];
+        if (!pack->isInline) {
+            continue;
+        }
+        char indexPath[MAX_FILE_PATH_LENGTH];
+        snprintf(indexPath, sizeof(indexPath), "%.*s.idx", (int)strlen(pack->path) - 5, pack->path);
+        utimensat(ctx->rootFd, pack->path, NULL, 0);
+        if (unlinkat(ctx->rootFd, indexPath, 0) == 0) {
+            result->merged_packs++;
+        }
+    }
+    return 0;
+}
+
+static int removeAbandonedPacks(keep_ctx* ctx, time_t now) {
+    // Removes packs without an index, which are not being written since
+    // keep tier holds the lock: packs merged into another one and packs a
+    // failed command left behind.
+    DIR* dir = repoOpenDir(ctx, PACKS_DIR);
+    if (dir == NULL) {
+        return errno == ENOENT ? 0 : setError(ctx, -1, "Failed to open directory '%s'", PACKS_DIR);
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (length < 6 || strcmp(entry->d_name + length - 5, ".pack") != 0) {
+            continue;
+        }
+
+        char path[MAX_FILE_PATH_LENGTH];
+        char indexPath[MAX_FILE_PATH_LENGTH];
+        snprintf(path, sizeof(path), "%s/%s", PACKS_DIR, entry->d_name);
+        snprintf(indexPath, sizeof(indexPath), "%s/%.*s.idx", PACKS_DIR, (int)length - 5, entry->d_name);
+        struct stat packStat;
+        if (faccessat(ctx->rootFd, indexPath, F_OK, 0) != 0 && fstatat(ctx->rootFd, path, &packStat, 0) == 0 &&
+            now - packStat.st_mtime >= TIER_GRACE_SECONDS) {
+            unlinkat(ctx->rootFd, path, 0);
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+static int comparePackEntryOffsets(const void* a, const void* b) {
+    const struct packEntry* x = *(const struct packEntry* const*)a;
+    const struct packEntry* y = *(const struct packEntry* const*)b;
+    if (x->group != y->group) {
+        return x->group < y->group ? -1 : 1;
+    }
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static void newPackPaths(keep_ctx* ctx, const char* kind, char* packPath, char* indexPath, size_t size) {
+    // The first kind-N.pack for which neither the pack nor its index exists.
+    int number = 1;
+    do {
+        snprintf(packPath, size, "%s/%s-%d.pack", PACKS_DIR, kind, number);
+        snprintf(indexPath, size, "%s/%s-%d.idx", PACKS_DIR, kind, number++);
+    } while (faccessat(ctx->rootFd, packPath, F_OK, 0) == 0 || faccessat(ctx->rootFd, indexPath, F_OK, 0) == 0);
+}
+
+static int writePackIndex(keep_ctx* ctx, const char* indexPath, struct packEntry* entries, int count) {
+    // Lists entries sorted by hash, each hash once, and renames the index
+    // into place once it is on disk.
+    qsort(entries, count, sizeof(struct packEntry), comparePackEntries);
+    int unique = 0;
+    for (int i = 0; i < count; i++) {
+        if (unique == 0 || comparePackEntries(&entries[unique - 1], &entries[i]) != 0) {
+            entries[unique++] = entries[i];
+        }
+    }
+
+    struct packHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    header.count = unique;
+
+    char tempPath[MAX_FILE_PATH_LENGTH];
+    snprintf(tempPath, sizeof(tempPath), "%s.temp", indexPath);
+    int failed = 0;
+    int fd = openat(ctx->rootFd, tempPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || writeFully(fd, &header, sizeof(header)) != 0 ||
+        writeFully(fd, entries, unique * sizeof(struct packEntry)) != 0 || fsync(fd) != 0) {
+        failed = 1;
+    }
+    if (fd >= 0 && close(fd) != 0) {
+        failed = 1;
+    }
+    if (!failed && renameat(ctx->rootFd, tempPath, ctx->rootFd, indexPath) != 0) {
+        failed = 1;
+    }
+    if (failed) {
+        unlinkat(ctx->rootFd, tempPath, 0);
+        return -1;
+    }
+    return 0;
+}
+
+static int encodeChunk(lzma_stream* stream, const unsigned char* data, size_t length, lzma_action action, int fd,
+                       uint64_t* offset) {
+    // Feeds data to the encoder and appends what it produces to fd. With
+    // LZMA_FINISH, ends the stream.
+    unsigned char out[COPY_CHUNK_SIZE];
+    stream->next_in = data;
+    stream->avail_in = length;
+    for (;;) {
+        stream->next_out = out;
+        stream->avail_out = sizeof(out);
+        lzma_ret ret = lzma_code(stream, action);
+        size_t produced = sizeof(out) - stream->avail_out;
+        if (produced > 0 && writeFully(fd, out, produced) != 0) {
+            return -1;
+        }
+        *offset += produced;
+
+        if (ret == LZMA_STREAM_END) {
+            return 0;
+        }
+        if (ret != LZMA_OK) {
+            return -1;
+        }
+        if (action == LZMA_RUN && stream->avail_in == 0 && stream->avail_out > 0) {
+            return 0;
+        }
+    }
+}
+
+static int comparePackEntries(const void* a, const void* b) {
+    return memcmp(((const struct packEntry*)a)->hash, ((const struct packEntry*)b)->hash, OBJECT_HASH_SIZE);
+}
+
+static int loadPacks(keep_ctx* ctx) {
+    // Maps every .keep/packs/*.idx.
+    struct fileStamp stamp;
+    if (readStamp(ctx, PACKS_DIR, &stamp) != 0) {
+        freePacks(ctx);
+        return 0;
+    }
+    if (sameStamp(&stamp, &ctx->packsStamp)) {
+        return 0;
+    }
+    freePacks(ctx);
+
+    int capacity = 0;
+    if (mapPacks(ctx, PACKS_DIR, &ctx->packs, &ctx->numPacks, &capacity) != 0) {
+        return setError(ctx, -1, "Failed to open directory '%s'", PACKS_DIR);
+    }
+    ctx->packsStamp = stamp;
+    return 0;
+}
+
+static int mapPacks(keep_ctx* ctx, const char* dirPath, struct pack** packs, int* count, int* capacity) {
+    // Adds every index in dirPath to packs. A pack without its index is
+    // still being written, or was abandoned, and is ignored.
+    DIR* dir = repoOpenDir(ctx, dirPath);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (length < 5 || strcmp(entry->d_name + length - 4, ".idx") != 0) {
+            continue;
+        }
+
+        char path[MAX_FILE_PATH_LENGTH];
+        snprintf(path, sizeof(path), "%s/%s", dirPath, entry->d_name);
+        int fd = openat(ctx->rootFd, path, O_RDONLY | O_CLOEXEC);
+        struct stat indexStat;
+        void* map = MAP_FAILED;
+        if (fd >= 0 && fstat(fd, &indexStat) == 0 && indexStat.st_size >= (off_t)sizeof(struct packHeader)) {
+            map = mmap(NULL, indexStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (map == MAP_FAILED) {
+            continue;
+        }
+
+        const struct packHeader* header = map;
+        void* grown = growArray(*packs, capacity, *count, sizeof(struct pack));
+        if (memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) != 0 ||
+            sizeof(*header) + header->count * sizeof(struct packEntry) != (uint64_t)indexStat.st_size ||
+            grown == NULL) {
+            munmap(map, indexStat.st_size);
+            continue;
+        }
+
+        *packs = grown;
+        struct pack* pack = &(*packs)[(*count)++];
+        snprintf(pack->path, sizeof(pack->path), "%s/%.*s.pack", dirPath, (int)length - 4, entry->d_name);
+        pack->isInline = strncmp(entry->d_name, "inline-", 7) == 0;
+        pack->entries = (const struct packEntry*)(header + 1);
+        pack->count = header->count;
+        pack->map = map;
+        pack->mapSize = indexStat.st_size;
+    }
+    closedir(dir);
+    return 0;
+}
+
+static void freePacks(keep_ctx* ctx) {
+    for (int i = 0; i < ctx->numPacks; i++) {
+        munmap(ctx->packs[i].map, ctx->packs[i].mapSize);
+    }
+    free(ctx->packs);
+    ctx->packs = NULL;
+    ctx->numPacks = 0;
+    ctx->packsStamp.valid = 0;
+}
+
+static int loadAlternatePacks(keep_ctx* ctx) {
+    // An alternate's keep tier moves cold objects out of its object store
+    // into .keep/packs next to it, so repositories relying on them look
+    // there too. A missing packs directory is stamped as invalid, which
+    // matches itself here, unlike in sameStamp.
+    if (loadAlternates(ctx) != 0) {
+        return -1;
+    }
+
+    struct fileStamp* stamps = calloc(ctx->numAlternates + 1, sizeof(struct fileStamp));
+    if (stamps == NULL) {
+        return setError(ctx, -1, "Out of memory");
+    }
+    int changed = ctx->alternatePackStamps == NULL || ctx->numAlternatePackStamps != ctx->numAlternates;
+    for (int i = 0; i < ctx->numAlternates; i++) {
+        char dirPath[MAX_FILE_PATH_LENGTH];
+        alternatePacksPath(ctx->alternates[i], dirPath, sizeof(dirPath));
+        readStamp(ctx, dirPath, &stamps[i]);
+        if (!changed) {
+            const struct fileStamp* old = &ctx->alternatePackStamps[i];
+            changed = stamps[i].valid || old->valid ? !sameStamp(&stamps[i], old) : 0;
+        }
+    }
+    if (!changed) {
+        free(stamps);
+        return 0;
+    }
+
+    freeAlternatePacks(ctx);
+    int capacity = 0;
+    for (int i = 0; i < ctx->numAlternates; i++) {
+        char dirPath[MAX_FILE_PATH_LENGTH];
+        alternatePacksPath(ctx->alternates[i], dirPath, sizeof(dirPath));
+        if (stamps[i].valid) {
+            mapPacks(ctx, dirPath, &ctx->alternatePacks, &ctx->numAlternatePacks, &capacity);
+        }
+    }
+    ctx->alternatePackStamps = stamps;
+    ctx->numAlternatePackStamps = ctx->numAlternates;
+    return 0;
+}
+
+static void alternatePacksPath(const char* alternate, char* path, size_t size) {
+    // Alternates name the objects directory of a .keep; packs lie next to it.
+    size_t length = strlen(alternate);
+    if (length >= 8 && strcmp(alternate + length - 8, "/objects") == 0) {
+        length -= 8;
+    }
+    snprintf(path, size, "%.*s/packs", (int)length, alternate);
+}
+
+static void freeAlternatePacks(keep_ctx* ctx) {
+    for (int i = 0; i < ctx->numAlternatePacks; i++) {
+        munmap(ctx->alternatePacks[i].map, ctx->alternatePacks[i].mapSize);
+    }
+    free(ctx->alternatePacks);
+    free(ctx->alternatePackStamps);
+    ctx->alternatePacks = NULL;
+    ctx->numAlternatePacks = 0;
+    ctx->alternatePackStamps = NULL;
+    ctx->numAlternatePackStamps = 0;
+}
+
+static int findPackedObject(keep_ctx* ctx, const char* hash, const struct pack** pack, const struct packEntry** entry) {
+    // Looks in this repository's packs only: whatever it finds there is
+    // this repository's to keep or drop.
+    struct packEntry key;
+    if (parseObjectHash(hash, key.hash) != 0 || loadPacks(ctx) != 0) {
+        return -1;
+    }
+    return searchPacks(ctx->packs, ctx->numPacks, &key, pack, entry);
+}
+
+static int findAlternatePackedObject(keep_ctx* ctx, const char* hash, const struct pack** pack,
+                                     const struct packEntry** entry) {
+    // Looks in the packs of the alternates. Their paths are absolute, and
+    // their objects are only ever read by unpacking them: see
+    // versionFileSource.
+    struct packEntry key;
+    if (parseObjectHash(hash, key.hash) != 0 || loadAlternatePacks(ctx) != 0) {
+        return -1;
+    }
+    return searchPacks(ctx->alternatePacks, ctx->numAlternatePacks, &key, pack, entry);
+}
+
+static int searchPacks(const struct pack* packs, int count, const struct packEntry* key, const struct pack** pack,
+                       const struct packEntry** entry) {
+    for (int i = 0; i < count; i++) {
+        if (packs[i].count == 0) {
+            continue;
+        }
+        const struct packEntry* found = bsearch(key, packs[i].entries, packs[i].count, sizeof(struct packEntry),
+                                                comparePackEntries);
+        if (found != NULL) {
+            if (pack != NULL) {
+                *pack = &packs[i];
+            }
+            if (entry != NULL) {
+                *entry = found;
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int decodePackGroup(keep_ctx* ctx, int fd, const struct packEntry* entry, packConsumer consume, void* arg) {
+    lzma_stream stream = LZMA_STREAM_INIT;
+    if (lzma_stream_decoder(&stream, UINT64_MAX, 0) != LZMA_OK) {
+        return -1;
+    }
+
+    unsigned char in[COPY_CHUNK_SIZE];
+    unsigned char out[COPY_CHUNK_SIZE];
+    uint64_t consumed = 0;
+    uint64_t position = 0;
+    int result = 0;
+    lzma_ret ret = LZMA_OK;
+    while (ret == LZMA_OK && result == 0) {
+        if (stream.avail_in == 0 && consumed < entry->groupLength) {
+            size_t length = entry->groupLength - consumed < sizeof(in) ? entry->groupLength - consumed : sizeof(in);
+            long long started = throttleBegin(ctx, length, 1);
+            ssize_t n = pread(fd, in, length, entry->group + consumed);
+            throttleEnd(ctx, started, 1);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                result = -1;
+                break;
+            }
+            TRACE_COUNT(TRACE_SYSCALLS, 1);
+            consumed += n;
+            stream.next_in = in;
+            stream.avail_in = n;
+        }
+
+        stream.next_out = out;
+        stream.avail_out = sizeof(out);
+        ret = lzma_code(&stream, consumed == entry->groupLength ? LZMA_FINISH : LZMA_RUN);
+        size_t produced = sizeof(out) - stream.avail_out;
+        if (produced > 0) {
+            result = consume(out, produced, position, arg);
+            position += produced;
+        }
+    }
+    lzma_end(&stream);
+
+    if (result == 0 && ret != LZMA_STREAM_END) {
+        result = -1;
+    }
+    return result < 0 ? -1 : 0;
+}
+
+static int consumeSlice(const unsigned char* data, size_t length, uint64_t position, void* arg) {
+    // Picks the bytes of one object out of its group.
+    struct packSlice* slice = arg;
+    uint64_t start = slice->entry->offset;
+    uint64_t end = start + slice->entry->size;
+    uint64_t from = position > start ? position : start;
+    uint64_t to = position + length < end ? position + length : end;
+    if (from < to) {
+        sha256Update(slice->sha, data + (from - position), to - from);
+        if (slice->copy != NULL) {
+            memcpy(slice->copy + (from - start), data + (from - position), to - from);
+        }
+        if (slice->fd >= 0 && writeFully(slice->fd, data + (from - position), to - from) != 0) {
+            return -1;
+        }
+    }
+    return position + length >= end ? 1 : 0;
+}
+
+static int thawObject(keep_ctx* ctx, const char* hash) {
+    TRACE_SCOPE("thawObject");
+
+    // Unpacks an object of this repository's packs, or else of an
+    // alternate's, into the object store. The copy is written and checked
+    // like any new object before it is renamed into place, so readers can
+    // do this without the lock.
+    const struct pack* pack;
+    const struct packEntry* entry;
+    if (findPackedObject(ctx, hash, &pack, &entry) != 0 && findAlternatePackedObject(ctx, hash, &pack, &entry) != 0) {
+        return -1;
+    }
+
+    char tempPath[MAX_FILE_PATH_LENGTH];
+    tempObjectPath(ctx, tempPath, sizeof(tempPath));
+    int packFd = openat(ctx->rootFd, pack->path, O_RDONLY | O_CLOEXEC);
+    int fd = makeParentDirs(ctx, tempPath) != 0 ? -1 :
+             openat(ctx->rootFd, tempPath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+    if (packFd < 0 || fd < 0) {
+        if (packFd >= 0) {
+            close(packFd);
+        }
+        if (fd >= 0) {
+            close(fd);
+            unlinkat(ctx->rootFd, tempPath, 0);
+        }
+        return setError(ctx, -1, "Failed to unpack object %s", hash);
+    }
+
+    struct sha256 sha;
+    sha256Init(&sha);
+    struct packSlice slice = {entry, fd, &sha, NULL};
+    int result = entry->size == 0 ? 0 : decodePackGroup(ctx, packFd, entry, consumeSlice, &slice);
+    close(packFd);
+    if (close(fd) != 0) {
+        result = -1;
+    }
+
+    char check[HASH_HEX_LENGTH + 1];
+    sha256Final(&sha, check);
+    char path[MAX_FILE_PATH_LENGTH];
+    objectPath(hash, path, sizeof(path));
+    if (result != 0 || strcmp(check, hash) != 0 || makeParentDirs(ctx, path) != 0 ||
+        renameat(ctx->rootFd, tempPath, ctx->rootFd, path) != 0) {
+        unlinkat(ctx->rootFd, tempPath, 0);
+        return setError(ctx, -1, "Failed to unpack object %s from '%s'", hash, pack->path);
+    }
+    TRACE_COUNT(TRACE_BYTES, entry->size);
+    return 0;
+}
+
+static int findInlineObject(keep_ctx* ctx, const char* hash, const struct pack** pack, const struct packEntry** entry) {
+    // Finds an object that only an inline pack holds. Readers take such
+    // objects from the pack rather than unpack them into the object store.
+    char path[MAX_FILE_PATH_LENGTH];
+    if (hash[0] == '\0' || findObject(ctx, hash, path, sizeof(path)) == 0 ||
+        findPackedObject(ctx, hash, pack, entry) != 0 || !(*pack)->isInline) {
+        return -1;
+    }
+    return 0;
+}
+
+static unsigned char* readPackedObject(keep_ctx* ctx, const char* packPath, const struct packEntry* entry) {
+    // Decodes one object into memory, followed by a NUL for regexec, and
+    // checks it against its hash. Sets no error, so that worker threads can
+    // call it too.
+    unsigned char* data = malloc(entry->size + 1);
+    int packFd = data == NULL ? -1 : openat(ctx->rootFd, packPath, O_RDONLY | O_CLOEXEC);
+    if (packFd < 0) {
+        free(data);
+        return NULL;
+    }
+
+    struct sha256 sha;
+    sha256Init(&sha);
+    struct packSlice slice = {entry, -1, &sha, data};
+    int result = entry->size == 0 ? 0 : decodePackGroup(ctx, packFd, entry, consumeSlice, &slice);
+    close(packFd);
+
+    char check[HASH_HEX_LENGTH + 1];
+    unsigned char hash[OBJECT_HASH_SIZE];
+    sha256Final(&sha, check);
+    if (result != 0 || parseObjectHash(check, hash) != 0 || memcmp(hash, entry->hash, OBJECT_HASH_SIZE) != 0) {
+        free(data);
+        return NULL;
+    }
+    data[entry->size] = '\0';
+    TRACE_COUNT(TRACE_BYTES, entry->size);
+    return data;
+}
+
+static int planFileSource(keep_ctx* ctx, int version, const struct versionFile* file, FILE** plan, char* path,
+                          size_t size) {
+    // Like versionFileSource, except that a file whose content only lies in
+    // an inline pack is added to plan, created on first use, for
+    // readInlineFiles. Returns 1 then, 0 when path is set and -1 on errors.
+    const struct pack* pack;
+    const struct packEntry* entry;
+    if (file->hash[0] == '\0' || findObject(ctx, file->hash, path, size) == 0 ||
+        findPackedObject(ctx, file->hash, &pack, &entry) != 0 || !pack->isInline) {
+        versionFileSource(ctx, version, file, path, size);
+        return 0;
+    }
+
+    if (*plan == NULL && (*plan = createSortFile(ctx)) == NULL) {
+        return -1;
+    }
+    fprintf(*plan, "%s %016llx %016llx %016llx %016llx %ld %s\n", pack->path, (unsigned long long)entry->group,
+            (unsigned long long)entry->groupLength, (unsigned long long)entry->offset,
+            (unsigned long long)entry->size, file->mtime, file->path);
+    return 1;
+}
+
+static int readInlineFiles(keep_ctx* ctx, FILE* plan, inlineConsumer consume, void* arg) {
+    TRACE_SCOPE("readInlineFiles");
+
+    // The plan, which is closed, is sorted by pack, group and offset, so
+    // each group is read and decoded once and its files come in order.
+    FILE* sorted = sortLines(ctx, plan, compareLines);
+    if (sorted == NULL) {
+        return -1;
+    }
+
+    struct groupBuffer buffer = {NULL, 0, 0};
+    char packPath[MAX_FILE_PATH_LENGTH] = "";
+    int packFd = -1;
+    unsigned long long group = ULLONG_MAX;
+    int result = 0;
+    char line[MANIFEST_LINE_LENGTH + MAX_FILE_PATH_LENGTH];
+    struct versionFile file;
+    file.hash[0] = '\0';
+    while (result == 0 && fgets(line, sizeof(line), sorted) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        char linePack[MAX_FILE_PATH_LENGTH];
+        unsigned long long fields[4];
+        int pathOffset = 0;
+        if (sscanf(line, "%255s %llx %llx %llx %llx %ld %n", linePack, &fields[0], &fields[1], &fields[2],
+                   &fields[3], &file.mtime, &pathOffset) != 6 || pathOffset == 0) {
+            continue;
+        }
+
+        if (strcmp(linePack, packPath) != 0) {
+            if (packFd >= 0) {
+                close(packFd);
+            }
+            snprintf(packPath, sizeof(packPath), "%s", linePack);
+            packFd = openat(ctx->rootFd, packPath, O_RDONLY | O_CLOEXEC);
+            group = ULLONG_MAX;
+        }
+        if (packFd < 0) {
+            result = setError(ctx, -1, "Failed to open pack '%s'", packPath);
+            break;
+        }
+        if (fields[0] != group) {
+            struct packEntry entry;
+            memset(&entry, 0, sizeof(entry));
+            entry.group = fields[0];
+            entry.groupLength = fields[1];
+            buffer.length = 0;
+            if (decodePackGroup(ctx, packFd, &entry, consumeGroup, &buffer) != 0) {
+                result = setError(ctx, -1, "Failed to read pack '%s'", packPath);
+                break;
+            }
+            group = fields[0];
+        }
+        if (fields[2] + fields[3] > buffer.length) {
+            result = setError(ctx, -1, "Pack '%s' is corrupt", packPath);
+            break;
+        }
+        snprintf(file.path, sizeof(file.path), "%s", line + pathOffset);
+        file.size = fields[3];
+        result = consume(ctx, &file, buffer.data + fields[2], arg);
+    }
+    if (result == 0 && ferror(sorted)) {
+        result = setError(ctx, -1, "Failed to read a temporary file");
+    }
+
+    if (packFd >= 0) {
+        close(packFd);
+    }
+    fclose(sorted);
+    free(buffer.data);
+    return result;
+}
+
+static int consumeGroup(const unsigned char* data, size_t length, uint64_t position, void* arg) {
+    struct groupBuffer* buffer = arg;
+    if (position + length > buffer->capacity) {
+        size_t capacity = buffer->capacity * 2 > position + length ? buffer->capacity * 2 : position + length;
+        unsigned char* grown = realloc(buffer->data, capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + position, data, length);
+    buffer->length = position + length;
+    return 0;
+}
+
+static int restoreInlineFile(keep_ctx* ctx, const struct versionFile* file, const unsigned char* data, void* arg) {
+    // Writes a file below the directory arg.
+    char target[MAX_FILE_PATH_LENGTH];
+    snprintf(target, sizeof(target), "%s/%s", (const char*)arg, file->path);
+    if (makeParentDirs(ctx, target) != 0) {
+        return -1;
+    }
+
+    int fd = openat(ctx->rootFd, target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return setError(ctx, -1, "Failed to create target file '%s'", target);
+    }
+    long long started = throttleBegin(ctx, file->size, 1);
+    int written = writeFully(fd, data, file->size);
+    throttleEnd(ctx, started, 1);
+    if (close(fd) != 0 || written != 0) {
+        return setError(ctx, -1, "Failed to write target file '%s'", target);
+    }
+    TRACE_COUNT(TRACE_SYSCALLS, 3);
+    TRACE_COUNT(TRACE_BYTES, file->size);
+    TRACE_COUNT(TRACE_FILES, 1);
+    return 0;
+}
+
+static int exportInlineFile(keep_ctx* ctx, const struct versionFile* file, const unsigned char* data, void* arg) {
+    // Appends a tar entry to the file descriptor arg points to.
+    int fd = *(const int*)arg;
+    char padding[TAR_BLOCK_SIZE] = {0};
+    if (writeTarHeader(ctx, fd, file->path, file->size, TAR_FILE_MODE, file->mtime) != 0 ||
+        writeFully(fd, data, file->size) != 0 ||
+        writeFully(fd, padding, (TAR_BLOCK_SIZE - file->size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE) != 0) {
+        return setError(ctx, -1, "Failed to export '%s'", file->path);
+    }
+    TRACE_COUNT(TRACE_BYTES, file->size);
+    TRACE_COUNT(TRACE_FILES, 1);
+    return 0;
+}
+
+static int scrubPacks(struct fsckRun* run) {
+    TRACE_SCOPE("scrubPacks");
+
+    // Each group is decoded once and every object in it rehashed on the
+    // way, which also checks the xz integrity checks.
+    keep_ctx* ctx = run->ctx;
+    if (loadPacks(ctx) != 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < ctx->numPacks; i++) {
+        const struct pack* pack = &ctx->packs[i];
+        const struct packEntry** entries = malloc((pack->count + 1) * sizeof(*entries));
+        if (entries == NULL) {
+            return setError(ctx, -1, "Out of memory");
+        }
+        for (uint64_t j = 0; j < pack->count; j++) {
+            entries[j] = &pack->entries[j];
+        }
+        qsort(entries, pack->count, sizeof(*entries), compareScrubEntries);
+
+        int fd = openat(ctx->rootFd, pack->path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fsckProblem(run, "Pack %s cannot be read", pack->path);
+            free(entries);
+            continue;
+        }
+
+        for (uint64_t first = 0; first < pack->count;) {
+            uint64_t last = first;
+            while (last < pack->count && entries[last]->group == entries[first]->group) {
+                last++;
+            }
+
+            struct sha256 sha;
+            sha256Init(&sha);
+            struct packScrub scrub = {run, pack, entries + first, (int)(last - first), 0, &sha};
+            if (decodePackGroup(ctx, fd, entries[first], consumeScrub, &scrub) != 0) {
+                consumeScrub(NULL, 0, UINT64_MAX, &scrub);
+                fsckProblem(run, "Pack %s is corrupt at offset %llu", pack->path,
+                            (unsigned long long)entries[first]->group);
+            } else {
+                consumeScrub(NULL, 0, entries[last - 1]->offset + entries[last - 1]->size, &scrub);
+            }
+            first = last;
+        }
+        close(fd);
+        free(entries);
+    }
+    return 0;
+}
+
+static int compareScrubEntries(const void* a, const void* b) {
+    const struct packEntry* x = *(const struct packEntry* const*)a;
+    const struct packEntry* y = *(const struct packEntry* const*)b;
+    if (x->group != y->group) {
+        return x->group < y->group ? -1 : 1;
+    }
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static int consumeScrub(const unsigned char* data, size_t length, uint64_t position, void* arg) {
+    // Hashes the objects of a group in order and reports each one whose
+    // content does not match its name. Called once more without data when
+    // decoding stops: at the end of the group to finish objects the data
+    // fell short of, or at UINT64_MAX to report all that are left.
+    struct packScrub* scrub = arg;
+    uint64_t end = data != NULL ? position + length : position;
+    while (scrub->next < scrub->count) {
+        const struct packEntry* entry = scrub->entries[scrub->next];
+        uint64_t objectEnd = entry->offset + entry->size;
+        uint64_t from = position > entry->offset ? position : entry->offset;
+        uint64_t to = end < objectEnd ? end : objectEnd;
+        if (data != NULL && from < to) {
+            sha256Update(scrub->sha, data + (from - position), to - from);
+        }
+        if (data != NULL && end < objectEnd) {
+            break;
+        }
+
+        char expected[HASH_HEX_LENGTH + 1];
+        char actual[HASH_HEX_LENGTH + 1];
+        formatObjectHash(entry->hash, expected);
+        sha256Final(scrub->sha, actual);
+        if (position == UINT64_MAX || strcmp(expected, actual) != 0) {
+            fsckProblem(scrub->run, "Object %s in pack %s is corrupt", expected, scrub->pack->path);
+        }
+        scrub->run->result->objects++;
+        scrub->run->result->bytes += entry->size;
+        sha256Init(scrub->sha);
+        scrub->next++;
+    }
+    return 0;
+}
+
+static void formatObjectHash(const unsigned char* hash, char* hex) {
+    for (int i = 0; i < OBJECT_HASH_SIZE; i++) {
+        sprintf(hex + i * 2, "%02x", hash[i]);
+    }
+}
+
+static void recordVersionAccess(keep_ctx* ctx, int version) {
+    // keep tier keeps recently restored versions hot. Only the time
+    // .keep/access/N was last touched matters.
+    char path[MAX_FILE_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/%d", ACCESS_DIR, version);
+    if (makeParentDirs(ctx, path) != 0) {
+        return;
+    }
+    int fd = openat(ctx->rootFd, path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        futimens(fd, NULL);
+        close(fd);
+    }
+}
+
+static int watchTrackedFiles(keep_ctx* ctx, struct autoState* state) {
+    // Watches every directory that holds a tracked file, and .keep for a
+    // new tracking-files. A directory that is already watched keeps its
+    // watch; ones that no longer hold tracked files only cost spurious
+    // events. When the kernel runs out of watches, keep_auto falls back to
+    // storing every interval.
+    if (loadTrackedFiles(ctx) != KEEP_OK) {
+        return -1;
+    }
+
+    int numPaths = ctx->numTrackedFiles;
+    char (*paths)[MAX_FILE_PATH_LENGTH] = malloc((numPaths + 1) * sizeof(*paths));
+    char* changed = calloc(numPaths + 1, 1);
+    if (paths == NULL || changed == NULL) {
+        free(paths);
+        free(changed);
+        return setError(ctx, -1, "Out of memory");
+    }
+    for (int i = 0; i < numPaths; i++) {
+        memcpy(paths[i], ctx->trackedFiles[i].path, sizeof(paths[i]));
+    }
+    qsort(paths, numPaths, sizeof(*paths), comparePaths);
+
+    // Flags of paths that are still tracked carry over.
+    for (int i = 0; i < state->numPaths; i++) {
+        char (*found)[MAX_FILE_PATH_LENGTH] = bsearch(state->paths[i], paths, numPaths, sizeof(*paths), comparePaths);
+        if (found != NULL && state->changed[i]) {
+            changed[found - paths] = 1;
+        }
+    }
+    free(state->paths);
+    free(state->changed);
+    state->paths = paths;
+    state->changed = changed;
+    state->numPaths = numPaths;
+
+    for (int i = -1; i < numPaths && !state->polling; i++) {
+        char dir[MAX_FILE_PATH_LENGTH];
+        snprintf(dir, sizeof(dir), "%s", i < 0 ? ".keep" : paths[i]);
+        char* slash = strrchr(dir, '/');
+        if (i >= 0 && slash == NULL) {
+            snprintf(dir, sizeof(dir), ".");
+        } else if (i >= 0) {
+            *slash = '\0';
+        }
+        if (state->numWatches > 0 && strcmp(state->watches[state->numWatches - 1].dir, dir) == 0) {
+            continue;
+        }
+
+        // inotify takes a path, and the repository need not be the
+        // working directory.
+        char watchPath[MAX_FILE_PATH_LENGTH + 32];
+        snprintf(watchPath, sizeof(watchPath), "/proc/self/fd/%d/%s", ctx->rootFd, dir);
+        uint32_t mask = i < 0 ? IN_MOVED_TO
+                              : IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                    IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+        int wd = inotify_add_watch(state->fd, watchPath, mask);
+        if (wd < 0 && errno == ENOENT) {
+            continue;
+        }
+        if (wd < 0) {
+            state->polling = 1;
+            break;
+        }
+
+        int known = 0;
+        for (int j = 0; j < state->numWatches && !known; j++) {
+            known = state->watches[j].wd == wd;
+        }
+        if (known) {
+            continue;
+        }
+        void* grown = growArray(state->watches, &state->watchesCapacity, state->numWatches, sizeof(struct autoWatch));
+        if (grown == NULL) {
+            return setError(ctx, -1, "Out of memory");
+        }
+        state->watches = grown;
+        state->watches[state->numWatches].wd = wd;
+        snprintf(state->watches[state->numWatches++].dir, MAX_FILE_PATH_LENGTH, "%s", dir);
+    }
+    return 0;
+}
+
+static int readAutoEvents(struct autoState* state, int* rewatch) {
+    // Returns how many events concern tracked files, setting *rewatch when
+    // the tracking list changed or a watched directory went away. Lost
+    // events count as a change to something.
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changes = 0;
+    for (;;) {
+        ssize_t n = read(state->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+
+        for (char* p = buf; p < buf + n;) {
+            const struct inotify_event* event = (const struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                changes++;
+                continue;
+            }
+            if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                *rewatch = 1;
+                continue;
+            }
+
+            const struct autoWatch* watch = NULL;
+            for (int i = 0; i < state->numWatches && watch == NULL; i++) {
+                if (state->watches[i].wd == event->wd) {
+                    watch = &state->watches[i];
+                }
+            }
+            if (watch == NULL || event->len == 0) {
+                continue;
+            }
+            if (strcmp(watch->dir, ".keep") == 0) {
+                *rewatch |= strcmp(event->name, "tracking-files") == 0;
+                continue;
+            }
+
+            char path[MAX_FILE_PATH_LENGTH];
+            if (strcmp(watch->dir, ".") == 0) {
+                snprintf(path, sizeof(path), "%s", event->name);
+            } else {
+                snprintf(path, sizeof(path), "%s/%s", watch->dir, event->name);
+            }
+            char (*found)[MAX_FILE_PATH_LENGTH] = bsearch(path, state->paths, state->numPaths, sizeof(*state->paths),
+                                                          comparePaths);
+            if (found != NULL) {
+                state->changed[found - state->paths] = 1;
+                changes++;
+            }
+        }
+    }
+    return changes;
+}
+
+static void autoNote(const struct autoState* state, char* note, size_t size) {
+    // "Automatic snapshot: a, b, c and 4 more files", from the paths that
+    // changed since the last store.
+    int numChanged = 0;
+    size_t length = snprintf(note, size, "Automatic snapshot");
+    for (int i = 0; i < state->numPaths; i++) {
+        if (!state->changed[i]) {
+            continue;
+        }
+        if (numChanged < AUTO_NOTE_PATHS && length < size) {
+            length += snprintf(note + length, size - length, "%s%s", numChanged == 0 ? ": " : ", ", state->paths[i]);
+        }
+        numChanged++;
+    }
+    if (numChanged > AUTO_NOTE_PATHS && length < size) {
+        snprintf(note + length, size - length, " and %d more files", numChanged - AUTO_NOTE_PATHS);
+    }
+}
+
+static int comparePaths(const void* a, const void* b) {
+    return strcmp(a, b);
+}
+
+static int nextBisectVersion(int good, int bad, const char* skipped, int first) {
+    // The untested version closest to the middle of (good, bad), or 0 once
+    // there is none left. Versions that could not be tested are skipped.
+    int middle = good + (bad - good) / 2;
+    for (int distance = 0; middle - distance > good || middle + distance < bad; distance++) {
+        int below = middle - distance;
+        int above = middle + distance;
+        if (below > good && !skipped[below - first]) {
+            return below;
+        }
+        if (above > good && above < bad && !skipped[above - first]) {
+            return above;
+        }
+    }
+    return 0;
+}
+
+static int checkoutBisectVersion(keep_ctx* ctx, int* current, int version) {
+    TRACE_SCOPE("checkoutBisectVersion");
+
+    if (*current == version) {
+        return 0;
+    }
+
+    // The version file is removed while the worktree is in between two
+    // versions, so an interrupted checkout starts over from scratch.
+    if (unlinkat(ctx->rootFd, BISECT_VERSION_PATH, 0) != 0 && errno != ENOENT) {
+        return setError(ctx, -1, "Failed to remove bisect version file");
+    }
+
+    int result;
+    if (*current > 0) {
+        result = applyVersionDelta(ctx, *current, version, BISECT_WORKTREE);
+    } else if (removeTree(ctx, BISECT_WORKTREE) != 0 || mkdirat(ctx->rootFd, BISECT_WORKTREE, 0700) != 0) {
+        result = setError(ctx, -1, "Failed to create directory '%s'", BISECT_WORKTREE);
+    } else {
+        result = restoreFilesToDir(ctx, version, BISECT_WORKTREE);
+    }
+    *current = 0;
+    if (result != 0) {
+        return -1;
+    }
+
+    FILE* versionFile = repoOpen(ctx, BISECT_VERSION_PATH, "w");
+    if (versionFile == NULL) {
+        return setError(ctx, -1, "Failed to open bisect version file");
+    }
+    fprintf(versionFile, "%d", version);
+    if (fclose(versionFile) != 0) {
+        return setError(ctx, -1, "Failed to write bisect version file");
+    }
+
+    *current = version;
+    recordVersionAccess(ctx, version);
+    return 0;
+}
+
+static int applyVersionDelta(keep_ctx* ctx, int from, int to, const char* dir) {
+    // Turns dir from a copy of one version into a copy of another by writing
+    // only the files whose content differs and removing those that are gone.
+    // Anything else in dir, such as build output, is left alone. Both lists
+    // are streamed in path order twice: removals go first, so that a path
+    // can turn from a file into a directory.
+    struct manifestStream oldStream;
+    struct manifestStream newStream;
+    if (openManifestStream(ctx, from, 1, &oldStream) != 0) {
+        return -1;
+    }
+    if (openManifestStream(ctx, to, 1, &newStream) != 0) {
+        closeManifestStream(&oldStream);
+        return -1;
+    }
+
+    int result = 0;
+    int numWrites = 0;
+    long long bytes = 0;
+    size_t dirLength = strlen(dir);
+    FILE* inlinePlan = NULL;
+    for (int pass = 0; pass < 2 && result == 0; pass++) {
+        rewind(oldStream.file);
+        rewind(newStream.file);
+        int haveOld = nextManifestEntry(ctx, &oldStream);
+        int haveNew = nextManifestEntry(ctx, &newStream);
+        while (result == 0 && haveOld >= 0 && haveNew >= 0 && (haveOld > 0 || haveNew > 0)) {
+            const struct versionFile* oldFile = &oldStream.entry;
+            const struct versionFile* newFile = &newStream.entry;
+            int order = haveOld == 0 ? 1 : haveNew == 0 ? -1 : strcmp(oldFile->path, newFile->path);
+
+            // Files of versions stored before the object store have no hash
+            // to compare and are always written.
+            char target[MAX_FILE_PATH_LENGTH];
+            if (pass == 0 && order < 0) {
+                snprintf(target, sizeof(target), "%s/%s", dir, oldFile->path);
+                if (unlinkat(ctx->rootFd, target, 0) != 0 && errno != ENOENT) {
+                    result = setError(ctx, -1, "Failed to remove file '%s'", target);
+                }
+                for (char* slash = strrchr(target, '/'); slash > target + dirLength; slash = strrchr(target, '/')) {
+                    *slash = '\0';
+                    if (unlinkat(ctx->rootFd, target, AT_REMOVEDIR) != 0) {
+                        break;
+                    }
+                }
+            } else if (pass == 1 && (order > 0 || (order == 0 && (newFile->hash[0] == '\0' ||
+                                                                  strcmp(oldFile->hash, newFile->hash) != 0)))) {
+                char source[MAX_FILE_PATH_LENGTH];
+                int deferred = planFileSource(ctx, to, newFile, &inlinePlan, source, sizeof(source));
+                snprintf(target, sizeof(target), "%s/%s", dir, newFile->path);
+                if (deferred != 0) {
+                    result = deferred < 0 ? -1 : 0;
+                } else {
+                    result = makeParentDirs(ctx, target) != 0 ? -1 : cloneFileToTarget(ctx, source, target);
+                }
+                bytes += newFile->size;
+                numWrites++;
+            }
+
+            if (order <= 0) {
+                haveOld = nextManifestEntry(ctx, &oldStream);
+            }
+            if (order >= 0) {
+                haveNew = nextManifestEntry(ctx, &newStream);
+            }
+        }
+        if (haveOld < 0 || haveNew < 0) {
+            result = -1;
+        }
+    }
+    if (result == 0 && inlinePlan != NULL) {
+        result = readInlineFiles(ctx, inlinePlan, restoreInlineFile, (void*)dir);
+    } else if (inlinePlan != NULL) {
+        fclose(inlinePlan);
+    }
+
+    if (result == 0) {
+        ctx->metrics.counters[METRIC_RESTORE_FILES] += numWrites;
+        ctx->metrics.counters[METRIC_RESTORE_BYTES] += bytes;
+    }
+    closeManifestStream(&oldStream);
+    closeManifestStream(&newStream);
+    return result;
+}
+
+static int runBisectCommand(keep_ctx* ctx, const char* command, int version, enum keep_bisect_verdict* verdict) {
+    TRACE_SCOPE("runBisectCommand");
+
+    int dirFd = openat(ctx->rootFd, BISECT_WORKTREE, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0) {
+        return setError(ctx, -1, "Failed to open directory '%s'", BISECT_WORKTREE);
+    }
+
+    char versionText[16];
+    snprintf(versionText, sizeof(versionText), "%d", version);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (fchdir(dirFd) == 0 && setenv("KEEP_BISECT_VERSION", versionText, 1) == 0) {
+            execl("/bin/sh", "sh", "-c", command, (char*)NULL);
+        }
+        _exit(127);
+    }
+    close(dirFd);
+    if (pid < 0) {
+        return setError(ctx, -1, "Failed to run '%s'", command);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return setError(ctx, -1, "Failed to wait for '%s'", command);
+        }
+    }
+
+    // As with git bisect run, 0 means good, 125 untestable and any other
+    // status up to 127 bad. A command that could not be found or executed,
+    // or that was killed, ends the bisect instead of blaming a version.
+    if (WIFSIGNALED(status)) {
+        return setError(ctx, -1, "'%s' was killed by signal %d on version %d", command, WTERMSIG(status), version);
+    }
+    int code = WEXITSTATUS(status);
+    if (code >= 126) {
+        return setError(ctx, -1, "'%s' failed with status %d on version %d", command, code, version);
+    }
+    *verdict = code == 0 ? KEEP_BISECT_GOOD : code == 125 ? KEEP_BISECT_SKIP : KEEP_BISECT_BAD;
+    return 0;
+}
+
+static int useLayoutOrder(keep_ctx* ctx) {
+    if (ctx->readOrder != KEEP_ORDER_AUTO) {
+        return ctx->readOrder == KEEP_ORDER_PHYSICAL;
+    }
+    if (ctx->rotational != 0) {
+        return ctx->rotational > 0;
+    }
+
+    // The device of a partition has no queue of its own; its disk does.
+    // Filesystems without a single block device, such as btrfs or NFS,
+    // count as not rotational.
+    ctx->rotational = -1;
+    struct stat keepStat;
+    if (fstatat(ctx->rootFd, ".keep", &keepStat, 0) != 0) {
+        return 0;
+    }
+    static const char* const formats[] = {"/sys/dev/block/%u:%u/queue/rotational",
+                                          "/sys/dev/block/%u:%u/../queue/rotational"};
+    for (int i = 0; i < 2; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), formats[i], major(keepStat.st_dev), minor(keepStat.st_dev));
+        FILE* file = fopen(path, "re");
+        if (file != NULL) {
+            int flag = fgetc(file);
+            fclose(file);
+            ctx->rotational = flag == '1' ? 1 : -1;
+            break;
+        }
+    }
+    return ctx->rotational > 0;
+}
+
+static void planLayoutOrder(keep_ctx* ctx, struct manifestStream* stream) {
+    // Replaces the stream with a plan of the same files in the order their
+    // content lies on disk: every entry behind its layout key and its place
+    // in the list, sorted. Best effort; when planning fails the stream is
+    // left in manifest order.
+    TRACE_SCOPE("planLayoutOrder");
+    if (stream->file == NULL || !useLayoutOrder(ctx)) {
+        return;
+    }
+    loadPacks(ctx);
+
+    int numPackFds = ctx->numPacks;
+    int* packFds = malloc((numPackFds + 1) * sizeof(int));
+    FILE* plan = packFds != NULL ? createSortFile(ctx) : NULL;
+    if (plan == NULL) {
+        free(packFds);
+        return;
+    }
+    for (int i = 0; i < numPackFds; i++) {
+        packFds[i] = -1;
+    }
+
+    int index = 0;
+    for (int status; (status = nextManifestEntry(ctx, stream)) > 0; index++) {
+        const struct versionFile* file = &stream->entry;
+        fprintf(plan, "%016llx %010d ", layoutKeyOf(ctx, stream->version, file, packFds, numPackFds), index);
+        if (stream->hasManifest) {
+            fprintf(plan, "%s %lld %ld %s\n", file->hash, file->size, file->mtime, file->path);
+        } else {
+            fprintf(plan, "%s %ld\n", file->path, file->mtime);
+        }
+    }
+    rewind(stream->file);
+
+    for (int i = 0; i < numPackFds; i++) {
+        if (packFds[i] >= 0) {
+            close(packFds[i]);
+        }
+    }
+    free(packFds);
+
+    FILE* sorted = ferror(plan) ? NULL : sortLines(ctx, plan, compareLines);
+    if (sorted == NULL) {
+        return;
+    }
+    fclose(stream->file);
+    stream->file = sorted;
+    stream->keyed = 1;
+}
+
+static unsigned long long layoutKeyOf(keep_ctx* ctx, int version, const struct versionFile* file, int* packFds,
+                                      int numPackFds) {
+    // Loose objects and legacy copies sort by the physical address of their
+    // first extent, packed objects by that of their group. packFds caches
+    // open packs by index in ctx->packs.
+    char path[MAX_FILE_PATH_LENGTH];
+    const struct pack* pack;
+    const struct packEntry* entry;
+    unsigned long long physical = ULLONG_MAX;
+    if (file->hash[0] == '\0' || findObject(ctx, file->hash, path, sizeof(path)) == 0) {
+        if (file->hash[0] == '\0') {
+            snprintf(path, sizeof(path), ".keep/%d/target/%s", version, file->path);
+        }
+        int fd = openat(ctx->rootFd, path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            physical = physicalOffset(fd, 0);
+            close(fd);
+        }
+    } else if (findPackedObject(ctx, file->hash, &pack, &entry) == 0 && pack - ctx->packs < numPackFds) {
+        int* packFd = &packFds[pack - ctx->packs];
+        if (*packFd < 0) {
+            *packFd = openat(ctx->rootFd, pack->path, O_RDONLY | O_CLOEXEC);
+        }
+        if (*packFd >= 0) {
+            physical = physicalOffset(*packFd, entry->group);
+        }
+    }
+    return physical;
+}
+
+static unsigned long long physicalOffset(int fd, off_t offset) {
+    // Where on the device the byte at offset lies. Holes, inline data and
+    // filesystems without FIEMAP sort last.
+    union {
+        struct fiemap map;
+        char bytes[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.map.fm_start = offset;
+    request.map.fm_length = 1;
+    request.map.fm_extent_count = 1;
+    TRACE_COUNT(TRACE_SYSCALLS, 1);
+    if (ioctl(fd, FS_IOC_FIEMAP, &request.map) != 0 || request.map.fm_mapped_extents == 0) {
+        return ULLONG_MAX;
+    }
+
+    const struct fiemap_extent* extent = &request.map.fm_extents[0];
+    if (extent->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE) ||
+        (unsigned long long)offset < extent->fe_logical) {
+        return ULLONG_MAX;
+    }
+    return extent->fe_physical + (offset - extent->fe_logical);
+}
+
+static int compareLayoutKeys(const void* a, const void* b) {
+    const struct layoutKey* x = a;
+    const struct layoutKey* y = b;
+    if (x->physical != y->physical) {
+        return x->physical < y->physical ? -1 : 1;
+    }
+    return x->index - y->index;
+}
+
+static int loadVersionFiles(keep_ctx* ctx, int version, struct versionFile** files, int* count) {
+    // .keep/N/manifest lists "hash size mtime path" per file. Older versions
+    // only have .keep/N/tracking-files with "path mtime".
+    char listPath[MAX_FILE_PATH_LENGTH];
+    snprintf(listPath, sizeof(listPath), ".keep/%d/manifest", version);
+
+    int hasManifest = 1;
+    FILE* listFile = repoOpen(ctx, listPath, "r");
+    if (listFile == NULL) {
+        hasManifest = 0;
+        snprintf(listPath, sizeof(listPath), ".keep/%d/tracking-files", version);
+        listFile = repoOpen(ctx, listPath, "r");
+    }
+    if (listFile == NULL) {
+        return setError(ctx, -1, "Failed to open the file list of version %d", version);
+    }
+
+    int capacity = 64;
+    int numFiles = 0;
+    struct versionFile* list = malloc(capacity * sizeof(struct versionFile));
+
+    char line[MAX_FILE_PATH_LENGTH + 128];
+    while (list != NULL && fgets(line, sizeof(line), listFile) != NULL) {
+        if (numFiles == capacity) {
+            capacity *= 2;
+            struct versionFile* grown = realloc(list, capacity * sizeof(struct versionFile));
+            if (grown == NULL) {
+                free(list);
+                list = NULL;
+                break;
+            }
+            list = grown;
+        }
+
+        struct versionFile* file = &list[numFiles];
+        memset(file, 0, sizeof(*file));
+        if (hasManifest) {
+            if (parseManifestLine(line, file) != 0) {
+                continue;
+            }
+        } else {
+            char* filePath;
+            if (parseTrackingLine(line, &filePath, &file->mtime) != 0) {
+                continue;
+            }
+            snprintf(file->path, sizeof(file->path), "%s", filePath);
+        }
+        numFiles++;
+    }
+    fclose(listFile);
+
+    if (list == NULL) {
+        return setError(ctx, -1, "Out of memory");
+    }
+
+    *files = list;
+    *count = numFiles;
+    return 0;
+}
+
+static int parseManifestLine(char* line, struct versionFile* file) {
+    line[strcspn(line, "\n")] = '\0';
+
+    int pathOffset = 0;
+    if (sscanf(line, "%64s %lld %ld %n", file->hash, &file->size, &file->mtime, &pathOffset) != 3 ||
+        pathOffset == 0 || line[pathOffset] == '\0' || strlen(file->hash) != HASH_HEX_LENGTH) {
+        return -1;
+    }
+
+    snprintf(file->path, sizeof(file->path), "%s", line + pathOffset);
+    return 0;
+}
+
+static int openManifestStream(keep_ctx* ctx, int version, int sorted, struct manifestStream* stream) {
+    // Opens the file list of a version, see loadVersionFiles. With sorted,
+    // lists not in path order, from versions stored before manifests were
+    // written sorted, are sorted into a temporary file on the way.
+    memset(stream, 0, sizeof(*stream));
+    stream->version = version;
+    stream->hasManifest = 1;
+
+    char listPath[MAX_FILE_PATH_LENGTH];
+    snprintf(listPath, sizeof(listPath), ".keep/%d/manifest", version);
+    stream->file = repoOpen(ctx, listPath, "r");
+    if (stream->file == NULL) {
+        stream->hasManifest = 0;
+        snprintf(listPath, sizeof(listPath), ".keep/%d/tracking-files", version);
+        stream->file = repoOpen(ctx, listPath, "r");
+    }
+    if (stream->file == NULL) {
+        return setError(ctx, -1, "Failed to open the file list of version %d", version);
+    }
+
+    lineCompare compare = stream->hasManifest ? compareManifestLines : compareTrackingLines;
+    if (sorted && !isSortedFile(stream->file, compare)) {
+        stream->file = sortLines(ctx, stream->file, compare);
+        if (stream->file == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int nextManifestEntry(keep_ctx* ctx, struct manifestStream* stream) {
+    // 1 with the next file in stream->entry, 0 at the end of the list and -1
+    // on errors. Lines that do not parse are skipped, as by loadVersionFiles.
+    if (stream->file == NULL) {
+        return 0;
+    }
+
+    char line[MANIFEST_LINE_LENGTH];
+    while (fgets(line, sizeof(line), stream->file) != NULL) {
+        char* text = line;
+        if (stream->keyed) {
+            if (strlen(line) <= LAYOUT_KEY_LENGTH) {
+                continue;
+            }
+            text += LAYOUT_KEY_LENGTH;
+        }
+
+        struct versionFile* file = &stream->entry;
+        memset(file, 0, sizeof(*file));
+        if (stream->hasManifest) {
+            if (parseManifestLine(text, file) != 0) {
+                continue;
+            }
+            return 1;
+        }
+
+        char* filePath;
+        if (parseTrackingLine(text, &filePath, &file->mtime) != 0) {
+            continue;
+        }
+        snprintf(file->path, sizeof(file->path), "%s", filePath);
+        if (stream->hashLegacy) {
+            char source[MAX_FILE_PATH_LENGTH];
+            versionFileSource(ctx, stream->version, file, source, sizeof(source));
+            if (hashFile(ctx, source, file->hash, &file->size) != 0) {
+                return -1;
+            }
+        }
+        return 1;
+    }
+
+    if (ferror(stream->file)) {
+        return setError(ctx, -1, "Failed to read the file list of version %d", stream->version);
+    }
+    return 0;
+}
+
+static void closeManifestStream(struct manifestStream* stream) {
+    if (stream->file != NULL) {
+        fclose(stream->file);
+        stream->file = NULL;
+    }
+}
+
+static int appendVersionFile(keep_ctx* ctx, struct versionFile** files, int* count, int* capacity,
+                             const struct versionFile* file) {
+    struct versionFile* grown = growArray(*files, capacity, *count, sizeof(struct versionFile));
+    if (grown == NULL) {
+        return setError(ctx, KEEP_ERR_NO_MEMORY, "Out of memory");
+    }
+    *files = grown;
+    (*files)[(*count)++] = *file;
+    return 0;
+}
+
+static FILE* sortLines(keep_ctx* ctx, FILE* input, lineCompare compare) {
+    // Sorts the lines of input, which it closes, into an unlinked temporary
+    // file and returns that rewound, or NULL. Lines are sorted in runs as
+    // large as the memory limit allows; more than one run are merged, so
+    // memory use stays the same however long input is.
+    TRACE_SCOPE("sortLines");
+    size_t limit = ctx->memoryLimit > 0 ? (size_t)ctx->memoryLimit : SORT_DEFAULT_MEMORY;
+    char* buffer = malloc(limit);
+    FILE** runs = NULL;
+    int numRuns = 0;
+    int runsCapacity = 0;
+    int failed = buffer == NULL ? setError(ctx, -1, "Out of memory") : 0;
+
+    // Line text grows from the front of buffer, pointers to the lines from
+    // its back. A line that does not fit any more starts the next run.
+    char** top = (char**)buffer + limit / sizeof(char*);
+    char line[MANIFEST_LINE_LENGTH];
+    int haveLine = 0;
+    rewind(input);
+    while (!failed) {
+        size_t used = 0;
+        size_t numLines = 0;
+        while (haveLine || fgets(line, sizeof(line), input) != NULL) {
+            size_t length = strlen(line) + 1;
+            haveLine = used + length > (size_t)((char*)(top - numLines - 1) - buffer);
+            if (haveLine) {
+                break;
+            }
+            memcpy(buffer + used, line, length);
+            *(top - ++numLines) = buffer + used;
+            used += length;
+        }
+        if (ferror(input)) {
+            failed = setError(ctx, -1, "Failed to read the lines to sort");
+            break;
+        }
+
+        qsort_r(top - numLines, numLines, sizeof(char*), compareLinePointers, &compare);
+        FILE* run = createSortFile(ctx);
+        FILE** grown = run != NULL ? growArray(runs, &runsCapacity, numRuns, sizeof(FILE*)) : NULL;
+        if (grown == NULL) {
+            if (run != NULL) {
+                fclose(run);
+                setError(ctx, -1, "Out of memory");
+            }
+            failed = -1;
+            break;
+        }
+        runs = grown;
+        runs[numRuns++] = run;
+        for (size_t i = 0; i < numLines; i++) {
+            fputs(top[-(ptrdiff_t)numLines + (ptrdiff_t)i], run);
+        }
+        if (fflush(run) != 0) {
+            failed = setError(ctx, -1, "Failed to write a temporary file");
+        }
+        if (!haveLine) {
+            break;
+        }
+    }
+    fclose(input);
+    free(buffer);
+
+    FILE* sorted = NULL;
+    if (failed) {
+        for (int i = 0; i < numRuns; i++) {
+            fclose(runs[i]);
+        }
+    } else if (numRuns == 1) {
+        sorted = runs[0];
+        rewind(sorted);
+    } else {
+        sorted = mergeRuns(ctx, runs, numRuns, compare);
+    }
+    free(runs);
+    return sorted;
+}
+
+static FILE* mergeRuns(keep_ctx* ctx, FILE** runs, int count, lineCompare compare) {
+    // Merges sorted runs, which it closes, SORT_MAX_RUNS at a time through a
+    // heap of their current lines until one is left, and returns that
+    // rewound, or NULL.
+    char (*lines)[MANIFEST_LINE_LENGTH] = malloc(SORT_MAX_RUNS * sizeof(*lines));
+    int heap[SORT_MAX_RUNS];
+    int failed = lines == NULL ? setError(ctx, -1, "Out of memory") : 0;
+    int merged = 0;
+    int first = 0;
+    while (!failed && count > 1) {
+        merged = 0;
+        for (first = 0; first < count && !failed; first += SORT_MAX_RUNS) {
+            int group = count - first < SORT_MAX_RUNS ? count - first : SORT_MAX_RUNS;
+            if (group == 1) {
+                runs[merged++] = runs[first];
+                runs[first] = NULL;
+                continue;
+            }
+            FILE* output = createSortFile(ctx);
+            if (output == NULL) {
+                failed = -1;
+                break;
+            }
+
+            int size = 0;
+            for (int i = 0; i < group; i++) {
+                rewind(runs[first + i]);
+                if (fgets(lines[i], sizeof(lines[i]), runs[first + i]) != NULL) {
+                    heap[size++] = i;
+                }
+            }
+            for (int i = size / 2 - 1; i >= 0; i--) {
+                siftRuns(heap, size, i, lines, compare);
+            }
+            while (size > 0) {
+                int next = heap[0];
+                fputs(lines[next], output);
+                if (fgets(lines[next], sizeof(lines[next]), runs[first + next]) == NULL) {
+                    heap[0] = heap[--size];
+                }
+                siftRuns(heap, size, 0, lines, compare);
+            }
+
+            for (int i = 0; i < group; i++) {
+                if (ferror(runs[first + i])) {
+                    failed = setError(ctx, -1, "Failed to read a temporary file");
+                }
+                fclose(runs[first + i]);
+                runs[first + i] = NULL;
+            }
+            if (fflush(output) != 0) {
+                failed = setError(ctx, -1, "Failed to write a temporary file");
+            }
+            runs[merged++] = output;
+        }
+        if (!failed) {
+            count = merged;
+        }
+    }
+    free(lines);
+
+    if (failed) {
+        for (int i = 0; i < merged; i++) {
+            fclose(runs[i]);
+        }
+        for (int i = first; i < count; i++) {
+            if (runs[i] != NULL) {
+                fclose(runs[i]);
+            }
+        }
+        return NULL;
+    }
+    rewind(runs[0]);
+    return runs[0];
+}
+
+static void siftRuns(int* heap, int size, int index, char (*lines)[MANIFEST_LINE_LENGTH], lineCompare compare) {
+    // Moves heap[index] down until the line of every run in the heap sorts
+    // no later than those of the runs below it.
+    for (;;) {
+        int smallest = index;
+        for (int child = 2 * index + 1; child <= 2 * index + 2 && child < size; child++) {
+            if (compare(lines[heap[child]], lines[heap[smallest]]) < 0) {
+                smallest = child;
+            }
+        }
+        if (smallest == index) {
+            return;
+        }
+        int swap = heap[index];
+        heap[index] = heap[smallest];
+        heap[smallest] = swap;
+        index = smallest;
+    }
+}
+
+static FILE* createSortFile(keep_ctx* ctx) {
+    // Sort files live in .keep/sort, on the disk of what they sort, and are
+    // unlinked right away so that nothing is left behind by a crash.
+    char path[MAX_FILE_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/%d.%d", SORT_DIR, (int)getpid(), ctx->tempCounter++);
+    if (makeParentDirs(ctx, path) != 0) {
+        return NULL;
+    }
+
+    int fd = openat(ctx->rootFd, path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        setError(ctx, -1, "Failed to create temporary file '%s'", path);
+        return NULL;
+    }
+    unlinkat(ctx->rootFd, path, 0);
+
+    FILE* file = fdopen(fd, "w+");
+    if (file == NULL) {
+        close(fd);
+        setError(ctx, -1, "Out of memory");
+    }
+    return file;
+}
+
+static int isSortedFile(FILE* file, lineCompare compare) {
+    char lines[2][MANIFEST_LINE_LENGTH];
+    int count = 0;
+    int sorted = 1;
+    while (sorted && fgets(lines[count % 2], sizeof(lines[0]), file) != NULL) {
+        sorted = count == 0 || compare(lines[(count + 1) % 2], lines[count % 2]) <= 0;
+        count++;
+    }
+    rewind(file);
+    return sorted;
+}
+
+static int compareLinePointers(const void* a, const void* b, void* compare) {
+    return (*(lineCompare*)compare)(*(char* const*)a, *(char* const*)b);
+}
+
+static int compareManifestLines(const char* a, const char* b) {
+    // "hash size mtime path", by path
+    a = skipFields(a, 3);
+    b = skipFields(b, 3);
+    return comparePathSpans(a, strcspn(a, "\n"), b, strcspn(b, "\n"));
+}
+
+static const char* skipFields(const char* line, int count) {
+    for (int i = 0; i < count; i++) {
+        line += strcspn(line, " ");
+        if (*line == ' ') {
+            line++;
+        }
+    }
+    return line;
+}
+
+static int compareTrackingLines(const char* a, const char* b) {
+    // "path mtime", by path
+    const char* aEnd = strrchr(a, ' ');
+    const char* bEnd = strrchr(b, ' ');
+    return comparePathSpans(a, aEnd != NULL ? (size_t)(aEnd - a) : strcspn(a, "\n"), b,
+                            bEnd != NULL ? (size_t)(bEnd - b) : strcspn(b, "\n"));
+}
+
+static int comparePathSpans(const char* a, size_t aLength, const char* b, size_t bLength) {
+    // Orders paths as strcmp does, which merges of file lists rely on.
+    int order = memcmp(a, b, aLength < bLength ? aLength : bLength);
+    if (order != 0) {
+        return order;
+    }
+    return aLength < bLength ? -1 : aLength > bLength;
+}
+
+static int compareLines(const char* a, const char* b) {
+    return strcmp(a, b);
+}
+
+static int writeManifest(keep_ctx* ctx, const char* dir, struct versionFile* files, int count) {
+    // Manifests are written in path order, so that versions can be merged
+    // without sorting them first.
+    qsort(files, count, sizeof(struct versionFile), compareVersionFiles);
+
+    char manifestPath[MAX_FILE_PATH_LENGTH];
+    snprintf(manifestPath, sizeof(manifestPath), "%s/manifest", dir);
+
+    FILE* manifest = repoOpen(ctx, manifestPath, "w");
+    if (manifest == NULL) {
+        return setError(ctx, -1, "Failed to create manifest file");
+    }
+
+    for (int i = 0; i < count; i++) {
+        fprintf(manifest, "%s %lld %ld %s\n", files[i].hash, files[i].size, files[i].mtime, files[i].path);
+    }
+
+    if (fclose(manifest) != 0) {
+        return setError(ctx, -1, "Failed to write manifest file");
+    }
+    return 0;
+}
+
+static void versionFileSource(keep_ctx* ctx, int version, const struct versionFile* file, char* path, size_t size) {
+    // An object of a cold pack is unpacked into the object store on first
+    // use and stays there until keep tier finds it cold again. Objects of
+    // inline packs are not: see findInlineObject. Objects borrowed from an
+    // alternate that has since packed them are unpacked into this
+    // repository, whatever their pack.
+    const struct pack* pack;
+    const struct packEntry* entry;
+    if (file->hash[0] != '\0') {
+        if (findObject(ctx, file->hash, path, size) == 0) {
+            return;
+        }
+        int packed = findPackedObject(ctx, file->hash, &pack, &entry) == 0;
+        if ((packed ? !pack->isInline : findAlternatePackedObject(ctx, file->hash, &pack, &entry) == 0) &&
+            thawObject(ctx, file->hash) == 0) {
+            objectPath(file->hash, path, size);
+        }
+    } else {
+        snprintf(path, size, ".keep/%d/target/%s", version, file->path);
+    }
+}
+
+static int compareVersionFiles(const void* a, const void* b) {
+    return strcmp(((const struct versionFile*)a)->path, ((const struct versionFile*)b)->path);
+}
+
+static int removeNonTrackingFiles(keep_ctx* ctx) {
+    TRACE_SCOPE("removeNonTrackingFiles");
+
+    DIR* dir = repoOpenDir(ctx, ".");
+    if (dir == NULL) {
+        return setError(ctx, -1, "Failed to open current directory");
+    }
+
+    int result = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            strcmp(entry->d_name, ".keep") == 0) {
+            continue;
+        }
+
+        size_t nameLength = strlen(entry->d_name);
+        int found = 0;
+        for (int i = 0; i < ctx->numTrackedFiles && !found; i++) {
+            const char* trackedPath = ctx->trackedFiles[i].path;
+            found = strncmp(trackedPath, entry->d_name, nameLength) == 0 &&
+                    (trackedPath[nameLength] == '\0' || trackedPath[nameLength] == '/');
+        }
+
+        // Like remove(), only empty directories are deleted.
+        if (!found) {
+            int flags = entry->d_type == DT_DIR ? AT_REMOVEDIR : 0;
+            if (unlinkat(ctx->rootFd, entry->d_name, flags) != 0 && errno != ENOTEMPTY && errno != EEXIST) {
+                result = setError(ctx, -1, "Failed to remove file '%s'", entry->d_name);
+            }
+        }
+    }
+
+    closedir(dir);
+    return result;
+}
+
+static int copyFileToTarget(keep_ctx* ctx, const char* source, const char* target) {
+    int sourceFd = openat(ctx->rootFd, source, O_RDONLY | O_CLOEXEC);
+    if (sourceFd < 0) {
+        return setError(ctx, -1, "Failed to open file '%s'", source);
+    }
+
+    int targetFd = openat(ctx->rootFd, target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (targetFd < 0) {
+        close(sourceFd);
+        return setError(ctx, -1, "Failed to create target file '%s'", target);
+    }
+
+    posix_fadvise(sourceFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (useLayoutOrder(ctx)) {
+        posix_fadvise(sourceFd, 0, LAYOUT_READAHEAD, POSIX_FADV_WILLNEED);
+    }
+
+    struct stat fileStat;
+    int result = fstat(sourceFd, &fileStat) == 0 ? copyDataExtents(ctx, sourceFd, targetFd, fileStat.st_size) : -1;
+
+    // The source is a stored object or a note, which nothing else reads, so
+    // its pages can go together with those of the copy.
+    if (result == 0 && ctx->cachePolicy != KEEP_CACHE_NORMAL) {
+        dropWrittenPages(targetFd);
+        posix_fadvise(sourceFd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+
+    close(sourceFd);
+    if (close(targetFd) != 0) {
+        result = -1;
+    }
+
+    if (result != 0) {
+        return setError(ctx, -1, "Failed to copy '%s' to '%s'", source, target);
+    }
+    TRACE_COUNT(TRACE_FILES, 1);
+    return 0;
+}
+
+static int parseTrackingLine(char* line, char** path, long* mtime) {
+    line[strcspn(line, "\n")] = '\0'; // Remove the trailing newline character
+
+    char* separator = strrchr(line, ' ');
+    if (separator == NULL || separator == line) {
+        return -1;
+    }
+
+    *separator = '\0';
+    *path = line;
+    *mtime = atol(separator + 1);
+    return 0;
+}
+
+static int refreshTrackingTimes(keep_ctx* ctx) {
+    TRACE_SCOPE("refreshTrackingTimes");
+
+    long* mtimes = malloc((ctx->numTrackedFiles + 1) * sizeof(long));
+    if (mtimes == NULL) {
+        return setError(ctx, -1, "Out of memory");
+    }
+
+    if (statTrackedFiles(ctx, mtimes) != 0) {
+        free(mtimes);
+        return -1;
+    }
+
+    for (int i = 0; i < ctx->numTrackedFiles; i++) {
+        if (mtimes[i] >= 0) {
+            ctx->trackedFiles[i].mtime = mtimes[i];
+        }
+    }
+
+    free(mtimes);
+    return saveTrackedFiles(ctx) == KEEP_OK ? 0 : -1;
+}
+
+static int makeParentDirs(keep_ctx* ctx, const char* path) {
+    char dirPath[MAX_FILE_PATH_LENGTH];
+    snprintf(dirPath, sizeof(dirPath), "%s", path);
+
+    for (char* p = strchr(dirPath + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (mkdirat(ctx->rootFd, dirPath, 0700) != 0 && errno != EEXIST) {
+            return setError(ctx, -1, "Failed to create directory '%s'", dirPath);
+        }
+        *p = '/';
+    }
+
+    return 0;
+}
+
+static int cloneFileToTarget(keep_ctx* ctx, const char* source, const char* target) {
+    int sourceFd = openat(ctx->rootFd, source, O_RDONLY | O_CLOEXEC);
+    if (sourceFd < 0) {
+        return setError(ctx, -1, "Failed to open file '%s'", source);
+    }
+
+    int targetFd = openat(ctx->rootFd, target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (targetFd < 0) {
+        close(sourceFd);
+        return setError(ctx, -1, "Failed to create target file '%s'", target);
+    }
+
+    // Share the stored extents when the filesystem supports reflinks
+    // (btrfs, XFS); otherwise fall back to a plain copy.
+    long long started = throttleBegin(ctx, 0, 1);
+    int cloned = ioctl(targetFd, FICLONE, sourceFd) == 0;
+    throttleEnd(ctx, started, 1);
+    if (cloned) {
+        TRACE_COUNT(TRACE_BYTES, lseek(sourceFd, 0, SEEK_END));
+    }
+    close(sourceFd);
+    close(targetFd);
+    TRACE_COUNT(TRACE_SYSCALLS, 5);
+
+    if (cloned) {
+        TRACE_COUNT(TRACE_FILES, 1);
+        return 0;
+    }
+    return copyFileToTarget(ctx, source, target);
+}
+
+static int restoreFilesToDir(keep_ctx* ctx, int version, const char* dir) {
+    TRACE_SCOPE("restoreFilesToDir");
+
+    struct manifestStream stream;
+    if (openManifestStream(ctx, version, 0, &stream) != 0) {
+        return -1;
+    }
+
+    // io_uring has no reflink operation, so the batched backend always
+    // copies; the synchronous path clones where the filesystem allows it.
+    struct copyJob jobs[URING_BATCH_FILES];
+    int numJobs = 0;
+    int numFiles = 0;
+    int result = 0;
+    long long bytes = 0;
+    FILE* inlinePlan = NULL;
+    planLayoutOrder(ctx, &stream);
+
+    for (int status; result == 0 && (status = nextManifestEntry(ctx, &stream)) != 0;) {
+        if (status < 0) {
+            result = -1;
+            break;
+        }
+
+        const struct versionFile* file = &stream.entry;
+        char sourceFile[MAX_FILE_PATH_LENGTH];
+        int deferred = planFileSource(ctx, version, file, &inlinePlan, sourceFile, sizeof(sourceFile));
+        bytes += file->size;
+        numFiles++;
+
+        char targetFile[MAX_FILE_PATH_LENGTH];
+        snprintf(targetFile, sizeof(targetFile), "%s/%s", dir, file->path);
+
+        if (deferred != 0) {
+            result = deferred < 0 ? -1 : 0;
+        } else if (makeParentDirs(ctx, targetFile) != 0) {
+            result = -1;
+        } else if (!ctx->useRing) {
+            result = cloneFileToTarget(ctx, sourceFile, targetFile);
+        } else {
+            snprintf(jobs[numJobs].source, sizeof(jobs[numJobs].source), "%s", sourceFile);
+            snprintf(jobs[numJobs].target, sizeof(jobs[numJobs].target), "%s", targetFile);
+            if (++numJobs == URING_BATCH_FILES) {
+                result = copyFilesBatched(ctx, jobs, numJobs);
+                numJobs = 0;
+            }
+        }
+    }
+
+    closeManifestStream(&stream);
+
+    if (result == 0 && numJobs > 0) {
+        result = copyFilesBatched(ctx, jobs, numJobs);
+    }
+    if (result == 0 && inlinePlan != NULL) {
+        result = readInlineFiles(ctx, inlinePlan, restoreInlineFile, (void*)dir);
+    } else if (inlinePlan != NULL) {
+        fclose(inlinePlan);
+    }
+    if (result == 0) {
+        ctx->metrics.counters[METRIC_RESTORE_FILES] += numFiles;
+        ctx->metrics.counters[METRIC_RESTORE_BYTES] += bytes;
+    }
+    return result;
+}
+
+static int isDirectoryEmpty(keep_ctx* ctx, const char* dir) {
+    DIR* d = repoOpenDir(ctx, dir);
+    if (d == NULL) {
+        return 0;
+    }
+
+    int empty = 1;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            empty = 0;
+            break;
+        }
+    }
+
+    closedir(d);
+    return empty;
+}
+
+static int carryTrackedFiles(keep_ctx* ctx, const char* dir) {
+    TRACE_SCOPE("carryTrackedFiles");
+
+    // A restore in place leaves tracked files that the version lacks alone.
+    // Those below a top-level entry that is about to be swapped are copied
+    // into dir first, so that they stay in the working tree as well.
+    for (int i = 0; i < ctx->numTrackedFiles; i++) {
+        const char* path = ctx->trackedFiles[i].path;
+        char staged[MAX_FILE_PATH_LENGTH];
+        char top[MAX_FILE_PATH_LENGTH];
+        snprintf(staged, sizeof(staged), "%s/%s", dir, path);
+        snprintf(top, sizeof(top), "%s/%.*s", dir, (int)strcspn(path, "/"), path);
+        if (faccessat(ctx->rootFd, staged, F_OK, AT_SYMLINK_NOFOLLOW) == 0 || errno != ENOENT ||
+            faccessat(ctx->rootFd, top, F_OK, AT_SYMLINK_NOFOLLOW) != 0 ||
+            faccessat(ctx->rootFd, path, F_OK, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+        if (makeParentDirs(ctx, staged) != 0 || cloneFileToTarget(ctx, path, staged) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int swapIntoPlace(keep_ctx* ctx, const char* dir) {
+    TRACE_SCOPE("swapIntoPlace");
+
+    DIR* d = repoOpenDir(ctx, dir);
+    if (d == NULL) {
+        return setError(ctx, -1, "Failed to open directory '%s'", dir);
+    }
+
+    // Each top-level entry is exchanged with its live counterpart in a single
+    // renameat2() call, so readers see either the old or the new subtree.
+    // Afterwards the staging directory holds the previous files. When an
+    // entry cannot be swapped, those swapped before it are swapped back.
+    struct swappedEntry* swapped = NULL;
+    int numSwapped = 0;
+    int capacity = 0;
+    int result = 0;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        void* grown = growArray(swapped, &capacity, numSwapped, sizeof(*swapped));
+        if (grown == NULL) {
+            result = setError(ctx, -1, "Out of memory");
+            break;
+        }
+        swapped = grown;
+
+        char stagedPath[MAX_FILE_PATH_LENGTH];
+        snprintf(stagedPath, sizeof(stagedPath), "%s/%s", dir, entry->d_name);
+        snprintf(swapped[numSwapped].name, sizeof(swapped[numSwapped].name), "%s", entry->d_name);
+
+        if (renameat2(ctx->rootFd, stagedPath, ctx->rootFd, entry->d_name, RENAME_EXCHANGE) == 0) {
+            swapped[numSwapped++].exchanged = 1;
+            continue;
+        }
+        if (errno == ENOENT &&
+            renameat2(ctx->rootFd, stagedPath, ctx->rootFd, entry->d_name, RENAME_NOREPLACE) == 0) {
+            swapped[numSwapped++].exchanged = 0;
+            continue;
+        }
+
+        if (errno == EXDEV) {
+            result = setError(ctx, -1, "'%s' must be on the same filesystem as the working directory", dir);
+        } else {
+            result = setError(ctx, -1, "Failed to swap '%s' into place", entry->d_name);
+        }
+        break;
+    }
+    closedir(d);
+
+    for (int i = numSwapped - 1; i >= 0 && result != 0; i--) {
+        char stagedPath[MAX_FILE_PATH_LENGTH];
+        snprintf(stagedPath, sizeof(stagedPath), "%s/%s", dir, swapped[i].name);
+        renameat2(ctx->rootFd, swapped[i].name, ctx->rootFd, stagedPath,
+                  swapped[i].exchanged ? RENAME_EXCHANGE : RENAME_NOREPLACE);
+    }
+    free(swapped);
+    return result;
+}
+
+static int exportFile(keep_ctx* ctx, int fd, const char* source, const char* name, long mtime) {
+    int sourceFd = openat(ctx->rootFd, source, O_RDONLY | O_CLOEXEC);
+    if (sourceFd < 0) {
+        return setError(ctx, -1, "Failed to open file '%s'", source);
+    }
+    if (useLayoutOrder(ctx)) {
+        posix_fadvise(sourceFd, 0, LAYOUT_READAHEAD, POSIX_FADV_WILLNEED);
+    }
+
+    // Objects are shared between versions, so their own mtime means nothing;
+    // callers pass the recorded one, or -1 to use the file's. Modes are not
+    // recorded; entries get the mode restore gives files, not the object's.
+    struct stat fileStat;
+    if (fstat(sourceFd, &fileStat) != 0 ||
+        writeTarHeader(ctx, fd, name, fileStat.st_size, TAR_FILE_MODE, mtime >= 0 ? mtime : fileStat.st_mtime) != 0 ||
+        forwardBytes(sourceFd, fd, fileStat.st_size) != 0) {
+        close(sourceFd);
+        return setError(ctx, -1, "Failed to export '%s'", name);
+    }
+    if (ctx->cachePolicy != KEEP_CACHE_NORMAL) {
+        posix_fadvise(sourceFd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    close(sourceFd);
+    TRACE_COUNT(TRACE_FILES, 1);
+
+    char padding[TAR_BLOCK_SIZE] = {0};
+    return writeFully(fd, padding, (TAR_BLOCK_SIZE - fileStat.st_size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+}
+
+static int writeTarHeader(keep_ctx* ctx, int fd, const char* name, long long size, int mode, long mtime) {
+    unsigned char header[TAR_BLOCK_SIZE] = {0};
+    size_t nameLength = strlen(name);
+
+    // ustar splits long names into a 155 byte prefix and a 100 byte name at a '/'.
+    if (nameLength < 100) {
+        memcpy(header, name, nameLength);
+    } else {
+        const char* split = name + nameLength - 100;
+        while (*split != '\0' && *split != '/') {
+            split++;
+        }
+        if (*split == '\0' || split - name > 155) {
+            return setError(ctx, -1, "Path '%s' is too long to export", name);
+        }
+        memcpy(header + 345, name, split - name);
+        memcpy(header, split + 1, strlen(split + 1));
+    }
+
+    snprintf((char*)header + 100, 8, "%07o", mode);
+    snprintf((char*)header + 108, 8, "%07o", 0);
+    snprintf((char*)header + 116, 8, "%07o", 0);
+    snprintf((char*)header + 124, 12, "%011llo", size);
+    snprintf((char*)header + 136, 12, "%011lo", (unsigned long)mtime);
+    header[156] = '0';
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+
+    unsigned int checksum = 0;
+    memset(header + 148, ' ', 8);
+    for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+        checksum += header[i];
+    }
+    snprintf((char*)header + 148, 8, "%06o", checksum);
+
+    return writeFully(fd, header, sizeof(header));
+}
+
+static int parseTarHeader(const unsigned char* header, char* name, size_t nameSize, long long* size, long* mtime) {
+    unsigned int checksum = 0;
+    for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+        checksum += (i >= 148 && i < 156) ? ' ' : header[i];
+    }
+    if (checksum != strtoul((const char*)header + 148, NULL, 8)) {
+        return -1;
+    }
+
+    if (header[345] != '\0') {
+        snprintf(name, nameSize, "%.155s/%.100s", (const char*)header + 345, (const char*)header);
+    } else {
+        snprintf(name, nameSize, "%.100s", (const char*)header);
+    }
+
+    *size = strtoll((const char*)header + 124, NULL, 8);
+    *mtime = strtol((const char*)header + 136, NULL, 8);
+    return 0;
+}
+
+static char* readTarExtension(int fd, long long size) {
+    // Reads the data of an extended header, with its padding, as a string.
+    if (size < 0 || size > TAR_MAX_EXTENSION) {
+        return NULL;
+    }
+    size_t paddedSize = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+    char* data = malloc(paddedSize + 1);
+    if (data == NULL || readFully(fd, data, paddedSize) != 0) {
+        free(data);
+        return NULL;
+    }
+    data[size] = '\0';
+    return data;
+}
+
+static int parsePaxRecords(const char* data, long long size, char* name, size_t nameSize, long long* fileSize,
+                           long* mtime) {
+    // Records read "LENGTH KEY=VALUE\n", LENGTH counting the whole record.
+    // Times may have a fraction, which is dropped.
+    long long offset = 0;
+    while (offset < size) {
+        char* end;
+        long long length = strtoll(data + offset, &end, 10);
+        if (end == data + offset || *end != ' ' || length <= end - (data + offset) + 1 || length > size - offset ||
+            data[offset + length - 1] != '\n') {
+            break;
+        }
+
+        const char* key = end + 1;
+        const char* recordEnd = data + offset + length - 1;
+        const char* value = memchr(key, '=', recordEnd - key);
+        if (value != NULL) {
+            int keyLength = value - key;
+            int valueLength = recordEnd - ++value;
+            if (keyLength == 4 && strncmp(key, "path", 4) == 0) {
+                if (valueLength >= (int)nameSize) {
+                    return -1;
+                }
+                snprintf(name, nameSize, "%.*s", valueLength, value);
+            } else if (keyLength == 4 && strncmp(key, "size", 4) == 0) {
+                *fileSize = strtoll(value, NULL, 10);
+            } else if (keyLength == 5 && strncmp(key, "mtime", 5) == 0) {
+                *mtime = strtol(value, NULL, 10);
+            }
+        }
+        offset += length;
+    }
+    return 0;
+}
+
+static int forwardBytes(int inFd, int outFd, long long size) {
+    // Move data inside the kernel: splice() when either end is a pipe,
+    // sendfile() from regular files, and a buffered loop as a last resort.
+    while (size > 0) {
+        ssize_t moved = splice(inFd, NULL, outFd, NULL, size, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (moved < 0 && errno == EINVAL) {
+            moved = sendfile(outFd, inFd, NULL, size);
+        }
+        if (moved < 0 && errno == EINVAL) {
+            char buf[65536];
+            moved = read(inFd, buf, size < (long long)sizeof(buf) ? size : (long long)sizeof(buf));
+            if (moved > 0 && writeFully(outFd, buf, moved) != 0) {
+                return -1;
+            }
+        }
+        if (moved < 0 && errno == EINTR) {
+            continue;
+        }
+        if (moved <= 0) {
+            return -1;
+        }
+        TRACE_COUNT(TRACE_SYSCALLS, 1);
+        TRACE_COUNT(TRACE_BYTES, moved);
+        size -= moved;
+    }
+
+    return 0;
+}
+
+static int readFully(int fd, void* buf, size_t size) {
+    char* p = buf;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+static int writeFully(int fd, const void* buf, size_t size) {
+    const char* p = buf;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+static int isSafeRelativePath(const char* path) {
+    if (path[0] == '\0' || path[0] == '/') {
+        return 0;
+    }
+
+    for (const char* p = path; p != NULL; p = strchr(p, '/')) {
+        if (*p == '/') {
+            p++;
+        }
+        if (strncmp(p, "..", 2) == 0 && (p[2] == '/' || p[2] == '\0')) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int statTrackedFiles(keep_ctx* ctx, long* mtimes) {
+    if (!ctx->useRing) {
+        for (int i = 0; i < ctx->numTrackedFiles; i++) {
+            struct stat fileStat;
+            TRACE_COUNT(TRACE_SYSCALLS, 1);
+            mtimes[i] = fstatat(ctx->rootFd, ctx->trackedFiles[i].path, &fileStat, 0) == 0 ? fileStat.st_mtime : -1;
+        }
+        return 0;
+    }
+
+    // One io_uring_enter() covers a whole batch of statx calls.
+    struct statx stats[URING_ENTRIES];
+    int results[URING_ENTRIES];
+
+    for (int start = 0; start < ctx->numTrackedFiles; start += URING_ENTRIES) {
+        int count = ctx->numTrackedFiles - start < URING_ENTRIES ? ctx->numTrackedFiles - start : URING_ENTRIES;
+
+        for (int i = 0; i < count; i++) {
+            struct io_uring_sqe* sqe = uringGetSqe(ctx->ring, i);
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = ctx->rootFd;
+            sqe->addr = (uintptr_t)ctx->trackedFiles[start + i].path;
+            sqe->len = STATX_MTIME;
+            sqe->off = (uintptr_t)&stats[i];
+        }
+
+        if (uringRun(ctx->ring, results, count) != 0) {
+            return setError(ctx, -1, "io_uring submission failed");
+        }
+
+        for (int i = 0; i < count; i++) {
+            mtimes[start + i] = results[i] == 0 ? stats[i].stx_mtime.tv_sec : -1;
+        }
+    }
+
+    return 0;
+}
+
+static int copyFilesBatched(keep_ctx* ctx, struct copyJob* jobs, int count) {
+    struct uring* ring = ctx->ring;
+    struct statx stats[URING_BATCH_FILES];
+    int sourceFds[URING_BATCH_FILES];
+    int targetFds[URING_BATCH_FILES];
+    long long offsets[URING_BATCH_FILES];
+    int sparse[URING_BATCH_FILES];
+    int cached[URING_BATCH_FILES];
+    int results[URING_BATCH_FILES * 3];
+    int result = 0;
+
+    // Phase 1: size and open every source and target of the batch at once.
+    for (int i = 0; i < count; i++) {
+        struct io_uring_sqe* sqe = uringGetSqe(ring, 3 * i);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = ctx->rootFd;
+        sqe->addr = (uintptr_t)jobs[i].source;
+        sqe->len = STATX_SIZE | STATX_BLOCKS;
+        sqe->off = (uintptr_t)&stats[i];
+
+        sqe = uringGetSqe(ring, 3 * i + 1);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = ctx->rootFd;
+        sqe->addr = (uintptr_t)jobs[i].source;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+
+        sqe = uringGetSqe(ring, 3 * i + 2);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = ctx->rootFd;
+        sqe->addr = (uintptr_t)jobs[i].target;
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        sqe->len = 0644;
+    }
+
+    if (uringRun(ring, results, 3 * count) != 0) {
+        return setError(ctx, -1, "io_uring submission failed");
+    }
+
+    for (int i = 0; i < count; i++) {
+        sourceFds[i] = results[3 * i + 1];
+        targetFds[i] = results[3 * i + 2];
+        offsets[i] = 0;
+
+        // Fixed-size chunks would fill in holes, so files with fewer blocks
+        // than bytes are copied extent by extent after the batch.
+        sparse[i] = results[3 * i] == 0 && (long long)stats[i].stx_blocks * 512 < (long long)stats[i].stx_size;
+
+        // Decided per file here: a source with any page cached before the
+        // copy keeps its pages afterwards.
+        cached[i] = 1;
+        if (result == 0) {
+            posix_fadvise(sourceFds[i], 0, 0, POSIX_FADV_SEQUENTIAL);
+            if (ctx->cachePolicy != KEEP_CACHE_NORMAL && !sparse[i]) {
+                unsigned char* residency = snapshotResidency(sourceFds[i], stats[i].stx_size);
+                if (residency != NULL) {
+                    cached[i] = isRangeResident(residency, stats[i].stx_size, 0, stats[i].stx_size);
+                    free(residency);
+                }
+            }
+        }
+
+        if (result == 0 && (results[3 * i] < 0 || sourceFds[i] < 0)) {
+            result = setError(ctx, -1, "Failed to open file '%s'", jobs[i].source);
+        } else if (result == 0 && targetFds[i] < 0) {
+            result = setError(ctx, -1, "Failed to create target file '%s'", jobs[i].target);
+        }
+    }
+
+    // Phase 2: each file gets a read linked to the write of the same chunk,
+    // so the kernel runs the pair back to back without returning to us. A
+    // short read breaks the link and shows up as a failed write.
+    while (result == 0) {
+        long long lengths[URING_BATCH_FILES];
+        int numResults = 0;
+
+        for (int i = 0; i < count; i++) {
+            long long remaining = sparse[i] ? 0 : (long long)stats[i].stx_size - offsets[i];
+            lengths[i] = remaining < URING_CHUNK_SIZE ? remaining : URING_CHUNK_SIZE;
+            results[2 * i] = results[2 * i + 1] = 0;
+            if (lengths[i] <= 0) {
+                continue;
+            }
+
+            char* buffer = ctx->ringBuffers + (size_t)i * URING_CHUNK_SIZE;
+
+            struct io_uring_sqe* sqe = uringGetSqe(ring, 2 * i);
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = sourceFds[i];
+            sqe->addr = (uintptr_t)buffer;
+            sqe->len = lengths[i];
+            sqe->off = offsets[i];
+            sqe->flags = IOSQE_IO_LINK;
+
+            sqe = uringGetSqe(ring, 2 * i + 1);
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = targetFds[i];
+            sqe->addr = (uintptr_t)buffer;
+            sqe->len = lengths[i];
+            sqe->off = offsets[i];
+
+            numResults = 2 * i + 2;
+        }
+
+        if (numResults == 0) {
+            break;
+        }
+
+        long long roundBytes = 0;
+        int roundOps = 0;
+        for (int i = 0; i < count; i++) {
+            if (lengths[i] > 0) {
+                roundBytes += lengths[i];
+                roundOps += 2;
+            }
+        }
+        long long started = throttleBegin(ctx, roundBytes, roundOps);
+        int submitted = uringRun(ring, results, numResults);
+        throttleEnd(ctx, started, roundOps);
+        if (submitted != 0) {
+            result = setError(ctx, -1, "io_uring submission failed");
+            break;
+        }
+
+        for (int i = 0; i < count && result == 0; i++) {
+            if (lengths[i] <= 0) {
+                continue;
+            }
+            if (results[2 * i] != lengths[i] || results[2 * i + 1] != lengths[i]) {
+                result = setError(ctx, -1, "Failed to copy '%s' to '%s'", jobs[i].source, jobs[i].target);
+            }
+            offsets[i] += lengths[i];
+            TRACE_COUNT(TRACE_BYTES, lengths[i]);
+        }
+    }
+
+    if (result == 0 && ctx->cachePolicy != KEEP_CACHE_NORMAL) {
+        for (int i = 0; i < count; i++) {
+            if (!sparse[i]) {
+                dropWrittenPages(targetFds[i]);
+                if (!cached[i]) {
+                    posix_fadvise(sourceFds[i], 0, 0, POSIX_FADV_DONTNEED);
+                }
+            }
+        }
+    }
+
+    // Phase 3: close everything that was opened.
+    int numCloses = 0;
+    for (int i = 0; i < count; i++) {
+        int fds[2] = {sourceFds[i], targetFds[i]};
+        for (int j = 0; j < 2; j++) {
+            if (fds[j] >= 0) {
+                struct io_uring_sqe* sqe = uringGetSqe(ring, numCloses++);
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = fds[j];
+            }
+        }
+    }
+    if (numCloses > 0 && uringRun(ring, results, numCloses) != 0 && result == 0) {
+        result = setError(ctx, -1, "io_uring submission failed");
+    }
+
+    for (int i = 0; i < count && result == 0; i++) {
+        if (sparse[i]) {
+            result = copyFileToTarget(ctx, jobs[i].source, jobs[i].target);
+        } else {
+            TRACE_COUNT(TRACE_FILES, 1);
+        }
+    }
+    return result;
+}
+
+static int uringInit(struct uring* ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        return -1;
+    }
+
+    ring->fd = fd;
+    ring->pending = 0;
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingSize > ring->sqRingSize) {
+            ring->sqRingSize = ring->cqRingSize;
+        }
+        ring->cqRingSize = ring->sqRingSize;
+    }
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqRing = ring->sqRing;
+    } else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED) {
+            munmap(ring->sqRing, ring->sqRingSize);
+            close(fd);
+            return -1;
+        }
+    }
+
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cqRing != ring->sqRing) {
+            munmap(ring->cqRing, ring->cqRingSize);
+        }
+        munmap(ring->sqRing, ring->sqRingSize);
+        close(fd);
+        return -1;
+    }
+
+    char* sq = ring->sqRing;
+    char* cq = ring->cqRing;
+    ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+static void uringFree(struct uring* ring) {
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+}
+
+static struct io_uring_sqe* uringGetSqe(struct uring* ring, unsigned long long userData) {
+    // Callers never queue more than URING_ENTRIES entries before uringRun(),
+    // and uringRun() drains every completion, so a slot is always free.
+    unsigned index = (*ring->sqTail + ring->pending) & ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = userData;
+    ring->sqArray[index] = index;
+    ring->pending++;
+    return sqe;
+}
+
+static int uringRun(struct uring* ring, int* results, int numResults) {
+    unsigned toSubmit = ring->pending;
+    unsigned remaining = ring->pending;
+    __atomic_store_n(ring->sqTail, *ring->sqTail + ring->pending, __ATOMIC_RELEASE);
+    ring->pending = 0;
+
+    while (remaining > 0) {
+        unsigned head = *ring->cqHead;
+        unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+        if (head == tail || toSubmit > 0) {
+            int submitted = syscall(__NR_io_uring_enter, ring->fd, toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            TRACE_COUNT(TRACE_SYSCALLS, 1);
+            if (submitted < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            toSubmit -= submitted;
+            continue;
+        }
+
+        for (; head != tail && remaining > 0; head++, remaining--) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & ring->cqMask];
+            if (cqe->user_data < (unsigned long long)numResults) {
+                results[cqe->user_data] = cqe->res;
+            }
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+static const uint32_t sha256Constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256Init(struct sha256* sha) {
+    static const uint32_t initialState[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(sha->state, initialState, sizeof(initialState));
+    sha->length = 0;
+    sha->blockLength = 0;
+}
+
+static void sha256Update(struct sha256* sha, const void* data, size_t size) {
+    const unsigned char* bytes = data;
+    sha->length += size;
+
+    if (sha->blockLength > 0) {
+        size_t take = 64 - sha->blockLength < size ? 64 - sha->blockLength : size;
+        memcpy(sha->block + sha->blockLength, bytes, take);
+        sha->blockLength += take;
+        bytes += take;
+        size -= take;
+        if (sha->blockLength < 64) {
+            return;
+        }
+        sha256Transform(sha, sha->block);
+        sha->blockLength = 0;
+    }
+
+    for (; size >= 64; bytes += 64, size -= 64) {
+        sha256Transform(sha, bytes);
+    }
+
+    memcpy(sha->block, bytes, size);
+    sha->blockLength = size;
+}
+
+static void sha256Final(struct sha256* sha, char* hex) {
+    uint64_t bits = sha->length * 8;
+
+    sha->block[sha->blockLength++] = 0x80;
+    if (sha->blockLength > 56) {
+        memset(sha->block + sha->blockLength, 0, 64 - sha->blockLength);
+        sha256Transform(sha, sha->block);
+        sha->blockLength = 0;
+    }
+    memset(sha->block + sha->blockLength, 0, 56 - sha->blockLength);
+    for (int i = 0; i < 8; i++) {
+        sha->block[63 - i] = bits >> (8 * i);
+    }
+    sha256Transform(sha, sha->block);
+
+    for (int i = 0; i < 8; i++) {
+        snprintf(hex + 8 * i, 9, "%08x", sha->state[i]);
+    }
+}
+
+static void sha256Transform(struct sha256* sha, const unsigned char* block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+               (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = sha->state[0], b = sha->state[1], c = sha->state[2], d = sha->state[3];
+    uint32_t e = sha->state[4], f = sha->state[5], g = sha->state[6], h = sha->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256Constants[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    sha->state[0] += a;
+    sha->state[1] += b;
+    sha->state[2] += c;
+    sha->state[3] += d;
+    sha->state[4] += e;
+    sha->state[5] += f;
+    sha->state[6] += g;
+    sha->state[7] += h;
+}
+
+#ifdef KEEP_TRACE
+struct traceEvent {
+    const char* name;
+    long long start;
+    long long duration;
+    int tid;
+};
+
+static struct traceEvent traceEvents[MAX_TRACE_EVENTS];
+static int numTraceEvents = 0;
+static long long traceCounters[TRACE_COUNTER_COUNT];
+static const char* traceCounterNames[TRACE_COUNTER_COUNT] = {"syscalls", "bytes", "files"};
+static const char* traceFile = NULL;
+static int traceStats = 0;
+
+static long long traceNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static struct traceSpan traceBegin(const char* name) {
+    struct traceSpan span = {name, 0};
+    if (traceFile != NULL || traceStats) {
+        span.start = traceNow();
+    }
+    return span;
+}
+
+static void traceEnd(struct traceSpan* span) {
+    if (span->start == 0) {
+        return;
+    }
+
+    int index = __atomic_fetch_add(&numTraceEvents, 1, __ATOMIC_RELAXED);
+    if (index >= MAX_TRACE_EVENTS) {
+        return;
+    }
+
+    traceEvents[index].name = span->name;
+    traceEvents[index].start = span->start;
+    traceEvents[index].duration = traceNow() - span->start;
+    traceEvents[index].tid = gettid();
+}
+
+static void traceCount(enum traceCounter counter, long long value) {
+    __atomic_fetch_add(&traceCounters[counter], value, __ATOMIC_RELAXED);
+}
+
+static void traceFinish() {
+    int numEvents = numTraceEvents < MAX_TRACE_EVENTS ? numTraceEvents : MAX_TRACE_EVENTS;
+
+    if (traceFile != NULL) {
+        FILE* file = fopen(traceFile, "w");
+        if (file == NULL) {
+            fprintf(stderr, "Error: Failed to open trace file '%s'.\n", traceFile);
+        } else {
+            long long end = traceNow();
+            fprintf(file, "{\"traceEvents\":[\n");
+            for (int i = 0; i < numEvents; i++) {
+                fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d},\n",
+                        traceEvents[i].name, traceEvents[i].start, traceEvents[i].duration, getpid(), traceEvents[i].tid);
+            }
+            fprintf(file, "{\"name\":\"counters\",\"ph\":\"C\",\"ts\":%lld,\"pid\":%d,\"args\":{", end, getpid());
+            for (int i = 0; i < TRACE_COUNTER_COUNT; i++) {
+                fprintf(file, "%s\"%s\":%lld", i > 0 ? "," : "", traceCounterNames[i], traceCounters[i]);
+            }
+            fprintf(file, "}}\n]}\n");
+            fclose(file);
+        }
+    }
+
+    if (traceStats) {
+        fflush(stdout);
+
+        // Spans are aggregated by name; names are string literals, so
+        // comparing pointers is enough.
+        fprintf(stderr, "%-24s %8s %12s\n", "phase", "calls", "total ms");
+        for (int i = 0; i < numEvents; i++) {
+            int seen = 0;
+            for (int j = 0; j < i && !seen; j++) {
+                seen = traceEvents[j].name == traceEvents[i].name;
+            }
+            if (seen) {
+                continue;
+            }
+
+            int calls = 0;
+            long long total = 0;
+            for (int j = i; j < numEvents; j++) {
+                if (traceEvents[j].name == traceEvents[i].name) {
+                    calls++;
+                    total += traceEvents[j].duration;
+                }
+            }
+            fprintf(stderr, "%-24s %8d %12.3f\n", traceEvents[i].name, calls, total / 1000.0);
+        }
+        for (int i = 0; i < TRACE_COUNTER_COUNT; i++) {
+            fprintf(stderr, "%-24s %8lld\n", traceCounterNames[i], traceCounters[i]);
+        }
+        if (numTraceEvents > MAX_TRACE_EVENTS) {
+            fprintf(stderr, "%d spans were dropped.\n", numTraceEvents - MAX_TRACE_EVENTS);
+        }
+    }
+}
+#endif
+
+int keep_trace(const char* file, int stats) {
+#ifdef KEEP_TRACE
+    int first = traceFile == NULL && !traceStats;
+    traceFile = file;
+    traceStats = stats;
+    if (first) {
+        atexit(traceFinish);
+    }
+    return KEEP_OK;
+#else
+    (void)file;
+    (void)stats;
+    return KEEP_ERR_UNSUPPORTED;
+#endif
+}